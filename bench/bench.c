@@ -0,0 +1,344 @@
+// Runs au3 scripts as benchmarks and reports them as JSON, optionally
+// against a baseline written by an earlier run.
+//
+//   gcc -O2 bench.c -o bench
+//   ./bench -o base.json ../au3 *.au3
+//   ./bench [-n runs] [-b base.json] [-t percent] [-o out.json] ../au3 *.au3
+//
+// Every script runs once to warm up and then (runs) times with its
+// output discarded. Wall time is given as median and p95, peak RSS is
+// the largest of the runs and instructions retired, where perf events
+// are available, the median of user space counts. A benchmark whose
+// median time, or instruction count when both sides have one, grows
+// by more than (percent) over the baseline is a regression and makes
+// the exit status 1.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#define RUNS_DEFAULT        10
+#define THRESHOLD_DEFAULT   5.0
+
+typedef struct {
+    char name[64];
+    double median;
+    double p95;
+    int64_t instructions;
+    long maxRss;
+    bool failed;
+} result_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int compareInt(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Counts user space instructions of (pid) once it calls exec, -1 when
+// perf events are not available.
+static int openCounter(pid_t pid)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+// One run of (script), returns false if it could not run or failed.
+static bool runOnce(const char *au3, const char *script, double *seconds,
+    int64_t *instructions, long *maxRss)
+{
+    int gate[2];
+    if (pipe(gate) != 0) return false;
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+
+    if (pid == 0) {
+        // Waits for the counter to be attached before starting.
+        char c;
+        close(gate[1]);
+        if (read(gate[0], &c, 1) != 1) _exit(127);
+        close(gate[0]);
+
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+
+        execl(au3, au3, script, (char *)NULL);
+        _exit(127);
+    }
+
+    close(gate[0]);
+    int counter = openCounter(pid);
+
+    double start = now();
+    if (write(gate[1], "", 1) != 1) kill(pid, SIGKILL);
+    close(gate[1]);
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) ;
+    *seconds = now() - start;
+
+    *instructions = -1;
+    if (counter >= 0) {
+        uint64_t count;
+        if (read(counter, &count, sizeof(count)) == sizeof(count)) *instructions = (int64_t)count;
+        close(counter);
+    }
+
+    *maxRss = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void scriptName(char *dest, size_t size, const char *script)
+{
+    const char *s = strrchr(script, '/');
+    s = s != NULL ? s + 1 : script;
+
+    size_t length = strlen(s);
+    if (length > 4 && strcmp(s + length - 4, ".au3") == 0) length -= 4;
+    if (length >= size) length = size - 1;
+
+    memcpy(dest, s, length);
+    dest[length] = '\0';
+}
+
+static result_t runScript(const char *au3, const char *script, int runs)
+{
+    result_t result;
+    memset(&result, 0, sizeof(result));
+    scriptName(result.name, sizeof(result.name), script);
+
+    double *times = malloc(runs * sizeof(double));
+    int64_t *counts = malloc(runs * sizeof(int64_t));
+    double seconds;
+    int64_t instructions;
+    long rss;
+
+    result.failed = !runOnce(au3, script, &seconds, &instructions, &rss);
+
+    for (int i = 0; i < runs && !result.failed; i++) {
+        result.failed = !runOnce(au3, script, &times[i], &counts[i], &rss);
+        if (rss > result.maxRss) result.maxRss = rss;
+    }
+
+    if (!result.failed) {
+        qsort(times, runs, sizeof(double), compareDouble);
+        qsort(counts, runs, sizeof(int64_t), compareInt);
+
+        int p95 = (runs * 95 + 99) / 100 - 1;
+        result.median = times[runs / 2] * 1e3;
+        result.p95 = times[p95] * 1e3;
+        result.instructions = counts[runs / 2];
+    }
+
+    free(times);
+    free(counts);
+    return result;
+}
+
+static void printResults(FILE *out, const result_t *results, int count, int runs)
+{
+    fprintf(out, "{\n  \"runs\": %d,\n  \"benchmarks\": [\n", runs);
+
+    for (int i = 0; i < count; i++) {
+        const result_t *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", ", r->name);
+        if (r->failed) {
+            fprintf(out, "\"failed\": true}");
+        }
+        else {
+            fprintf(out, "\"median_ms\": %.3f, \"p95_ms\": %.3f, \"instructions\": ",
+                r->median, r->p95);
+            if (r->instructions < 0) fprintf(out, "null");
+            else fprintf(out, "%lld", (long long)r->instructions);
+            fprintf(out, ", \"max_rss_kb\": %ld}", r->maxRss);
+        }
+        fprintf(out, "%s\n", i + 1 < count ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
+
+static char *readAll(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char *buffer = malloc(size + 1);
+    size_t length = fread(buffer, 1, size, file);
+    buffer[length] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+// Finds the field (key) of benchmark (name) in a file printResults()
+// wrote, the entry of every benchmark sits on one line.
+static bool baselineField(const char *baseline, const char *name, const char *key, double *value)
+{
+    char pattern[96];
+    snprintf(pattern, sizeof(pattern), "{\"name\": \"%s\",", name);
+
+    const char *entry = strstr(baseline, pattern);
+    if (entry == NULL) return false;
+
+    const char *end = strchr(entry, '}');
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+
+    const char *field = strstr(entry, pattern);
+    if (field == NULL || field > end) return false;
+
+    char *stop;
+    *value = strtod(field + strlen(pattern), &stop);
+    return stop != field + strlen(pattern);
+}
+
+// A baseline of zero or less, or a field that did not parse, has no
+// percentage to compare against and is only reported.
+static bool regressed(const char *name, const char *what, double base, double current,
+    double threshold)
+{
+    if (!(base > 0)) {
+        fprintf(stderr, "  %-12s %-13s %14.3f -> %14.3f  no usable baseline\n", name, what,
+            base, current);
+        return false;
+    }
+
+    double change = (current - base) / base * 100;
+    bool worse = change > threshold;
+
+    fprintf(stderr, "  %-12s %-13s %14.3f -> %14.3f %+7.2f%%%s\n", name, what, base, current,
+        change, worse ? "  REGRESSION" : "");
+    return worse;
+}
+
+static int compare(const char *path, const result_t *results, int count, double threshold)
+{
+    char *baseline = readAll(path);
+    if (baseline == NULL) {
+        fprintf(stderr, "Could not read baseline \"%s\".\n", path);
+        return 2;
+    }
+
+    int regressions = 0;
+    fprintf(stderr, "against %s, threshold %.1f%%\n", path, threshold);
+
+    for (int i = 0; i < count; i++) {
+        const result_t *r = &results[i];
+        double base;
+
+        if (r->failed) {
+            fprintf(stderr, "  %-12s failed\n", r->name);
+            regressions++;
+            continue;
+        }
+
+        if (baselineField(baseline, r->name, "median_ms", &base) &&
+            regressed(r->name, "median_ms", base, r->median, threshold)) regressions++;
+
+        if (r->instructions >= 0 &&
+            baselineField(baseline, r->name, "instructions", &base) &&
+            regressed(r->name, "instructions", base, (double)r->instructions, threshold)) regressions++;
+    }
+
+    free(baseline);
+    return regressions > 0 ? 1 : 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: bench [-n runs] [-b baseline.json] [-t percent] "
+        "[-o out.json] au3 script...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int runs = RUNS_DEFAULT;
+    double threshold = THRESHOLD_DEFAULT;
+    const char *baseline = NULL;
+    const char *output = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:t:o:")) != -1) {
+        switch (opt) {
+            case 'n': runs = atoi(optarg); break;
+            case 'b': baseline = optarg; break;
+            case 't': threshold = atof(optarg); break;
+            case 'o': output = optarg; break;
+            default: usage();
+        }
+    }
+
+    if (runs < 1 || argc - optind < 2) usage();
+
+    const char *au3 = argv[optind];
+    int count = argc - optind - 1;
+    result_t *results = malloc(count * sizeof(result_t));
+
+    for (int i = 0; i < count; i++) {
+        results[i] = runScript(au3, argv[optind + 1 + i], runs);
+        fprintf(stderr, "%-12s %s\n", results[i].name, results[i].failed ? "failed" : "done");
+    }
+
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "Could not open \"%s\".\n", output);
+        return 2;
+    }
+
+    printResults(out, results, count, runs);
+    if (out != stdout) fclose(out);
+
+    int status = baseline != NULL ? compare(baseline, results, count, threshold) : 0;
+    free(results);
+    return status;
+}
@@ -0,0 +1,78 @@
+// Request style invocations with and without a region around each.
+//
+//   gcc -O2 -I../src region_bench.c ../src/lib_string.c $(ls ../src/*.c | grep -v 'main.c\|lib_') -lm -o region_bench
+//   ./region_bench [requests] [handler]
+//
+// The handler in region/handler.au3 is called (requests) times, 3000
+// by default, first in the heap and then in a region each. "handle"
+// leaves nothing behind, "leak" keeps part of every call in globals so
+// it has to be copied out when the region closes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "libs.h"
+#include "object.h"
+#include "gc.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool call(vm_t *vm, val_t callee, int n)
+{
+    val_t *base = vm->top;
+    vm_push(vm, callee);
+    vm_push(vm, VAL_INT(n));
+    bool ok = vm_call(vm, callee, 1) && vm_execute(vm) == VM_OK;
+    vm->top = base;
+    return ok;
+}
+
+static bool run(const char *handler, int requests, bool regions)
+{
+    vm_t *vm = vm_create();
+    load_libstring(vm);
+
+    val_t callee = VAL_NULL;
+    if (vm_dofile(vm, "region/handler.au3") != VM_OK
+        || !tab_get(vm->globals, str_copy(vm, handler, (int)strlen(handler), true), &callee)) {
+        fprintf(stderr, "Could not load handler \"%s\".\n", handler);
+        vm_close(vm);
+        return false;
+    }
+
+    gc_t *gc = vm->gc;
+    long moved = 0;
+    double start = now();
+
+    for (int i = 0; i < requests; i++) {
+        if (regions) gc_region_open(gc);
+        if (!call(vm, callee, i)) {
+            vm_close(vm);
+            return false;
+        }
+        if (regions) moved += gc_region_close(gc);
+    }
+
+    printf("  %-10s %10.1f %12llu %10ld %12zu\n", regions ? "region" : "heap", (now() - start) * 1000,
+        (unsigned long long)gc->stats.collections, moved, gc->allocated);
+    vm_close(vm);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int requests = argc > 1 ? atoi(argv[1]) : 3000;
+    const char *handler = argc > 2 ? argv[2] : "handle";
+
+    printf("%d calls of %s %9s %12s %10s %12s\n", requests, handler, "ms", "collections", "copied", "heap");
+    if (!run(handler, requests, false) || !run(handler, requests, true)) return 1;
+    return 0;
+}
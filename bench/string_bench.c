@@ -0,0 +1,98 @@
+// Byte scanning kernels against the naive loops they replace.
+//
+//   gcc -O2 -I../src string_bench.c ../src/strscan.c -o string_bench
+//   ./string_bench [megabytes]
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "strscan.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *naiveFind(const char *s, size_t n, const char *p, size_t m, bool ignorecase)
+{
+    for (size_t i = 0; i + m <= n; i++) {
+        size_t j = 0;
+        while (j < m && (ignorecase
+            ? tolower((unsigned char)s[i + j]) == tolower((unsigned char)p[j])
+            : s[i + j] == p[j])) j++;
+        if (j == m) return s + i;
+    }
+    return NULL;
+}
+
+static void naiveUpper(char *dest, const char *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) dest[i] = (char)toupper((unsigned char)src[i]);
+}
+
+typedef const char *(*find_fn)(const char *, size_t, const char *, size_t, bool);
+
+static size_t countAll(find_fn find, const char *s, size_t n, const char *p, bool ignorecase)
+{
+    size_t m = strlen(p), count = 0;
+    for (const char *at = s; (at = find(at, s + n - at, p, m, ignorecase)) != NULL; at += m) {
+        count++;
+    }
+    return count;
+}
+
+static void run(const char *label, find_fn find, const char *s, size_t n,
+    const char *p, bool ignorecase)
+{
+    double start = now();
+    size_t count = countAll(find, s, n, p, ignorecase);
+    double seconds = now() - start;
+    printf("  %-28s %8zu hits %9.2f MB/s\n", label, count, n / seconds / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = (argc > 1 ? (size_t)atoi(argv[1]) : 64) << 20;
+    char *text = malloc(size);
+    char *dest = malloc(size);
+
+    // Mostly lowercase words, a needle every 64 KiB or so.
+    srand(42);
+    for (size_t i = 0; i < size; i++) {
+        int r = rand() % 32;
+        text[i] = r < 26 ? 'a' + r : r < 30 ? ' ' : 'E';
+    }
+    for (size_t i = 65536; i + 16 < size; i += 65536) memcpy(text + i, "Needle-In-Hay", 13);
+
+    printf("%zu MB, kernels: %s\n", size >> 20, scan_name());
+
+    struct { const char *pattern; bool ignorecase; } cases[] = {
+        { "Needle-In-Hay", false },
+        { "needle-in-hay", true },
+        { ",", false },
+        { "ee", false },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        printf("find \"%s\"%s\n", cases[i].pattern, cases[i].ignorecase ? " ignorecase" : "");
+        run("naive", naiveFind, text, size, cases[i].pattern, cases[i].ignorecase);
+        run("scan_find", scan_find, text, size, cases[i].pattern, cases[i].ignorecase);
+    }
+
+    printf("upper\n");
+    double start = now();
+    naiveUpper(dest, text, size);
+    printf("  %-28s %9.2f MB/s\n", "naive", size / (now() - start) / 1e6);
+    start = now();
+    scan_upper(dest, text, size);
+    printf("  %-28s %9.2f MB/s\n", "scan_upper", size / (now() - start) / 1e6);
+
+    free(text);
+    free(dest);
+    return 0;
+}
@@ -0,0 +1,360 @@
+// Table, integer hash and string interning workloads in isolation.
+//
+//   gcc -O2 -I../src table_bench.c $(ls ../src/*.c | grep -v 'main.c\|lib_') -lm -o table_bench
+//   ./table_bench [cpu]
+//
+// The process is pinned to (cpu), 0 by default. Every case runs once
+// to warm up and then REPEATS times. The min and median are printed as
+// cycles per operation, from the time stamp counter on x86 and from
+// nanoseconds elsewhere. The collector is held off so only the
+// structures are measured.
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UNIT    "cycles/op"
+#else
+#define UNIT    "ns/op"
+#endif
+
+#include "vm.h"
+#include "object.h"
+#include "table.h"
+#include "hash.h"
+
+#define REPEATS     9
+#define PROBES      (1 << 16)
+
+typedef struct {
+    vm_t *vm;
+    int size;
+    int round;
+    str_t **keys;       // (size) keys in the table
+    str_t **others;     // (size) keys never inserted
+    str_t **probes;     // PROBES lookups at the current hit ratio
+    int64_t *intProbes; // PROBES integer keys below (size)
+    char **names;       // (size) unique names per round for misses
+    int nameLength;
+} ctx_t;
+
+typedef uint64_t (*case_fn)(ctx_t *ctx, int *ops);
+
+// Keeps lookups that only count hits from being optimized out.
+static volatile int found;
+
+static inline uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+static uint64_t rnd(void)
+{
+    static uint64_t state = 0x9E3779B97F4A7C15ull;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void measure(const char *label, case_fn fn, ctx_t *ctx)
+{
+    double samples[REPEATS];
+    int ops;
+
+    ctx->round = 0;
+    fn(ctx, &ops);
+
+    for (int i = 0; i < REPEATS; i++) {
+        ctx->round = i + 1;
+        uint64_t elapsed = fn(ctx, &ops);
+        samples[i] = (double)elapsed / ops;
+    }
+
+    qsort(samples, REPEATS, sizeof(double), compareDouble);
+    printf("  %-32s %10.1f %10.1f\n", label, samples[0], samples[REPEATS / 2]);
+}
+
+static str_t *makeKey(vm_t *vm, const char *prefix, int i, int length)
+{
+    char buffer[128];
+    int n = snprintf(buffer, sizeof(buffer), "%s%d_", prefix, i);
+    for (; n < length; n++) buffer[n] = 'a' + n % 26;
+    return str_copy(vm, buffer, length > n ? length : n, false);
+}
+
+static void fill(tab_t *table, str_t **keys, int count)
+{
+    tab_init(table);
+    for (int i = 0; i < count; i++) tab_set(NULL, table, keys[i], VAL_INT(i));
+}
+
+static void setProbes(ctx_t *ctx, int hitPercent)
+{
+    for (int i = 0; i < PROBES; i++) {
+        int k = (int)(rnd() % ctx->size);
+        ctx->probes[i] = (int)(rnd() % 100) < hitPercent ? ctx->keys[k] : ctx->others[k];
+    }
+}
+
+static uint64_t caseSet(ctx_t *ctx, int *ops)
+{
+    tab_t table;
+    tab_init(&table);
+
+    uint64_t start = ticks();
+    for (int i = 0; i < ctx->size; i++) tab_set(NULL, &table, ctx->keys[i], VAL_INT(i));
+    uint64_t elapsed = ticks() - start;
+
+    tab_free(NULL, &table);
+    *ops = ctx->size;
+    return elapsed;
+}
+
+static uint64_t caseGet(ctx_t *ctx, int *ops)
+{
+    tab_t table;
+    fill(&table, ctx->keys, ctx->size);
+
+    val_t value;
+    uint64_t start = ticks();
+    for (int i = 0; i < PROBES; i++) found += tab_get(&table, ctx->probes[i], &value);
+    uint64_t elapsed = ticks() - start;
+
+    tab_free(NULL, &table);
+    *ops = PROBES;
+    return elapsed;
+}
+
+static uint64_t caseRemove(ctx_t *ctx, int *ops)
+{
+    tab_t table;
+    fill(&table, ctx->keys, ctx->size);
+
+    uint64_t start = ticks();
+    for (int i = 0; i < ctx->size; i++) tab_remove(&table, ctx->keys[i]);
+    uint64_t elapsed = ticks() - start;
+
+    tab_free(NULL, &table);
+    *ops = ctx->size;
+    return elapsed;
+}
+
+// A sliding window: each step removes the oldest key and inserts a new
+// one, so tombstones pile up until a resize clears them.
+static uint64_t caseChurn(ctx_t *ctx, int *ops)
+{
+    tab_t table;
+    fill(&table, ctx->keys, ctx->size);
+
+    uint64_t start = ticks();
+    for (int i = 0; i < ctx->size; i++) {
+        tab_remove(&table, ctx->keys[i]);
+        tab_set(NULL, &table, ctx->others[i], VAL_INT(i));
+    }
+    uint64_t elapsed = ticks() - start;
+
+    tab_free(NULL, &table);
+    *ops = ctx->size * 2;
+    return elapsed;
+}
+
+// Hits after the churn, probing through the tombstones it left.
+static uint64_t caseChurnGet(ctx_t *ctx, int *ops)
+{
+    tab_t table;
+    fill(&table, ctx->keys, ctx->size);
+    for (int i = 0; i < ctx->size / 2; i++) {
+        tab_remove(&table, ctx->keys[i]);
+        tab_set(NULL, &table, ctx->others[i], VAL_INT(i));
+    }
+
+    val_t value;
+    uint64_t start = ticks();
+    for (int i = 0; i < PROBES; i++) {
+        int k = i % ctx->size;
+        tab_get(&table, k < ctx->size / 2 ? ctx->others[k] : ctx->keys[k], &value);
+    }
+    uint64_t elapsed = ticks() - start;
+
+    tab_free(NULL, &table);
+    *ops = PROBES;
+    return elapsed;
+}
+
+static uint64_t caseHashSet(ctx_t *ctx, int *ops)
+{
+    hash_t hash;
+    hash_init(&hash);
+
+    uint64_t start = ticks();
+    for (int i = 0; i < ctx->size; i++) hash_set(NULL, &hash, i, VAL_INT(i));
+    uint64_t elapsed = ticks() - start;
+
+    hash_free(NULL, &hash);
+    *ops = ctx->size;
+    return elapsed;
+}
+
+static uint64_t caseHashGet(ctx_t *ctx, int *ops)
+{
+    hash_t hash;
+    hash_init(&hash);
+    for (int i = 0; i < ctx->size; i++) hash_set(NULL, &hash, i, VAL_INT(i));
+
+    val_t value;
+    uint64_t start = ticks();
+    for (int i = 0; i < PROBES; i++) found += hash_get(&hash, ctx->intProbes[i], &value);
+    uint64_t elapsed = ticks() - start;
+
+    hash_free(NULL, &hash);
+    *ops = PROBES;
+    return elapsed;
+}
+
+// Fractional keys take the printed form the VM gives them, a runtime
+// string in the map's table.
+static uint64_t caseFractionSet(ctx_t *ctx, int *ops)
+{
+    tab_t table;
+    tab_init(&table);
+    char buffer[FMT_NUM_MAX];
+
+    uint64_t start = ticks();
+    for (int i = 0; i < ctx->size; i++) {
+        int length = fmt_num(buffer, i + 0.5);
+        tab_set(NULL, &table, str_new(ctx->vm, buffer, length), VAL_INT(i));
+    }
+    uint64_t elapsed = ticks() - start;
+
+    tab_free(NULL, &table);
+    *ops = ctx->size;
+    return elapsed;
+}
+
+static uint64_t caseInternHit(ctx_t *ctx, int *ops)
+{
+    uint64_t start = ticks();
+    for (int i = 0; i < ctx->size; i++) {
+        str_t *key = ctx->keys[i];
+        str_copy(ctx->vm, key->chars, key->length, false);
+    }
+    uint64_t elapsed = ticks() - start;
+
+    *ops = ctx->size;
+    return elapsed;
+}
+
+static uint64_t caseInternMiss(ctx_t *ctx, int *ops)
+{
+    // Names are unique per round so every copy is new.
+    char buffer[128];
+    int length = ctx->nameLength;
+    memset(buffer, 'x', sizeof(buffer));
+
+    uint64_t start = ticks();
+    for (int i = 0; i < ctx->size; i++) {
+        memcpy(buffer, ctx->names[i], 12);
+        buffer[0] = 'a' + ctx->round;
+        str_copy(ctx->vm, buffer, length, false);
+    }
+    uint64_t elapsed = ticks() - start;
+
+    *ops = ctx->size;
+    return elapsed;
+}
+
+static void runSize(vm_t *vm, int size, int keyLength)
+{
+    ctx_t ctx;
+    ctx.vm = vm;
+    ctx.size = size;
+    ctx.nameLength = keyLength;
+    ctx.keys = malloc(size * sizeof(str_t *));
+    ctx.others = malloc(size * sizeof(str_t *));
+    ctx.probes = malloc(PROBES * sizeof(str_t *));
+    ctx.intProbes = malloc(PROBES * sizeof(int64_t));
+    ctx.names = malloc(size * sizeof(char *));
+
+    for (int i = 0; i < size; i++) {
+        ctx.keys[i] = makeKey(vm, "k", i, keyLength);
+        ctx.others[i] = makeKey(vm, "o", i, keyLength);
+        ctx.names[i] = malloc(13);
+        snprintf(ctx.names[i], 13, "_m%010d", i + size);
+    }
+    for (int i = 0; i < PROBES; i++) ctx.intProbes[i] = (int64_t)(rnd() % size);
+
+    printf("%d keys of %d bytes %25s %10s\n", size, keyLength, "min", "median");
+
+    measure("tab_set", caseSet, &ctx);
+    setProbes(&ctx, 100);
+    measure("tab_get 100% hits", caseGet, &ctx);
+    setProbes(&ctx, 50);
+    measure("tab_get 50% hits", caseGet, &ctx);
+    setProbes(&ctx, 0);
+    measure("tab_get misses", caseGet, &ctx);
+    measure("tab_remove", caseRemove, &ctx);
+    measure("remove+set churn", caseChurn, &ctx);
+    measure("tab_get after churn", caseChurnGet, &ctx);
+    measure("hash_set integer keys", caseHashSet, &ctx);
+    measure("hash_get integer keys", caseHashGet, &ctx);
+    measure("fractional keys, set", caseFractionSet, &ctx);
+    measure("str_copy interned", caseInternHit, &ctx);
+    measure("str_copy new", caseInternMiss, &ctx);
+
+    for (int i = 0; i < size; i++) free(ctx.names[i]);
+    free(ctx.names);
+    free(ctx.keys);
+    free(ctx.others);
+    free(ctx.probes);
+    free(ctx.intProbes);
+}
+
+int main(int argc, char **argv)
+{
+    int cpu = argc > 1 ? atoi(argv[1]) : 0;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        fprintf(stderr, "Could not pin to cpu %d, running unpinned.\n", cpu);
+    }
+#endif
+
+    vm_t *vm = vm_create();
+    vm->gc->paused++;
+
+    printf("units: %s, pinned to cpu %d\n", UNIT, cpu);
+
+    int sizes[] = { 16, 1024, 65536, 262144 };
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        runSize(vm, sizes[i], 16);
+    }
+    runSize(vm, 65536, 64);
+
+    vm_close(vm);
+    return 0;
+}
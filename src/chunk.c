@@ -4,6 +4,7 @@
 
 #include "code.h"
 #include "value.h"
+#include "gc.h"
 
 #define CODE_PAGE   256
 
@@ -19,22 +20,27 @@ void chunk_init(chunk_t *chunk, src_t *source)
     arr_init(&chunk->constants);
 }
 
-void chunk_free(chunk_t *chunk)
+void chunk_free(gc_t *gc, chunk_t *chunk)
 {
-    free(chunk->code);
-    free(chunk->lines);
+    gc_resize(gc, GC_CODE, chunk->code, chunk->capacity * sizeof(uint8_t), 0);
+    gc_resize(gc, GC_CODE, chunk->lines, chunk->capacity * sizeof(uint16_t), 0);
+    gc_resize(gc, GC_CODE, chunk->columns, chunk->capacity * sizeof(uint16_t), 0);
 
-    arr_free(&chunk->constants);
+    arr_free(gc, &chunk->constants);
     chunk_init(chunk, NULL);
 }
 
-void chunk_emit(chunk_t *chunk, uint8_t byte, int line, int column)
+void chunk_emit(gc_t *gc, chunk_t *chunk, uint8_t byte, int line, int column)
 {
     if (chunk->count >= chunk->capacity) {
+        int old = chunk->capacity;
         chunk->capacity += CODE_PAGE;
-        chunk->code = realloc(chunk->code, chunk->capacity * sizeof(uint8_t));
-        chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(uint16_t));
-        chunk->columns = realloc(chunk->columns, chunk->capacity * sizeof(uint16_t));
+        chunk->code = gc_resize(gc, GC_CODE, chunk->code,
+            old * sizeof(uint8_t), chunk->capacity * sizeof(uint8_t));
+        chunk->lines = gc_resize(gc, GC_CODE, chunk->lines,
+            old * sizeof(uint16_t), chunk->capacity * sizeof(uint16_t));
+        chunk->columns = gc_resize(gc, GC_CODE, chunk->columns,
+            old * sizeof(uint16_t), chunk->capacity * sizeof(uint16_t));
     }
 
     chunk->code[chunk->count] = byte;
@@ -48,7 +54,11 @@ src_t *src_new(const char *fname)
     src_t *source = malloc(sizeof(src_t));
     if (source == NULL) return NULL;
 
-    char *buffer = read_file(fname, &source->size);
+    // The lexer runs straight on the mapped file, reading it into the
+    // heap only where mapping is not available.
+    char *buffer = map_file(fname, &source->size);
+    source->mapped = buffer != NULL;
+    if (buffer == NULL) buffer = read_file(fname, &source->size);
     if (buffer == NULL) {
         free(source);
         return NULL;
@@ -56,18 +66,43 @@ src_t *src_new(const char *fname)
 
     const char *s;
     if ((s = strrchr(fname, '/')) != NULL) s++;
-    if ((s = strrchr(fname, '\\')) != NULL) s++;
-    if (s == NULL) s = fname;
+    else if ((s = strrchr(fname, '\\')) != NULL) s++;
+    else s = fname;
 
     source->fname = strdup(s);
     source->buffer = buffer;
     return source;
 }
 
+// A source known by name only, for functions restored from an image.
+src_t *src_named(const char *fname)
+{
+    src_t *source = malloc(sizeof(src_t));
+    if (source == NULL) return NULL;
+
+    source->fname = strdup(fname);
+    source->buffer = NULL;
+    source->size = 0;
+    source->mapped = false;
+    return source;
+}
+
+// The text is only read while compiling, functions keep the name.
+void src_release(src_t *source)
+{
+    if (source->mapped) unmap_file(source->buffer, source->size);
+    else free(source->buffer);
+
+    source->buffer = NULL;
+    source->size = 0;
+    source->mapped = false;
+}
+
 void src_free(src_t *source)
 {
     if (source == NULL) return;
     free(source->fname);
-    free(source->buffer);
+    if (source->mapped) unmap_file(source->buffer, source->size);
+    else free(source->buffer);
     free(source);
 }
@@ -8,6 +8,7 @@
     _CODE(PRINT)   	/* []       [-1, +0]    pop a value from stack */ \
     _CODE(POP)     	/* []       [-1, +0]    pop a value from stack and print it */ \
     _CODE(CALL)    	/* [n]      [-n, +1]    */ \
+    _CODE(TAILCALL) /* [n]      [-n, +1]    call reusing the current frame, followed by RET */ \
     _CODE(RET)     	/* []       [-1, +0]    */ \
     _CODE(NIL)     	/* []       [-0, +1]    push nil to stack */ \
     _CODE(TRUE)    	/* []       [-0, +1]    push true to stack */ \
@@ -22,18 +23,31 @@
     _CODE(SUB)     	/* []       [-2, +1]    */ \
     _CODE(MUL)     	/* []       [-2, +1]    */ \
     _CODE(DIV)     	/* []       [-2, +1]    */ \
+    _CODE(CONCATN)  /* [n]      [-n, +1]    join (n) strings with one copy */ \
     _CODE(DEF)     	/* [k]      [-1, +0]    pop a value from stack and define as (k) in global */ \
     _CODE(GLD)     	/* [k]      [-0, +1]    push a from (k) in global to stack */ \
     _CODE(GST)     	/* [k]      [-0, +0]    set a value from stack as (k) in global */ \
     _CODE(JMP)     	/* [s, s]   [-0, +0]    */ \
     _CODE(JMPF)    	/* [s, s]   [-1, +0]    */ \
+    _CODE(LOOP)     /* [s, s]   [-0, +0]    jump backward (s, s), check for interrupt */ \
+    _CODE(JMPTABLE) /* [k, n, n, d, d, n*(s, s)] [-1, +0]  jump by integer from (k), see switchStatement() */ \
+    _CODE(JMPSTR)   /* [n, n, d, d, n*(k, s, s)] [-1, +0]  jump by string in hashed (k), see switchStatement() */ \
+    _CODE(FORPREP)  /* [a, s, s] [-0, +0]   check counter/limit/step in (a..a+2), skip loop if done */ \
+    _CODE(FORLOOP)  /* [a, s, s] [-0, +0]   step counter in (a), jump backward while in limit */ \
     _CODE(LD)      	/* [s]      [-0, +1]    */ \
     _CODE(ST)      	/* [s]      [-0, +0]    */ \
+    _CODE(ULD)      /* [u]      [-0, +1]    push the captured value (u) */ \
+    _CODE(UST)      /* [u]      [-0, +0]    set a value from stack as captured value (u) */ \
+    _CODE(CLOSE)    /* []       [-1, +0]    close the upvalue of a captured local, pop it */ \
+    _CODE(CLOSURE)  /* [k, n*2] [-0, +1]    make a closure from (k), captures moved to upv_t */ \
+    _CODE(STKCLOSURE) /* [k, n*2] [-0, +1]  make a closure from (k), captures stay in the frame */ \
     _CODE(MAP)      /* []       [-0, +1]    */ \
+    _CODE(ARRAY)    /* [d, n]   [-d-n, +1]  make an array of (d) sizes and (n) values, no sizes means [n] */ \
+    _CODE(REDIM)    /* [d]      [-d-1, +0]  resize the array below (d) sizes */ \
     _CODE(GET)      \
     _CODE(SET)      \
-    _CODE(GETI)     \
-    _CODE(SETI)
+    _CODE(GETI)     /* [n]      [-n-1, +1]  index a map or an array by (n) subscripts */ \
+    _CODE(SETI)     /* [n]      [-n-2, +1]  */
 
 typedef enum {
 #define _CODE(x)    OP_##x,
@@ -46,9 +60,12 @@ typedef struct {
     char *buffer;
     char *fname;
     size_t size;
+    bool mapped;
 } src_t;
 
 src_t *src_new(const char *fname);
+src_t *src_named(const char *fname);
+void src_release(src_t *source);
 void src_free(src_t *source);
 
 typedef struct {
@@ -62,8 +79,8 @@ typedef struct {
 } chunk_t;
 
 void chunk_init(chunk_t *chunk, src_t *source);
-void chunk_free(chunk_t *chunk);
-void chunk_emit(chunk_t *chunk, uint8_t byte, int ln, int col);
+void chunk_free(gc_t *gc, chunk_t *chunk);
+void chunk_emit(gc_t *gc, chunk_t *chunk, uint8_t byte, int ln, int col);
 
 static const char *opcode_tostr(opcode_t opcode) {
 #define _CODE(x) #x,
@@ -102,12 +119,14 @@ typedef enum {
     TOKEN_IDENTIFIER,
     TOKEN_STRING,
     TOKEN_NUMBER,
+    TOKEN_INTEGER,
 
     // Keywords.                                        
     TOKEN_AND,
     TOKEN_CASE,
     TOKEN_CLASS,
     TOKEN_CONST,
+    TOKEN_CONTINUELOOP,
     TOKEN_DEFAULT,
     TOKEN_DIM,
     TOKEN_DO,
@@ -181,3 +200,49 @@ void lexer_init(lexer_t *lexer, const char *source);
 tok_t lexer_scan(lexer_t *lexer);
 
 fun_t *compile(vm_t *vm, src_t *source);
+
+// A compiled script owned by no VM. Its code, line tables and constant
+// pool are never written once built, so VMs on any thread may run it
+// at the same time, each making only its own function objects and
+// interned strings, see vm_run(). References are counted atomically,
+// every function made from it holds one.
+typedef enum {
+    PK_VALUE,
+    PK_STRING,
+    PK_FUNCTION
+} pktype_t;
+
+typedef struct {
+    pktype_t type;
+    int length;
+    union {
+        val_t value;
+        char *chars;
+        int index;      // of the prototype
+    };
+} pconst_t;
+
+typedef struct {
+    int arity;
+    int upvalueCount;
+    char *name;         // NULL for the script
+    int nameLength;
+    int count;
+    uint8_t *code;
+    uint16_t *lines;
+    uint16_t *columns;
+    int constantCount;
+    pconst_t *constants;
+} proto_t;
+
+typedef struct {
+    volatile long refs;
+    src_t *source;
+    int protoCount;
+    proto_t *protos;    // the script first
+} program_t;
+
+program_t *program_compile(const char *fname);
+program_t *program_retain(program_t *program);
+void program_release(program_t *program);
+fun_t *program_load(vm_t *vm, program_t *program);
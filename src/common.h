@@ -33,4 +33,7 @@ typedef struct _gc  gc_t;
 typedef val_t (* cfn_t)(vm_t *vm, int argc, val_t *args);
 
 uint32_t hash_string(const char *chars, int length, bool ignorecase);
+double wall_clock(void);
 char *read_file(const char *path, size_t *size);
+char *map_file(const char *path, size_t *size);
+void unmap_file(char *buffer, size_t size);
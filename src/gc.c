@@ -6,36 +6,86 @@
 #include "vm.h"
 #include "object.h"
 
+struct _rblock {
+    rblock_t *next;
+    uint64_t data[];
+};
+
+#define BLOCK_SIZE  (sizeof(rblock_t) + REGION_BLOCK)
+
 void gc_init(gc_t *gc)
 {
     gc->allocated = 0;
-    gc->nextGC = 512 * 1024;
+    gc->nextGC = GC_THRESHOLD;
+    gc->growth = GC_GROWTH;
+    gc->limit = 0;
+    memset(&gc->stats, 0, sizeof(gcstats_t));
+    gc->paused = 0;
+    gc->allocprof = NULL;
     gc->objects = NULL;
+    memset(gc->regions, 0, sizeof(gc->regions));
+    gc->depth = 0;
+    gc->floor = 0;
 
     gc->grayCount = 0;
     gc->grayCapacity = 0;
     gc->grayStack = NULL;
 }
 
-void gc_free(gc_t *gc)
+static void freeObjects(gc_t *gc, obj_t *object)
 {
-    obj_t *object = gc->objects;
-
     while (object != NULL) {
         obj_t *next = object->next;
         obj_free(gc, object);
         object = next;
     }
+}
+
+static void freeBlocks(gc_t *gc, rblock_t *block)
+{
+    while (block != NULL) {
+        rblock_t *next = block->next;
+        gc_realloc(gc, block, BLOCK_SIZE, 0);
+        block = next;
+    }
+}
+
+void gc_free(gc_t *gc)
+{
+    freeObjects(gc, gc->objects);
+
+    for (int i = 0; i < REGION_MAX; i++) {
+        freeObjects(gc, gc->regions[i].objects);
+        freeBlocks(gc, gc->regions[i].blocks);
+        freeBlocks(gc, gc->regions[i].spare);
+        gc_resize(gc, GC_STACKS, gc->regions[i].remembered,
+            gc->regions[i].rememberedCapacity * sizeof(obj_t *), 0);
+    }
 
     free(gc->grayStack);
 }
 
+// The allocation goes ahead, the script stops at its next safepoint.
+static inline void interrupt(gc_t *gc)
+{
+    INTERRUPT_SET(gc->vm, INTERRUPT_GC);
+}
+
 void *gc_realloc(gc_t *gc, void *ptr, size_t old, size_t new)
 {
     gc->allocated += new - old;
+    gc->stats.inUse[GC_OBJECTS] += new - old;
+
+    if (new > old) {
+        gc->stats.bytesAllocated += new - old;
 
-    if (new > old && gc->allocated > gc->nextGC) {
-        gc_collect(gc);
+        if (gc->allocated > gc->nextGC) {
+            if (gc->paused == 0) gc_collect(gc);
+            if (gc->limit != 0 && gc->allocated > gc->limit) interrupt(gc);
+        }
+    }
+    else {
+        gc->stats.bytesFreed += old - new;
     }
 
     if (new == 0) {
@@ -46,16 +96,56 @@ void *gc_realloc(gc_t *gc, void *ptr, size_t old, size_t new)
     return realloc(ptr, new);
 }
 
+void gc_account(gc_t *gc, gcuse_t use, size_t old, size_t new)
+{
+    if (gc == NULL) return;
+
+    gc->allocated += new - old;
+    gc->stats.inUse[use] += new - old;
+
+    if (new > old) {
+        gc->stats.bytesAllocated += new - old;
+        if (gc->allocated > gc->nextGC) interrupt(gc);
+    }
+    else {
+        gc->stats.bytesFreed += old - new;
+    }
+}
+
+void *gc_resize(gc_t *gc, gcuse_t use, void *ptr, size_t old, size_t new)
+{
+    gc_account(gc, use, old, new);
+
+    if (new == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    void *result = realloc(ptr, new);
+    if (result == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    return result;
+}
+
+bool gc_safepoint(gc_t *gc)
+{
+    if (gc->allocated > gc->nextGC && gc->paused == 0) gc_collect(gc);
+    return gc->limit == 0 || gc->allocated <= gc->limit;
+}
+
 static void markObject(gc_t *gc, obj_t *object)
 {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (object->isMarked || object->region < gc->floor) return;
     object->isMarked = true;
 
     if (gc->grayCapacity < gc->grayCount + 1) {
-        gc->grayCapacity = GROW_CAP(gc->grayCapacity);
-        gc->grayStack = realloc(gc->grayStack,
-            gc->grayCapacity * sizeof(obj_t *));
+        int capacity = GROW_CAP(gc->grayCapacity);
+        gc->grayStack = gc_resize(gc, GC_STACKS, gc->grayStack,
+            gc->grayCapacity * sizeof(obj_t *), capacity * sizeof(obj_t *));
+        gc->grayCapacity = capacity;
     }
 
     gc->grayStack[gc->grayCount++] = object;
@@ -92,7 +182,15 @@ static void mark_array(gc_t *gc, arr_t *array)
 static void blackenObject(gc_t *gc, obj_t *object)
 {
     switch (object->type) {
-        case OT_STR:
+        case OT_STR: {
+            str_t *string = (str_t *)object;
+            str_charge(gc, string);
+            markObject(gc, (obj_t *)string->left);
+            markObject(gc, (obj_t *)string->right);
+            markObject(gc, (obj_t *)string->parent);
+            break;
+        }
+        case OT_VEC:
             break;
         case OT_UPV:
             markValue(gc, ((upv_t *)object)->closed);
@@ -101,8 +199,15 @@ static void blackenObject(gc_t *gc, obj_t *object)
             fun_t *function = (fun_t *)object;
             markObject(gc, (obj_t *)function->name);
             mark_array(gc, &function->chunk.constants);
-            for (int i = 0; i < function->upvalueCount; i++) {
-                markObject(gc, (obj_t *)function->upvalues[i]);
+            break;
+        }
+        case OT_CLO: {
+            clo_t *closure = (clo_t *)object;
+            markObject(gc, (obj_t *)closure->function);
+            if (!closure->onStack) {
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    markObject(gc, (obj_t *)closure->upvalues[i]);
+                }
             }
             break;
         }
@@ -112,6 +217,13 @@ static void blackenObject(gc_t *gc, obj_t *object)
             mark_hash(gc, &map->hash);
             break;
         }
+        case OT_ARR: {
+            ary_t *array = (ary_t *)object;
+            for (int i = 0; i < array->count; i++) {
+                markValue(gc, array->values[i]);
+            }
+            break;
+        }
     }
 }
 
@@ -129,6 +241,7 @@ static void markRoots(vm_t *vm)
 
     for (int i = 0; i < vm->frameCount; i++) {
         markObject(gc, (obj_t *)vm->frames[i].function);
+        markObject(gc, (obj_t *)vm->frames[i].closure);
     }
 
     for (upv_t *upvalue = vm->openUpvalues;
@@ -140,6 +253,17 @@ static void markRoots(vm_t *vm)
     //mark_compiler(vm);
 }
 
+// Objects a region's objects were stored in are kept until it closes.
+static void markRemembered(gc_t *gc)
+{
+    for (int i = 0; i < gc->depth; i++) {
+        region_t *region = &gc->regions[i];
+        for (int k = 0; k < region->rememberedCount; k++) {
+            markObject(gc, region->remembered[k]);
+        }
+    }
+}
+
 static void traceReferences(gc_t *gc)
 {
     while (gc->grayCount > 0) {
@@ -148,13 +272,13 @@ static void traceReferences(gc_t *gc)
     }
 }
 
-static void sweep(gc_t *gc)
+static void sweep(gc_t *gc, obj_t **list)
 {
     obj_t *prev = NULL;
-    obj_t *obj = gc->objects;
+    obj_t *obj = *list;
 
     while (obj != NULL) {
-        if (!obj->isMarked) {
+        if (obj->isMarked) {
             obj->isMarked = false;
             prev = obj;
             obj = obj->next;
@@ -167,7 +291,7 @@ static void sweep(gc_t *gc)
                 prev->next = obj;
             }
             else {
-                gc->objects = obj;
+                *list = obj;
             }
 
             obj_free(gc, unreached);
@@ -188,12 +312,309 @@ static void removeWhite(tab_t *table)
 void gc_collect(gc_t *gc)
 {
     vm_t *vm = gc->vm;
+    double start = wall_clock();
 
     markRoots(vm);
     markTable(gc, vm->globals);
+    markRemembered(gc);
     traceReferences(gc);
     removeWhite(vm->strings);
-    sweep(gc);
+    sweep(gc, &gc->objects);
+    for (int i = 0; i < gc->depth; i++) sweep(gc, &gc->regions[i].objects);
+
+    gc->nextGC = (size_t)(gc->allocated * gc->growth);
+    if (gc->limit != 0 && gc->nextGC > gc->limit) gc->nextGC = gc->limit;
+
+    double pause = wall_clock() - start;
+    gc->stats.collections++;
+    gc->stats.totalPause += pause;
+    if (pause > gc->stats.maxPause) gc->stats.maxPause = pause;
+    gc->stats.liveAfter = gc->allocated;
+}
+
+void gc_set_threshold(gc_t *gc, size_t bytes)
+{
+    gc->nextGC = bytes;
+    if (gc->limit != 0 && gc->nextGC > gc->limit) gc->nextGC = gc->limit;
+}
+
+void gc_set_growth(gc_t *gc, double factor)
+{
+    if (factor >= 1) gc->growth = factor;
+}
+
+void gc_set_limit(gc_t *gc, size_t bytes)
+{
+    gc->limit = bytes;
+    if (bytes != 0 && gc->nextGC > bytes) gc->nextGC = bytes;
+}
+
+bool gc_step(gc_t *gc, size_t bytes)
+{
+    if (gc->paused != 0 || gc->allocated + bytes <= gc->nextGC) return false;
+
+    gc_collect(gc);
+    return true;
+}
+
+void gc_count(gc_t *gc, size_t *counts)
+{
+    memset(counts, 0, GC_TYPES * sizeof(size_t));
+
+    for (obj_t *object = gc->objects; object != NULL; object = object->next) {
+        counts[object->type]++;
+    }
+
+    for (int i = 0; i < gc->depth; i++) {
+        for (obj_t *object = gc->regions[i].objects; object != NULL; object = object->next) {
+            counts[object->type]++;
+        }
+    }
+}
+
+const char *gc_typename(int type)
+{
+    switch (type) {
+        case OT_STR: return "str";
+        case OT_FUN: return "fun";
+        case OT_CLO: return "clo";
+        case OT_UPV: return "upv";
+        case OT_MAP: return "map";
+        case OT_ARR: return "arr";
+        case OT_VEC: return "vec";
+        default: return "obj";
+    }
+}
+
+obj_t *gc_bump(gc_t *gc, size_t size)
+{
+    region_t *region = &gc->regions[gc->depth - 1];
+    size = (size + 7) & ~(size_t)7;
+
+    if (region->blocks == NULL || region->used + size > REGION_BLOCK) {
+        rblock_t *block = region->spare;
+
+        if (block != NULL) region->spare = block->next;
+        else block = gc_realloc(gc, NULL, 0, BLOCK_SIZE);
+
+        block->next = region->blocks;
+        region->blocks = block;
+        region->used = 0;
+    }
+
+    obj_t *object = (obj_t *)((char *)region->blocks->data + region->used);
+    region->used += size;
+
+    object->isBumped = true;
+    object->region = (uint8_t)gc->depth;
+    object->next = region->objects;
+    region->objects = object;
+    return object;
+}
+
+void gc_escape(gc_t *gc, obj_t *container, obj_t *object)
+{
+    region_t *region = &gc->regions[object->region - 1];
+
+    if (container == NULL) {
+        region->globals = true;
+        return;
+    }
+
+    // Stores into one object tend to come in runs.
+    int count = region->rememberedCount;
+    if (count > 0 && region->remembered[count - 1] == container) return;
+
+    if (region->rememberedCapacity < count + 1) {
+        int capacity = GROW_CAP(region->rememberedCapacity);
+        region->remembered = gc_resize(gc, GC_STACKS, region->remembered,
+            region->rememberedCapacity * sizeof(obj_t *), capacity * sizeof(obj_t *));
+        region->rememberedCapacity = capacity;
+    }
+
+    region->remembered[region->rememberedCount++] = container;
+}
+
+bool gc_region_open(gc_t *gc)
+{
+    if (gc->depth == REGION_MAX) return false;
+
+    region_t *region = &gc->regions[gc->depth++];
+    region->objects = NULL;
+    region->globals = false;
+    region->rememberedCount = 0;
+    return true;
+}
+
+// A moved object's (next) is its copy.
+static inline obj_t *forward(obj_t *object, int depth)
+{
+    return object != NULL && object->region == depth ? object->next : object;
+}
+
+static inline void forwardValue(gc_t *gc, obj_t *container, val_t *value, int depth)
+{
+    if (!IS_OBJ(*value)) return;
+
+    *value = VAL_OBJ(forward(AS_OBJ(*value), depth));
+    gc_barrier(gc, container, *value);
+}
+
+// Copies hold no references into outer regions the barrier has not
+// seen, the objects they moved into keep those they already had.
+static void forwardFields(gc_t *gc, obj_t *object, int depth)
+{
+    switch (object->type) {
+        case OT_UPV:
+            forwardValue(gc, object, &((upv_t *)object)->closed, depth);
+            break;
+        case OT_CLO: {
+            clo_t *closure = (clo_t *)object;
+            if (closure->onStack) break;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = (upv_t *)forward((obj_t *)closure->upvalues[i], depth);
+                gc_barrier(gc, object, VAL_OBJ(closure->upvalues[i]));
+            }
+            break;
+        }
+        case OT_MAP: {
+            map_t *map = (map_t *)object;
+            for (int i = 0; i < map->table.capacity; i++) {
+                ent_t *entry = &map->table.entries[i];
+                if (entry->key == NULL) continue;
+                entry->key = (str_t *)forward((obj_t *)entry->key, depth);
+                gc_barrier(gc, object, VAL_OBJ(entry->key));
+                forwardValue(gc, object, &entry->value, depth);
+            }
+            for (int i = 0; i < map->hash.capacity; i++) {
+                forwardValue(gc, object, &map->hash.indexes[i].value, depth);
+            }
+            break;
+        }
+        case OT_ARR: {
+            ary_t *array = (ary_t *)object;
+            for (int i = 0; i < array->count; i++) {
+                forwardValue(gc, object, &array->values[i], depth);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void forwardRoots(gc_t *gc, region_t *region, int depth)
+{
+    vm_t *vm = gc->vm;
+
+    for (val_t *slot = vm->stack; slot < vm->top; slot++) {
+        if (IS_OBJ(*slot)) *slot = VAL_OBJ(forward(AS_OBJ(*slot), depth));
+    }
+
+    for (int i = 0; i < vm->numRoots; i++) {
+        vm->tempRoots[i] = forward(vm->tempRoots[i], depth);
+    }
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].closure = (clo_t *)forward((obj_t *)vm->frames[i].closure, depth);
+    }
+
+    vm->openUpvalues = (upv_t *)forward((obj_t *)vm->openUpvalues, depth);
+    for (upv_t *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->next = (upv_t *)forward((obj_t *)upvalue->next, depth);
+    }
+
+    if (region->globals) {
+        for (int i = 0; i < vm->globals->capacity; i++) {
+            val_t *value = &vm->globals->entries[i].value;
+            if (IS_OBJ(*value)) *value = VAL_OBJ(forward(AS_OBJ(*value), depth));
+        }
+    }
+}
+
+// Marks what outlives the region: its objects the VM, the globals or
+// remembered objects still reach, and nothing outside it.
+static void markEscaped(gc_t *gc, region_t *region, int depth)
+{
+    gc->floor = depth;
+
+    markRoots(gc->vm);
+    if (region->globals) markTable(gc, gc->vm->globals);
+    for (int i = 0; i < region->rememberedCount; i++) {
+        blackenObject(gc, region->remembered[i]);
+    }
+    traceReferences(gc);
+
+    gc->floor = 0;
+}
+
+int gc_region_close(gc_t *gc)
+{
+    if (gc->depth == 0) return -1;
+
+    int depth = gc->depth;
+    region_t *region = &gc->regions[depth - 1];
+    int moved = 0;
+
+    markEscaped(gc, region, depth);
+    gc->depth--;
+    gc->paused++;
+
+    obj_t *object = region->objects;
+    while (object != NULL) {
+        obj_t *next = object->next;
+
+        if (object->isMarked) {
+            object->next = obj_copy(gc, object);
+            if (gc->allocprof != NULL) allocprof_move(gc, object, object->next);
+            moved++;
+        }
+        else {
+            obj_free(gc, object);
+        }
+        object = next;
+    }
+
+    // The copies are the newest objects of the heap.
+    if (moved > 0) {
+        forwardRoots(gc, region, depth);
+        for (int i = 0; i < region->rememberedCount; i++) {
+            forwardFields(gc, region->remembered[i], depth);
+        }
+
+        object = gc->objects;
+        for (int i = 0; i < moved; i++, object = object->next) {
+            forwardFields(gc, object, depth);
+        }
+    }
+
+    gc->paused--;
+
+    int kept = 0;
+    for (rblock_t *block = region->spare; block != NULL; block = block->next) kept++;
+
+    rblock_t *block = region->blocks;
+    while (block != NULL) {
+        rblock_t *next = block->next;
+
+        if (kept < REGION_KEEP) {
+            block->next = region->spare;
+            region->spare = block;
+            kept++;
+        }
+        else {
+            gc_realloc(gc, block, BLOCK_SIZE, 0);
+        }
+        block = next;
+    }
+
+    region->objects = NULL;
+    region->blocks = NULL;
+    region->used = 0;
+    region->globals = false;
+    region->rememberedCount = 0;
 
-    gc->nextGC = gc->allocated * 2;
+    gc->stats.regions++;
+    gc->stats.escaped += moved;
+    return moved;
 }
@@ -4,12 +4,78 @@
 
 #include "common.h"
 #include "object.h"
+#include "profile.h"
+
+#define GC_THRESHOLD    (512 * 1024)
+#define GC_GROWTH       2.0
+#define GC_TYPES        (OT_VEC + 1)
+
+#define REGION_MAX      8
+#define REGION_BLOCK    (64 * 1024)
+#define REGION_KEEP     4       // blocks kept for the next use
+
+// What the heap holds, every byte in (allocated) is one of these.
+typedef enum {
+    GC_OBJECTS,     // object structs and closure captures
+    GC_STRINGS,     // characters of strings
+    GC_TABLES,      // map, array and vector storage, globals, interning
+    GC_CODE,        // bytecode, line tables and constants
+    GC_STACKS,      // VM stacks and the collector's gray stack
+    GC_USES
+} gcuse_t;
+
+// Counters kept since gc_init(), pauses in seconds.
+typedef struct {
+    size_t inUse[GC_USES];  // bytes held now, by use
+    uint64_t collections;
+    double totalPause;
+    double maxPause;
+    uint64_t bytesAllocated;
+    uint64_t bytesFreed;
+    size_t liveAfter;       // heap left by the last collection
+    uint64_t regions;       // regions closed
+    uint64_t escaped;       // objects copied out of them
+} gcstats_t;
+
+// While a region is open, objects other than functions and interned
+// strings are bump allocated from its blocks and listed apart from the
+// heap. Closing it frees them all at once without a collection. The
+// ones that escaped, still reachable from the VM, from the globals or
+// from an object made outside the region, are first copied to the heap
+// and the references to them updated. The write barrier keeps the
+// objects from outside the region they were stored in.
+typedef struct _rblock rblock_t;
+
+typedef struct {
+    obj_t *objects;
+    rblock_t *blocks;       // bump allocated from the first
+    rblock_t *spare;
+    size_t used;            // bytes taken from the first block
+    bool globals;           // stored in a global
+    int rememberedCount;
+    int rememberedCapacity;
+    obj_t **remembered;
+} region_t;
 
 struct _gc {
     vm_t *vm;
     size_t allocated;
     size_t nextGC;
+    // The next threshold is the live heap times (growth), never above
+    // (limit), 0 means no limit. A heap over (limit) after a collection
+    // stops the script at its next safepoint.
+    double growth;
+    size_t limit;
+    gcstats_t stats;
+    // Natives building large rooted graphs raise this to hold off
+    // collections that could only mark what they just made.
+    int paused;
+    // Set while allocations are tracked, see vm_allocs_start().
+    allocprof_t *allocprof;
     obj_t *objects;
+    region_t regions[REGION_MAX];
+    int depth;              // regions open
+    int floor;              // shallowest region marked, see gc_region_close()
     obj_t **grayStack;
     int grayCount;
     int grayCapacity;
@@ -21,4 +87,45 @@ void gc_free(gc_t *gc);
 void *gc_realloc(gc_t *gc, void *ptr, size_t old, size_t new);
 void gc_collect(gc_t *gc);
 
+// Storage objects and the VM own, counted like objects but never the
+// start of a collection: a heap past its threshold asks the VM for one
+// at its next safepoint, where every live value is rooted. gc_account()
+// counts memory allocated elsewhere. A NULL (gc) counts nothing.
+void *gc_resize(gc_t *gc, gcuse_t use, void *ptr, size_t old, size_t new);
+void gc_account(gc_t *gc, gcuse_t use, size_t old, size_t new);
+
+// Runs the collection a safepoint was asked for, false when the heap
+// is still over its limit.
+bool gc_safepoint(gc_t *gc);
+
+// Tuning, effective from the next allocation. The threshold set before
+// a script runs is the initial one.
+void gc_set_threshold(gc_t *gc, size_t bytes);
+void gc_set_growth(gc_t *gc, double factor);
+void gc_set_limit(gc_t *gc, size_t bytes);
+
+// Counts (bytes) as allocated and collects if that takes the heap past
+// its threshold, true when it did.
+bool gc_step(gc_t *gc, size_t bytes);
+
+// Regions nest up to REGION_MAX deep. Closing one returns the number
+// of objects copied out of it, -1 when none was open.
+bool gc_region_open(gc_t *gc);
+int gc_region_close(gc_t *gc);
+
+obj_t *gc_bump(gc_t *gc, size_t size);
+void gc_escape(gc_t *gc, obj_t *container, obj_t *object);
+
+// Called before (value) is stored in (container), NULL for a global.
+static inline void gc_barrier(gc_t *gc, obj_t *container, val_t value)
+{
+    if (IS_OBJ(value) && AS_OBJ(value)->region > (container != NULL ? container->region : 0)) {
+        gc_escape(gc, container, AS_OBJ(value));
+    }
+}
+
+// Live objects by type, (counts) holds GC_TYPES entries.
+void gc_count(gc_t *gc, size_t *counts);
+const char *gc_typename(int type);
+
 #endif
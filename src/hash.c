@@ -2,9 +2,9 @@
 #include <string.h>
 
 #include "hash.h"
+#include "gc.h"
 
 #define HASH_MAX_LOAD   0.75
-#define UNUSED_INDEX    UINT64_MAX
 
 void hash_init(hash_t *hash)
 {
@@ -13,88 +13,77 @@ void hash_init(hash_t *hash)
     hash->indexes = NULL;
 }
 
-void hash_free(hash_t *hash)
+void hash_free(gc_t *gc, hash_t *hash)
 {
-    free(hash->indexes);
+    gc_resize(gc, GC_TABLES, hash->indexes, hash->capacity * sizeof(index_t), 0);
     hash_init(hash);
 }
 
-static index_t *hash_find(index_t *indexes, int capacity, uint64_t key)
+// Keys are never removed, so probing stops at the first free slot.
+static index_t *hash_find(index_t *indexes, int capacity, int64_t key)
 {
-    uint32_t i = key % capacity;
-    index_t *tombstone = NULL;
+    uint32_t i = (uint64_t)key % capacity;
 
     for (;;) {
         index_t *index = &indexes[i];
-
-        if (index->key == UNUSED_INDEX) {
-            if (IS_NULL(index->value)) {
-                // Empty entry.                              
-                return tombstone != NULL ? tombstone : index;
-            }
-            else {
-                // We found a tombstone.                     
-                if (tombstone == NULL) tombstone = index;
-            }
-        }
-        else if (index->key == key) {
-            // We found the key.
-            return index;
-        }
+        if (!index->used || index->key == key) return index;
 
         i = (i + 1) % capacity;
     }
 }
 
-static void hash_resize(hash_t *hash, int capacity)
+static void hash_resize(gc_t *gc, hash_t *hash, int capacity)
 {
-    index_t *indexes = malloc(capacity * sizeof(index_t));
+    index_t *indexes = gc_resize(gc, GC_TABLES, NULL, 0, capacity * sizeof(index_t));
 
     for (int i = 0; i < capacity; i++) {
-        indexes[i].key = UNUSED_INDEX;
+        indexes[i].key = 0;
         indexes[i].value = VAL_NULL;
+        indexes[i].used = false;
     }
  
     hash->count = 0;
     for (int i = 0; i < hash->capacity; i++) {
         index_t *index = &hash->indexes[i];
-        if (index->key == UNUSED_INDEX) continue;
+        if (!index->used) continue;
 
         index_t *dest = hash_find(indexes, capacity, index->key);
         dest->key = index->key;
         dest->value = index->value;
+        dest->used = true;
         hash->count++;
     }
 
-    free(hash->indexes);
+    gc_resize(gc, GC_TABLES, hash->indexes, hash->capacity * sizeof(index_t), 0);
     hash->indexes = indexes;
     hash->capacity = capacity;
 }
 
-bool hash_get(hash_t *hash, uint64_t key, val_t *value)
+bool hash_get(hash_t *hash, int64_t key, val_t *value)
 {
     if (hash->count == 0) return false;
 
     index_t *index = hash_find(hash->indexes, hash->capacity, key);
-    if (index->key == UNUSED_INDEX) return false;
+    if (!index->used) return false;
 
     (*value) = index->value;
     return true;
 }
 
-bool hash_set(hash_t *hash, uint64_t key, val_t value)
+bool hash_set(gc_t *gc, hash_t *hash, int64_t key, val_t value)
 {
     if (hash->count + 1 > hash->capacity * HASH_MAX_LOAD) {
         int capacity = GROW_CAP(hash->capacity);
-        hash_resize(hash, capacity);
+        hash_resize(gc, hash, capacity);
     }
 
     index_t *index = hash_find(hash->indexes, hash->capacity, key);
 
-    bool isNewKey = (index->key == UNUSED_INDEX);
-    if (isNewKey && IS_NULL(index->value)) hash->count++;
+    bool isNewKey = !index->used;
+    if (isNewKey) hash->count++;
 
     index->key = key;
     index->value = value;
+    index->used = true;
     return isNewKey;
 }
@@ -3,9 +3,12 @@
 #include "common.h"
 #include "value.h"
 
+// Integer keyed part of a map, the keys are any int64 value so free
+// slots are told apart by (used).
 typedef struct {
-    uint64_t key;
+    int64_t key;
     val_t value;
+    bool used;
 } index_t;
 
 typedef struct {
@@ -15,7 +18,7 @@ typedef struct {
 } hash_t;
 
 void hash_init(hash_t *hash);
-void hash_free(hash_t *hash);
+void hash_free(gc_t *gc, hash_t *hash);
 
-bool hash_get(hash_t *hash, uint64_t key, val_t *value);
-bool hash_set(hash_t *hash, uint64_t key, val_t value);
+bool hash_get(hash_t *hash, int64_t key, val_t *value);
+bool hash_set(gc_t *gc, hash_t *hash, int64_t key, val_t value);
@@ -0,0 +1,766 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "object.h"
+#include "gc.h"
+
+// A heap image holds what a script left behind in the globals: every
+// object they reach, written out as a table where references are the
+// index of the object in it. Natives are stored by the name they were
+// registered under, which a VM loading the same libraries has too,
+// and the sources of functions by file name. vm_restore() reads the
+// mapped file and rebuilds the objects in two passes, shells first so
+// references can point anywhere, cycles included.
+//
+//   header     "AU3I", version, byte order
+//   natives    count, names
+//   sources    count, names
+//   objects    count, records of type, size and payload
+//   globals    count, name reference and value
+#define IMAGE_VERSION   2
+#define IMAGE_ORDER     0x01020304u
+#define NO_REF          UINT32_MAX
+
+typedef enum {
+    TAG_NULL,
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_NUM,
+    TAG_INT,
+    TAG_OBJ,
+    TAG_CFN,
+} tag_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} buf_t;
+
+typedef struct {
+    vm_t *vm;
+    const char *error;
+    catalog_t *catalog;
+    int *used;          // catalog entries by image index
+    int usedCount;
+    src_t **sources;
+    int sourceCount;
+    obj_t **objects;    // by index, grows as references are found
+    int count;
+    int capacity;
+    int *index;         // objects by address, one up, 0 is free
+    int indexCapacity;
+    buf_t records;
+} writer_t;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool bad;
+} reader_t;
+
+static void put(buf_t *buf, const void *data, size_t length)
+{
+    if (buf->length + length > buf->capacity) {
+        size_t capacity = buf->capacity < 4096 ? 4096 : buf->capacity;
+        while (capacity < buf->length + length) capacity *= 2;
+        buf->data = realloc(buf->data, capacity);
+        buf->capacity = capacity;
+    }
+
+    memcpy(buf->data + buf->length, data, length);
+    buf->length += length;
+}
+
+static void putU8(buf_t *buf, uint8_t value)    { put(buf, &value, sizeof(value)); }
+static void putU32(buf_t *buf, uint32_t value)  { put(buf, &value, sizeof(value)); }
+static void putI64(buf_t *buf, int64_t value)   { put(buf, &value, sizeof(value)); }
+static void putF64(buf_t *buf, double value)    { put(buf, &value, sizeof(value)); }
+
+static void putName(buf_t *buf, const char *name)
+{
+    uint32_t length = (uint32_t)strlen(name);
+    putU32(buf, length);
+    put(buf, name, length);
+}
+
+static inline uint32_t pointerHash(const void *pointer)
+{
+    uint64_t h = (uint64_t)(uintptr_t)pointer * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h >> 32);
+}
+
+static void addNative(catalog_t *catalog, cfn_t function, const char *module, const char *name)
+{
+    for (int i = 0; i < catalog->count; i++) {
+        if (catalog->natives[i].function == function) return;
+    }
+
+    if (catalog->count == catalog->capacity) {
+        catalog->capacity = GROW_CAP(catalog->capacity);
+        catalog->natives = realloc(catalog->natives, catalog->capacity * sizeof(native_t));
+    }
+
+    size_t length = strlen(name) + (module != NULL ? strlen(module) + 1 : 0);
+    char *full = malloc(length + 1);
+    if (module != NULL) sprintf(full, "%s.%s", module, name);
+    else strcpy(full, name);
+
+    catalog->natives[catalog->count].function = function;
+    catalog->natives[catalog->count].name = full;
+    catalog->count++;
+}
+
+// Names the natives a library or the host sets as global (name), the
+// value itself or the members of a module map. Globals a script sets
+// are not looked at, an alias there must not rename a native.
+void vm_register(vm_t *vm, const char *name, val_t value)
+{
+    if (IS_CFN(value)) {
+        addNative(vm->natives, AS_CFN(value), NULL, name);
+    }
+    else if (IS_MAP(value)) {
+        tab_t *members = &AS_MAP(value)->table;
+        for (int i = 0; i < members->capacity; i++) {
+            ent_t *member = &members->entries[i];
+            if (member->key != NULL && IS_CFN(member->value)) {
+                addNative(vm->natives, AS_CFN(member->value), name, member->key->chars);
+            }
+        }
+    }
+}
+
+static void growIndex(writer_t *w)
+{
+    int capacity = GROW_CAP(w->indexCapacity);
+    int *index = calloc(capacity, sizeof(int));
+
+    for (int i = 0; i < w->count; i++) {
+        uint32_t slot = pointerHash(w->objects[i]) & (capacity - 1);
+        while (index[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        index[slot] = i + 1;
+    }
+
+    free(w->index);
+    w->index = index;
+    w->indexCapacity = capacity;
+}
+
+// The index of (object) in the image, numbering it on first sight.
+static uint32_t objectRef(writer_t *w, obj_t *object)
+{
+    if (object == NULL) return NO_REF;
+
+    if (w->count + 1 > w->indexCapacity / 2) growIndex(w);
+
+    uint32_t slot = pointerHash(object) & (w->indexCapacity - 1);
+    while (w->index[slot] != 0) {
+        if (w->objects[w->index[slot] - 1] == object) return w->index[slot] - 1;
+        slot = (slot + 1) & (w->indexCapacity - 1);
+    }
+
+    if (w->count == w->capacity) {
+        w->capacity = GROW_CAP(w->capacity);
+        w->objects = realloc(w->objects, w->capacity * sizeof(obj_t *));
+    }
+
+    w->objects[w->count] = object;
+    w->index[slot] = ++w->count;
+    return w->count - 1;
+}
+
+static uint32_t nativeRef(writer_t *w, cfn_t function)
+{
+    for (int i = 0; i < w->usedCount; i++) {
+        if (w->catalog->natives[w->used[i]].function == function) return i;
+    }
+
+    for (int i = 0; i < w->catalog->count; i++) {
+        if (w->catalog->natives[i].function == function) {
+            w->used = realloc(w->used, (w->usedCount + 1) * sizeof(int));
+            w->used[w->usedCount] = i;
+            return w->usedCount++;
+        }
+    }
+
+    w->error = "a native has no registered name";
+    return NO_REF;
+}
+
+static uint32_t sourceRef(writer_t *w, src_t *source)
+{
+    if (source == NULL) return NO_REF;
+
+    for (int i = 0; i < w->sourceCount; i++) {
+        if (w->sources[i] == source) return i;
+    }
+
+    w->sources = realloc(w->sources, (w->sourceCount + 1) * sizeof(src_t *));
+    w->sources[w->sourceCount] = source;
+    return w->sourceCount++;
+}
+
+static void writeValue(writer_t *w, buf_t *buf, val_t value)
+{
+    switch (AS_TYPE(value)) {
+        case VT_NULL:
+            putU8(buf, TAG_NULL);
+            break;
+        case VT_BOOL:
+            putU8(buf, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+            break;
+        case VT_NUM:
+            putU8(buf, TAG_NUM);
+            putF64(buf, AS_NUM(value));
+            break;
+        case VT_INT:
+            putU8(buf, TAG_INT);
+            putI64(buf, AS_INT(value));
+            break;
+        case VT_OBJ:
+            putU8(buf, TAG_OBJ);
+            putU32(buf, objectRef(w, AS_OBJ(value)));
+            break;
+        case VT_CFN:
+            putU8(buf, TAG_CFN);
+            putU32(buf, nativeRef(w, AS_CFN(value)));
+            break;
+        default:
+            w->error = "a pointer value can not be saved";
+            putU8(buf, TAG_NULL);
+            break;
+    }
+}
+
+static void writeObject(writer_t *w, obj_t *object)
+{
+    buf_t *buf = &w->records;
+
+    putU8(buf, (uint8_t)object->type);
+    size_t sizeAt = buf->length;
+    putU32(buf, 0);
+
+    switch (object->type) {
+        case OT_STR: {
+            str_t *string = (str_t *)object;
+            putU8(buf, string->isInterned);
+            putU32(buf, (uint32_t)string->length);
+            put(buf, str_flatten(string), string->length);
+            break;
+        }
+        case OT_FUN: {
+            fun_t *function = (fun_t *)object;
+            chunk_t *chunk = &function->chunk;
+            putU32(buf, (uint32_t)function->arity);
+            putU32(buf, (uint32_t)function->upvalueCount);
+            putU32(buf, objectRef(w, (obj_t *)function->name));
+            putU32(buf, sourceRef(w, chunk->source));
+            putU32(buf, (uint32_t)chunk->count);
+            put(buf, chunk->code, chunk->count * sizeof(uint8_t));
+            put(buf, chunk->lines, chunk->count * sizeof(uint16_t));
+            put(buf, chunk->columns, chunk->count * sizeof(uint16_t));
+            putU32(buf, (uint32_t)chunk->constants.count);
+            for (int i = 0; i < chunk->constants.count; i++) {
+                writeValue(w, buf, chunk->constants.values[i]);
+            }
+            break;
+        }
+        case OT_CLO: {
+            clo_t *closure = (clo_t *)object;
+            if (closure->onStack) w->error = "a closure lives on the stack";
+            putU32(buf, objectRef(w, (obj_t *)closure->function));
+            putU32(buf, (uint32_t)closure->upvalueCount);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                putU32(buf, closure->onStack ? NO_REF : objectRef(w, (obj_t *)closure->upvalues[i]));
+            }
+            break;
+        }
+        case OT_UPV: {
+            upv_t *upvalue = (upv_t *)object;
+            if (upvalue->location != &upvalue->closed) w->error = "an upvalue is still open";
+            writeValue(w, buf, *upvalue->location);
+            break;
+        }
+        case OT_MAP: {
+            map_t *map = (map_t *)object;
+            uint32_t count = 0;
+
+            putU8(buf, map->isArray);
+            for (int i = 0; i < map->table.capacity; i++) {
+                if (map->table.entries[i].key != NULL) count++;
+            }
+            putU32(buf, count);
+            for (int i = 0; i < map->table.capacity; i++) {
+                ent_t *entry = &map->table.entries[i];
+                if (entry->key == NULL) continue;
+                putU32(buf, objectRef(w, (obj_t *)entry->key));
+                writeValue(w, buf, entry->value);
+            }
+
+            count = 0;
+            for (int i = 0; i < map->hash.capacity; i++) {
+                if (map->hash.indexes[i].used) count++;
+            }
+            putU32(buf, count);
+            for (int i = 0; i < map->hash.capacity; i++) {
+                index_t *index = &map->hash.indexes[i];
+                if (!index->used) continue;
+                putI64(buf, index->key);
+                writeValue(w, buf, index->value);
+            }
+            break;
+        }
+        case OT_ARR: {
+            ary_t *array = (ary_t *)object;
+            putU32(buf, (uint32_t)array->dims);
+            for (int i = 0; i < array->dims; i++) putU32(buf, (uint32_t)array->sizes[i]);
+            for (int i = 0; i < array->count; i++) writeValue(w, buf, array->values[i]);
+            break;
+        }
+        case OT_VEC: {
+            vec_t *vector = (vec_t *)object;
+            putU32(buf, (uint32_t)vector->count);
+            put(buf, vector->data, vector->count * sizeof(double));
+            break;
+        }
+    }
+
+    uint32_t size = (uint32_t)(buf->length - sizeAt - sizeof(uint32_t));
+    memcpy(buf->data + sizeAt, &size, sizeof(size));
+}
+
+bool vm_snapshot(vm_t *vm, const char *path)
+{
+    writer_t w;
+    memset(&w, 0, sizeof(w));
+    w.vm = vm;
+    w.catalog = vm->natives;
+
+    buf_t globals = { NULL, 0, 0 };
+    uint32_t count = 0;
+
+    for (int i = 0; i < vm->globals->capacity; i++) {
+        ent_t *entry = &vm->globals->entries[i];
+        if (entry->key == NULL) continue;
+        putU32(&globals, objectRef(&w, (obj_t *)entry->key));
+        writeValue(&w, &globals, entry->value);
+        count++;
+    }
+
+    for (int i = 0; i < w.count && w.error == NULL; i++) {
+        writeObject(&w, w.objects[i]);
+    }
+
+    bool written = false;
+    FILE *file = w.error == NULL ? fopen(path, "wb") : NULL;
+
+    if (file != NULL) {
+        buf_t head = { NULL, 0, 0 };
+        put(&head, "AU3I", 4);
+        putU32(&head, IMAGE_VERSION);
+        putU32(&head, IMAGE_ORDER);
+
+        putU32(&head, (uint32_t)w.usedCount);
+        for (int i = 0; i < w.usedCount; i++) putName(&head, w.catalog->natives[w.used[i]].name);
+
+        putU32(&head, (uint32_t)w.sourceCount);
+        for (int i = 0; i < w.sourceCount; i++) putName(&head, w.sources[i]->fname);
+
+        putU32(&head, (uint32_t)w.count);
+
+        written = fwrite(head.data, 1, head.length, file) == head.length &&
+            fwrite(w.records.data, 1, w.records.length, file) == w.records.length &&
+            fwrite(&count, sizeof(count), 1, file) == 1 &&
+            fwrite(globals.data, 1, globals.length, file) == globals.length;
+        written = fclose(file) == 0 && written;
+        free(head.data);
+    }
+
+    if (w.error != NULL) fprintf(stderr, "Could not save \"%s\": %s.\n", path, w.error);
+    else if (!written) fprintf(stderr, "Could not write \"%s\".\n", path);
+
+    free(w.used);
+    free(w.sources);
+    free(w.objects);
+    free(w.index);
+    free(w.records.data);
+    free(globals.data);
+    return written;
+}
+
+static void take(reader_t *r, void *dest, size_t length)
+{
+    if (r->bad || (size_t)(r->end - r->p) < length) {
+        r->bad = true;
+        memset(dest, 0, length);
+        return;
+    }
+
+    memcpy(dest, r->p, length);
+    r->p += length;
+}
+
+static const uint8_t *skip(reader_t *r, size_t length)
+{
+    if (r->bad || (size_t)(r->end - r->p) < length) {
+        r->bad = true;
+        return NULL;
+    }
+
+    const uint8_t *start = r->p;
+    r->p += length;
+    return start;
+}
+
+static uint8_t getU8(reader_t *r)   { uint8_t v; take(r, &v, sizeof(v)); return v; }
+static uint32_t getU32(reader_t *r) { uint32_t v; take(r, &v, sizeof(v)); return v; }
+static int64_t getI64(reader_t *r)  { int64_t v; take(r, &v, sizeof(v)); return v; }
+static double getF64(reader_t *r)   { double v; take(r, &v, sizeof(v)); return v; }
+
+typedef struct {
+    const uint8_t *payload;
+    uint32_t size;
+    int type;
+} record_t;
+
+typedef struct {
+    vm_t *vm;
+    cfn_t *natives;
+    uint32_t nativeCount;
+    src_t **sources;
+    uint32_t sourceCount;
+    record_t *records;
+    obj_t **objects;
+    uint32_t count;
+} loader_t;
+
+static obj_t *getRef(loader_t *l, reader_t *r, int type)
+{
+    uint32_t ref = getU32(r);
+    if (ref == NO_REF) return NULL;
+
+    if (ref >= l->count || l->objects[ref] == NULL ||
+        (type >= 0 && (int)l->objects[ref]->type != type)) {
+        r->bad = true;
+        return NULL;
+    }
+    return l->objects[ref];
+}
+
+static val_t getValue(loader_t *l, reader_t *r)
+{
+    switch (getU8(r)) {
+        case TAG_NULL: return VAL_NULL;
+        case TAG_FALSE: return VAL_FALSE;
+        case TAG_TRUE: return VAL_TRUE;
+        case TAG_NUM: return VAL_NUM(getF64(r));
+        case TAG_INT: return VAL_INT(getI64(r));
+        case TAG_OBJ: {
+            obj_t *object = getRef(l, r, -1);
+            if (object == NULL) r->bad = true;
+            return object != NULL ? VAL_OBJ(object) : VAL_NULL;
+        }
+        case TAG_CFN: {
+            uint32_t ref = getU32(r);
+            if (ref < l->nativeCount) return VAL_CFN(l->natives[ref]);
+            r->bad = true;
+            return VAL_NULL;
+        }
+        default:
+            r->bad = true;
+            return VAL_NULL;
+    }
+}
+
+static char *getName(reader_t *r)
+{
+    uint32_t length = getU32(r);
+    const uint8_t *chars = skip(r, length);
+    if (chars == NULL) return NULL;
+
+    char *name = malloc(length + 1);
+    memcpy(name, chars, length);
+    name[length] = '\0';
+    return name;
+}
+
+// First pass: everything that needs no references. Closures are made
+// once the functions they need exist.
+static obj_t *makeShell(loader_t *l, int type, reader_t *r)
+{
+    vm_t *vm = l->vm;
+
+    switch (type) {
+        case OT_STR: {
+            bool interned = getU8(r) != 0;
+            uint32_t length = getU32(r);
+            const char *chars = (const char *)skip(r, length);
+            if (chars == NULL || length > INT32_MAX) return NULL;
+
+            return (obj_t *)(interned ? str_copy(vm, chars, (int)length, false)
+                : str_new(vm, chars, (int)length));
+        }
+        case OT_FUN: {
+            int arity = (int)getU32(r);
+            int upvalueCount = (int)getU32(r);
+            getU32(r);
+            uint32_t source = getU32(r);
+            uint32_t count = getU32(r);
+            const uint8_t *code = skip(r, (size_t)count * sizeof(uint8_t));
+            const uint8_t *lines = skip(r, (size_t)count * sizeof(uint16_t));
+            const uint8_t *columns = skip(r, (size_t)count * sizeof(uint16_t));
+            if (r->bad || (source != NO_REF && source >= l->sourceCount)) return NULL;
+
+            fun_t *function = fun_new(vm, source != NO_REF ? l->sources[source] : NULL);
+            chunk_t *chunk = &function->chunk;
+            function->arity = arity;
+            function->upvalueCount = upvalueCount;
+
+            chunk->code = gc_resize(vm->gc, GC_CODE, NULL, 0, count * sizeof(uint8_t));
+            chunk->lines = gc_resize(vm->gc, GC_CODE, NULL, 0, count * sizeof(uint16_t));
+            chunk->columns = gc_resize(vm->gc, GC_CODE, NULL, 0, count * sizeof(uint16_t));
+            if (count > 0) {
+                memcpy(chunk->code, code, count * sizeof(uint8_t));
+                memcpy(chunk->lines, lines, count * sizeof(uint16_t));
+                memcpy(chunk->columns, columns, count * sizeof(uint16_t));
+            }
+            chunk->count = chunk->capacity = (int)count;
+            return (obj_t *)function;
+        }
+        case OT_CLO: {
+            fun_t *function = (fun_t *)getRef(l, r, OT_FUN);
+            uint32_t upvalueCount = getU32(r);
+            if (function == NULL || upvalueCount != (uint32_t)function->upvalueCount) return NULL;
+            return (obj_t *)clo_new(vm, function, false);
+        }
+        case OT_UPV: {
+            upv_t *upvalue = upv_new(vm, NULL);
+            upvalue->location = &upvalue->closed;
+            return (obj_t *)upvalue;
+        }
+        case OT_MAP:
+            return (obj_t *)map_new(vm);
+        case OT_ARR: {
+            int dims = (int)getU32(r);
+            int sizes[ARY_DIMS_MAX];
+            int64_t count = 1;
+
+            if (dims < 1 || dims > ARY_DIMS_MAX) return NULL;
+            for (int i = 0; i < dims; i++) {
+                sizes[i] = (int)getU32(r);
+                count *= sizes[i];
+                if (sizes[i] < 0 || count > ARY_COUNT_MAX) return NULL;
+            }
+            return (obj_t *)ary_new(vm, dims, sizes);
+        }
+        case OT_VEC: {
+            uint32_t count = getU32(r);
+            const uint8_t *data = skip(r, (size_t)count * sizeof(double));
+            if (data == NULL || count > INT32_MAX) return NULL;
+
+            vec_t *vector = vec_new(vm, (int)count);
+            if (count > 0) memcpy(vector->data, data, count * sizeof(double));
+            return (obj_t *)vector;
+        }
+        default:
+            return NULL;
+    }
+}
+
+// Second pass: the references.
+static void fillObject(loader_t *l, obj_t *object, reader_t *r)
+{
+    vm_t *vm = l->vm;
+
+    switch (object->type) {
+        case OT_STR:
+        case OT_VEC:
+            break;
+        case OT_FUN: {
+            fun_t *function = (fun_t *)object;
+            skip(r, 2 * sizeof(uint32_t));
+            function->name = (str_t *)getRef(l, r, OT_STR);
+            skip(r, sizeof(uint32_t));
+            uint32_t count = getU32(r);
+            skip(r, (size_t)count * (sizeof(uint8_t) + 2 * sizeof(uint16_t)));
+
+            uint32_t constants = getU32(r);
+            for (uint32_t i = 0; i < constants && !r->bad; i++) {
+                arr_add(vm->gc, &function->chunk.constants, getValue(l, r), true);
+            }
+            break;
+        }
+        case OT_CLO: {
+            clo_t *closure = (clo_t *)object;
+            skip(r, 2 * sizeof(uint32_t));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = (upv_t *)getRef(l, r, OT_UPV);
+            }
+            break;
+        }
+        case OT_UPV:
+            ((upv_t *)object)->closed = getValue(l, r);
+            break;
+        case OT_MAP: {
+            map_t *map = (map_t *)object;
+            map->isArray = getU8(r) != 0;
+
+            uint32_t count = getU32(r);
+            for (uint32_t i = 0; i < count && !r->bad; i++) {
+                str_t *key = (str_t *)getRef(l, r, OT_STR);
+                val_t value = getValue(l, r);
+                if (key != NULL) tab_set(vm->gc, &map->table, key, value);
+            }
+
+            count = getU32(r);
+            for (uint32_t i = 0; i < count && !r->bad; i++) {
+                int64_t key = getI64(r);
+                hash_set(vm->gc, &map->hash, key, getValue(l, r));
+            }
+            break;
+        }
+        case OT_ARR: {
+            ary_t *array = (ary_t *)object;
+            skip(r, (1 + array->dims) * sizeof(uint32_t));
+            for (int i = 0; i < array->count && !r->bad; i++) {
+                array->values[i] = getValue(l, r);
+            }
+            break;
+        }
+    }
+}
+
+static bool loadNatives(loader_t *l, reader_t *r)
+{
+    catalog_t *catalog = l->vm->natives;
+
+    l->nativeCount = getU32(r);
+    l->natives = calloc(l->nativeCount > 0 ? l->nativeCount : 1, sizeof(cfn_t));
+    bool found = !r->bad;
+
+    for (uint32_t i = 0; i < l->nativeCount && found; i++) {
+        char *name = getName(r);
+        found = false;
+
+        for (int j = 0; name != NULL && j < catalog->count; j++) {
+            if (strcmp(catalog->natives[j].name, name) == 0) {
+                l->natives[i] = catalog->natives[j].function;
+                found = true;
+                break;
+            }
+        }
+
+        if (!found && name != NULL) fprintf(stderr, "Unknown native \"%s\".\n", name);
+        free(name);
+    }
+
+    return found;
+}
+
+static bool loadSources(loader_t *l, reader_t *r)
+{
+    l->sourceCount = getU32(r);
+    if (r->bad || l->sourceCount > (size_t)(r->end - r->p) / sizeof(uint32_t)) return false;
+
+    l->sources = calloc(l->sourceCount > 0 ? l->sourceCount : 1, sizeof(src_t *));
+    for (uint32_t i = 0; i < l->sourceCount; i++) {
+        char *name = getName(r);
+        if (name == NULL) return false;
+
+        l->sources[i] = src_named(name);
+        vm_add_source(l->vm, l->sources[i]);
+        free(name);
+    }
+    return true;
+}
+
+static bool loadObjects(loader_t *l, reader_t *r)
+{
+    l->count = getU32(r);
+    if (r->bad || l->count > (size_t)(r->end - r->p) / (1 + sizeof(uint32_t))) return false;
+
+    size_t slots = l->count > 0 ? l->count : 1;
+    l->objects = calloc(slots, sizeof(obj_t *));
+    l->records = malloc(slots * sizeof(record_t));
+
+    for (uint32_t i = 0; i < l->count; i++) {
+        record_t *record = &l->records[i];
+        record->type = getU8(r);
+        record->size = getU32(r);
+        record->payload = skip(r, record->size);
+        if (record->payload == NULL || record->type > OT_VEC) return false;
+    }
+
+    for (int round = 0; round < 2; round++) {
+        for (uint32_t i = 0; i < l->count; i++) {
+            record_t *record = &l->records[i];
+            if ((record->type == OT_CLO) != (round == 1)) continue;
+
+            reader_t at = { record->payload, record->payload + record->size, false };
+            l->objects[i] = makeShell(l, record->type, &at);
+            if (l->objects[i] == NULL || at.bad) return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < l->count; i++) {
+        record_t *record = &l->records[i];
+        reader_t at = { record->payload, record->payload + record->size, false };
+        fillObject(l, l->objects[i], &at);
+        if (at.bad) return false;
+    }
+
+    return true;
+}
+
+bool vm_restore(vm_t *vm, const char *path)
+{
+    size_t size;
+    char *data = map_file(path, &size);
+    bool mapped = data != NULL;
+    if (data == NULL) data = read_file(path, &size);
+
+    if (data == NULL) {
+        fprintf(stderr, "Could not read \"%s\".\n", path);
+        return false;
+    }
+
+    loader_t l;
+    memset(&l, 0, sizeof(l));
+    l.vm = vm;
+    reader_t r = { (const uint8_t *)data, (const uint8_t *)data + size, false };
+
+    const uint8_t *magic = skip(&r, 4);
+    bool ok = magic != NULL && memcmp(magic, "AU3I", 4) == 0 &&
+        getU32(&r) == IMAGE_VERSION && getU32(&r) == IMAGE_ORDER;
+
+    // Everything made below is unreachable until the globals are set.
+    vm->gc->paused++;
+
+    ok = ok && loadNatives(&l, &r) && loadSources(&l, &r) && loadObjects(&l, &r);
+
+    if (ok) {
+        uint32_t count = getU32(&r);
+        for (uint32_t i = 0; i < count && !r.bad; i++) {
+            str_t *name = (str_t *)getRef(&l, &r, OT_STR);
+            val_t value = getValue(&l, &r);
+            if (name == NULL) continue;
+            gc_barrier(vm->gc, NULL, value);
+            tab_set(vm->gc, vm->globals, name, value);
+        }
+        ok = !r.bad;
+    }
+
+    vm->gc->paused--;
+
+    if (!ok) fprintf(stderr, "\"%s\" is not a usable image.\n", path);
+
+    free(l.natives);
+    free(l.sources);
+    free(l.records);
+    free(l.objects);
+    if (mapped) unmap_file(data, size);
+    else free(data);
+    return ok;
+}
@@ -136,10 +136,15 @@ static void skipWhitespace(lexer_t *L)
                 advance(L);
                 break;
 
-            case ';':
-                // A comment goes until the end of the line.
-                while (peek(L) != '\n' && !isAtEnd(L)) advance(L);
+            case ';': {
+                // A comment goes until the end of the line, the source
+                // is always NUL terminated so strchr() can find it.
+                const char *end = strchr(L->current, '\n');
+                if (end == NULL) end = L->current + strlen(L->current);
+                L->position += (int)(end - L->current);
+                L->current = end;
                 break;
+            }
 
             case '#':
                 // Multiline comments
@@ -183,7 +188,10 @@ static toktype_t identifierType(lexer_t *L)
             if (LENGTH() > 1) switch (START(1)) {
                 case 'a': return checkKeyword(L, 2, 2, "se", TOKEN_CASE);
                 case 'l': return checkKeyword(L, 2, 3, "ass", TOKEN_CLASS);
-                case 'o': return checkKeyword(L, 2, 3, "nst", TOKEN_CONST);
+                case 'o':
+                    if (LENGTH() == 5)
+                        return checkKeyword(L, 2, 3, "nst", TOKEN_CONST);
+                    return checkKeyword(L, 2, 10, "ntinueloop", TOKEN_CONTINUELOOP);
             }
             break;
         case 'd':
@@ -205,12 +213,16 @@ static toktype_t identifierType(lexer_t *L)
                     break;
                 case 5:
                     return checkKeyword(L, 1, 4, "ndif", TOKEN_ENDIF);
+                case 6:
+                    return checkKeyword(L, 1, 5, "lseif", TOKEN_ELSEIF);
                 case 7: 
                     if (START(3) == 'f')
                         return checkKeyword(L, 1, 6, "ndfunc", TOKEN_ENDFUNC);
                     else if (START(3) == 'w')
                         return checkKeyword(L, 1, 6, "ndwith", TOKEN_ENDWITH);
                     break;
+                case 8:
+                    return checkKeyword(L, 1, 7, "xitloop", TOKEN_EXITLOOP);
                 case 9:
                     if (START(4) == 'e')
                         return checkKeyword(L, 1, 8, "ndselect", TOKEN_ENDSELECT);
@@ -273,9 +285,11 @@ static toktype_t identifierType(lexer_t *L)
                     }
                     break;
                 case 'r': return checkKeyword(L, 2, 2, "ue", TOKEN_TRUE);
-                case 'o': return checkKeyword(L, 2, 2, "", TOKEN_TO);
+                case 'o': return checkKeyword(L, 2, 0, "", TOKEN_TO);
             }       
             break;
+        case 'u':
+            return checkKeyword(L, 1, 4, "ntil", TOKEN_UNTIL);
         case 'v':
             if (LENGTH() > 1) switch (START(1)) {
                 case 'a': return checkKeyword(L, 2, 1, "r", TOKEN_VAR);
@@ -306,6 +320,14 @@ static tok_t identifier(lexer_t *L)
 
 static tok_t number(lexer_t *L)
 {
+    // Hexadecimal integer, 0x...
+    if (L->start[0] == '0' && peek(L) == 'x' && isHexa(peekNext(L))) {
+        advance(L);
+        while (isHexa(peek(L))) advance(L);
+
+        return makeToken(L, TOKEN_INTEGER);
+    }
+
     while (isDigit(peek(L))) advance(L);
 
     // Look for a fractional part.             
@@ -314,9 +336,10 @@ static tok_t number(lexer_t *L)
         advance(L);
 
         while (isDigit(peek(L))) advance(L);
+        return makeToken(L, TOKEN_NUMBER);
     }
 
-    return makeToken(L, TOKEN_NUMBER);
+    return makeToken(L, TOKEN_INTEGER);
 }
 
 static tok_t string(lexer_t *L, char start)
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libs.h"
+#include "vm.h"
+#include "object.h"
+#include "gc.h"
+
+// gc.collect() runs a full collection and returns the bytes it freed.
+static val_t collectNative(vm_t *vm, int argc, val_t *args)
+{
+    gc_t *gc = vm->gc;
+    size_t before = gc->allocated;
+
+    gc_collect(gc);
+    return VAL_INT((int64_t)(before - gc->allocated));
+}
+
+// gc.step([bytes]) collects only when the heap, grown by (bytes), is
+// past its threshold. The collector is not incremental, a step is
+// either nothing or a full cycle.
+static val_t stepNative(vm_t *vm, int argc, val_t *args)
+{
+    int64_t bytes = argc > 0 && IS_NUMBER(args[0]) ? val_toint(args[0]) : 0;
+    return VAL_BOOL(gc_step(vm->gc, bytes > 0 ? (size_t)bytes : 0));
+}
+
+static val_t statsNative(vm_t *vm, int argc, val_t *args)
+{
+    gc_t *gc = vm->gc;
+    gcstats_t stats = gc->stats;
+    size_t counts[GC_TYPES];
+
+    gc_count(gc, counts);
+
+    map_t *result = map_new(vm);
+    vm_push(vm, VAL_OBJ(result));
+
+    map_set(vm, result, "collections", VAL_INT((int64_t)stats.collections));
+    map_set(vm, result, "pause_total", VAL_NUM(stats.totalPause));
+    map_set(vm, result, "pause_max", VAL_NUM(stats.maxPause));
+    map_set(vm, result, "allocated", VAL_INT((int64_t)stats.bytesAllocated));
+    map_set(vm, result, "freed", VAL_INT((int64_t)stats.bytesFreed));
+    map_set(vm, result, "live", VAL_INT((int64_t)stats.liveAfter));
+    map_set(vm, result, "heap", VAL_INT((int64_t)gc->allocated));
+    map_set(vm, result, "threshold", VAL_INT((int64_t)gc->nextGC));
+    map_set(vm, result, "growth", VAL_NUM(gc->growth));
+    map_set(vm, result, "limit", VAL_INT((int64_t)gc->limit));
+    map_set(vm, result, "regions", VAL_INT((int64_t)stats.regions));
+    map_set(vm, result, "escaped", VAL_INT((int64_t)stats.escaped));
+
+    map_t *objects = map_new(vm);
+    vm_push(vm, VAL_OBJ(objects));
+
+    for (int i = 0; i < GC_TYPES; i++) {
+        map_set(vm, objects, gc_typename(i), VAL_INT((int64_t)counts[i]));
+    }
+    map_set(vm, result, "objects", VAL_OBJ(objects));
+    vm_pop(vm);
+
+    static const char *uses[GC_USES] = { "objects", "strings", "tables", "code", "stacks" };
+    map_t *memory = map_new(vm);
+    vm_push(vm, VAL_OBJ(memory));
+
+    for (int i = 0; i < GC_USES; i++) {
+        map_set(vm, memory, uses[i], VAL_INT((int64_t)stats.inUse[i]));
+    }
+    map_set(vm, result, "memory", VAL_OBJ(memory));
+
+    vm_pop(vm);
+    vm_pop(vm);
+    return VAL_OBJ(result);
+}
+
+// The setters return the value in effect before the call.
+static val_t thresholdNative(vm_t *vm, int argc, val_t *args)
+{
+    size_t previous = vm->gc->nextGC;
+    if (argc > 0 && IS_NUMBER(args[0]) && val_toint(args[0]) >= 0) {
+        gc_set_threshold(vm->gc, (size_t)val_toint(args[0]));
+    }
+    return VAL_INT((int64_t)previous);
+}
+
+static val_t growthNative(vm_t *vm, int argc, val_t *args)
+{
+    double previous = vm->gc->growth;
+    if (argc > 0 && IS_NUMBER(args[0])) gc_set_growth(vm->gc, val_tonum(args[0]));
+    return VAL_NUM(previous);
+}
+
+static val_t limitNative(vm_t *vm, int argc, val_t *args)
+{
+    size_t previous = vm->gc->limit;
+    if (argc > 0 && IS_NUMBER(args[0]) && val_toint(args[0]) >= 0) {
+        gc_set_limit(vm->gc, (size_t)val_toint(args[0]));
+    }
+    return VAL_INT((int64_t)previous);
+}
+
+void load_libgc(vm_t *vm)
+{
+    map_t *gc = map_new(vm);
+    vm_push(vm, VAL_OBJ(gc));
+
+    map_set(vm, gc, "collect", VAL_CFN(collectNative));
+    map_set(vm, gc, "step", VAL_CFN(stepNative));
+    map_set(vm, gc, "stats", VAL_CFN(statsNative));
+    map_set(vm, gc, "threshold", VAL_CFN(thresholdNative));
+    map_set(vm, gc, "growth", VAL_CFN(growthNative));
+    map_set(vm, gc, "limit", VAL_CFN(limitNative));
+
+    set_global(vm, "gc", VAL_OBJ(gc));
+    vm_pop(vm);
+}
@@ -0,0 +1,824 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libs.h"
+#include "vm.h"
+#include "object.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define JSON_X86
+#include <immintrin.h>
+#endif
+
+// json.parse() works in two stages. The first classifies the text 64
+// bytes at a time and records the offset of every structural character,
+// string quote and scalar start outside strings. The second walks those
+// offsets and builds maps directly, it never looks at whitespace or at
+// the inside of strings that have no escapes.
+#define JSON_DEPTH_MAX  512
+#define JSON_INDENT_MAX 10
+#define JSON_BLOCK      64
+
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;
+    uint64_t space;
+} masks_t;
+
+static void scalar_classify(const char *block, masks_t *masks)
+{
+    memset(masks, 0, sizeof(masks_t));
+
+    for (int i = 0; i < JSON_BLOCK; i++) {
+        uint64_t bit = 1ull << i;
+        switch (block[i]) {
+            case '"': masks->quote |= bit; break;
+            case '\\': masks->backslash |= bit; break;
+            case '{': case '}': case '[': case ']': case ':': case ',':
+                masks->op |= bit;
+                break;
+            case ' ': case '\t': case '\n': case '\r':
+                masks->space |= bit;
+                break;
+        }
+    }
+}
+
+#ifdef JSON_X86
+// '[' and ']' differ from '{' and '}' by 0x20 only, one compare of the
+// byte with 0x20 set covers both brackets.
+__attribute__((target("sse2")))
+static void sse2_classify(const char *block, masks_t *masks)
+{
+    memset(masks, 0, sizeof(masks_t));
+
+    for (int i = 0; i < JSON_BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+
+        __m128i op = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+
+        masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << i;
+        masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+        masks->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << i;
+        masks->space |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << i;
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_classify(const char *block, masks_t *masks)
+{
+    memset(masks, 0, sizeof(masks_t));
+
+    for (int i = 0; i < JSON_BLOCK; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+
+        __m256i op = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')),
+                _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+        __m256i space = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+
+        masks->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << i;
+        masks->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << i;
+        masks->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << i;
+        masks->space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << i;
+    }
+}
+#endif
+
+static void (*classify)(const char *block, masks_t *masks) = scalar_classify;
+
+// Bit i is set when an odd number of bits at or below i are.
+static inline uint64_t prefixXor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+typedef struct {
+    uint32_t *indexes;
+    uint32_t count;
+    uint32_t capacity;
+} index_list_t;
+
+// Stage one, false when a string is left open.
+static bool structuralIndex(const char *text, uint32_t length, index_list_t *list)
+{
+    uint64_t escapeCarry = 0;
+    uint64_t stringCarry = 0;
+    uint64_t scalarCarry = 0;
+    char tail[JSON_BLOCK];
+
+    for (uint32_t base = 0; base < length; base += JSON_BLOCK) {
+        const char *block = text + base;
+        masks_t masks;
+
+        if (length - base < JSON_BLOCK) {
+            memset(tail, ' ', JSON_BLOCK);
+            memcpy(tail, block, length - base);
+            block = tail;
+        }
+        classify(block, &masks);
+
+        // A backslash escapes the next byte unless it is escaped itself.
+        uint64_t escaped = escapeCarry;
+        escapeCarry = 0;
+        for (uint64_t bits = masks.backslash; bits != 0; bits &= bits - 1) {
+            int i = __builtin_ctzll(bits);
+            if ((escaped >> i) & 1) continue;
+            if (i == 63) escapeCarry = 1;
+            else escaped |= 1ull << (i + 1);
+        }
+
+        uint64_t quote = masks.quote & ~escaped;
+        uint64_t inString = prefixXor(quote) ^ stringCarry;
+        stringCarry = (uint64_t)((int64_t)inString >> 63);
+
+        uint64_t scalar = ~(masks.op | masks.space | masks.quote) & ~inString;
+        uint64_t scalarStart = scalar & ~((scalar << 1) | scalarCarry);
+        scalarCarry = scalar >> 63;
+
+        uint64_t bits = (masks.op & ~inString) | quote | scalarStart;
+
+        if (list->capacity < list->count + JSON_BLOCK + 1) {
+            while (list->capacity < list->count + JSON_BLOCK + 1) {
+                list->capacity = GROW_CAP(list->capacity);
+            }
+            list->indexes = realloc(list->indexes, list->capacity * sizeof(uint32_t));
+        }
+
+        for (; bits != 0; bits &= bits - 1) {
+            list->indexes[list->count++] = base + __builtin_ctzll(bits);
+        }
+    }
+
+    if (list->capacity < list->count + 1) {
+        list->capacity = list->count + 1;
+        list->indexes = realloc(list->indexes, list->capacity * sizeof(uint32_t));
+    }
+
+    // The text is NUL terminated, so is the index.
+    list->indexes[list->count] = length;
+    return stringCarry == 0;
+}
+
+typedef struct {
+    vm_t *vm;
+    str_t *source;
+    const char *text;
+    uint32_t *indexes;
+    uint32_t count;
+    uint32_t at;
+    int depth;
+} reader_t;
+
+static inline char peekToken(reader_t *reader)
+{
+    return reader->text[reader->indexes[reader->at]];
+}
+
+static int hexValue(const char *p)
+{
+    int value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') value |= (c | 0x20) - 'a' + 10;
+        else return -1;
+    }
+
+    return value;
+}
+
+static int encodeUtf8(char *dest, uint32_t code)
+{
+    if (code < 0x80) {
+        dest[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        dest[0] = (char)(0xC0 | code >> 6);
+        dest[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000) {
+        dest[0] = (char)(0xE0 | code >> 12);
+        dest[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        dest[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    dest[0] = (char)(0xF0 | code >> 18);
+    dest[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    dest[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    dest[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+// Decodes the escapes of (src) into (dest), which needs (length) bytes
+// at most. Returns the decoded length, -1 on a bad escape.
+static int unescape(char *dest, const char *src, int length)
+{
+    const char *end = src + length;
+    char *start = dest;
+
+    while (src < end) {
+        const char *slash = memchr(src, '\\', end - src);
+        if (slash == NULL) slash = end;
+
+        memcpy(dest, src, slash - src);
+        dest += slash - src;
+        src = slash;
+        if (src == end) break;
+
+        if (end - src < 2) return -1;
+        char c = src[1];
+        src += 2;
+
+        switch (c) {
+            case '"': *dest++ = '"'; break;
+            case '\\': *dest++ = '\\'; break;
+            case '/': *dest++ = '/'; break;
+            case 'b': *dest++ = '\b'; break;
+            case 'f': *dest++ = '\f'; break;
+            case 'n': *dest++ = '\n'; break;
+            case 'r': *dest++ = '\r'; break;
+            case 't': *dest++ = '\t'; break;
+            case 'u': {
+                int code;
+                if (end - src < 4 || (code = hexValue(src)) < 0) return -1;
+                src += 4;
+
+                if (code >= 0xD800 && code < 0xDC00 && end - src >= 6 &&
+                    src[0] == '\\' && src[1] == 'u') {
+                    int low = hexValue(src + 2);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        src += 6;
+                    }
+                }
+                dest += encodeUtf8(dest, (uint32_t)code);
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+
+    return (int)(dest - start);
+}
+
+// Reads the string whose opening quote is the current token. Object
+// keys are interned, values without escapes are views of the text.
+static bool readString(reader_t *reader, bool isKey, str_t **string)
+{
+    uint32_t open = reader->indexes[reader->at++];
+    uint32_t close = reader->indexes[reader->at++];
+    const char *chars = reader->text + open + 1;
+    int length = (int)(close - open - 1);
+
+    if (memchr(chars, '\\', length) == NULL) {
+        *string = isKey ? str_copy(reader->vm, chars, length, false)
+            : str_view(reader->vm, reader->source, open + 1, length);
+        return true;
+    }
+
+    char *buffer = malloc(length + 1);
+    length = unescape(buffer, chars, length);
+    if (length < 0) {
+        free(buffer);
+        return false;
+    }
+    buffer[length] = '\0';
+
+    if (isKey) {
+        *string = str_copy(reader->vm, buffer, length, false);
+        free(buffer);
+    }
+    else {
+        *string = str_take(reader->vm, buffer, length);
+    }
+    return true;
+}
+
+// Scalars run up to the next token, less trailing whitespace.
+static int scalarLength(reader_t *reader, uint32_t start)
+{
+    uint32_t end = reader->indexes[reader->at];
+    while (end > start && strchr(" \t\n\r", reader->text[end - 1]) != NULL) end--;
+    return (int)(end - start);
+}
+
+static bool readNumber(const char *p, int length, val_t *value)
+{
+    const char *end = p + length;
+    const char *s = p;
+    bool negative = false;
+    uint64_t mantissa = 0;
+    int digits = 0;
+
+    if (s < end && *s == '-') {
+        negative = true;
+        s++;
+    }
+    if (s == end || *s < '0' || *s > '9') return false;
+    if (*s == '0' && s + 1 < end && s[1] >= '0' && s[1] <= '9') return false;
+
+    for (; s < end && *s >= '0' && *s <= '9'; s++, digits++) {
+        mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+    }
+
+    if (s == end && digits <= 18) {
+        *value = VAL_INT(negative ? -(int64_t)mantissa : (int64_t)mantissa);
+        return true;
+    }
+
+    if (s < end && *s == '.') {
+        if (++s == end || *s < '0' || *s > '9') return false;
+        while (s < end && *s >= '0' && *s <= '9') s++;
+    }
+    if (s < end && (*s | 0x20) == 'e') {
+        s++;
+        if (s < end && (*s == '+' || *s == '-')) s++;
+        if (s == end || *s < '0' || *s > '9') return false;
+        while (s < end && *s >= '0' && *s <= '9') s++;
+    }
+    if (s != end) return false;
+
+    *value = VAL_NUM(strtod(p, NULL));
+    return true;
+}
+
+static bool readValue(reader_t *reader, val_t *value);
+
+static bool readObject(reader_t *reader, val_t *value)
+{
+    vm_t *vm = reader->vm;
+    map_t *map = map_new(vm);
+    vm_push(vm, VAL_OBJ(map));
+
+    if (peekToken(reader) == '}') {
+        reader->at++;
+    }
+    else for (;;) {
+        str_t *key;
+        val_t field;
+
+        if (peekToken(reader) != '"' || !readString(reader, true, &key)) return false;
+        vm_push(vm, VAL_OBJ(key));
+
+        if (peekToken(reader) != ':') return false;
+        reader->at++;
+
+        if (!readValue(reader, &field)) return false;
+        map_put(vm->gc, map, key, field);
+        vm_pop(vm);
+
+        char c = peekToken(reader);
+        reader->at++;
+        if (c == '}') break;
+        if (c != ',') return false;
+    }
+
+    *value = vm_pop(vm);
+    return true;
+}
+
+// Arrays are maps keyed 0 to n-1 on the integer path, marked so that
+// an empty one is still written back as [].
+static bool readArray(reader_t *reader, val_t *value)
+{
+    vm_t *vm = reader->vm;
+    map_t *map = map_new(vm);
+    map->isArray = true;
+    vm_push(vm, VAL_OBJ(map));
+
+    if (peekToken(reader) == ']') {
+        reader->at++;
+    }
+    else for (int64_t index = 0; ; index++) {
+        val_t element;
+
+        if (!readValue(reader, &element)) return false;
+        map_put_index(vm->gc, map, index, element);
+
+        char c = peekToken(reader);
+        reader->at++;
+        if (c == ']') break;
+        if (c != ',') return false;
+    }
+
+    *value = vm_pop(vm);
+    return true;
+}
+
+static bool readValue(reader_t *reader, val_t *value)
+{
+    if (reader->at >= reader->count || reader->depth == JSON_DEPTH_MAX) return false;
+
+    uint32_t start = reader->indexes[reader->at];
+    const char *p = reader->text + start;
+    bool ok;
+
+    switch (*p) {
+        case '{':
+        case '[':
+            reader->at++;
+            reader->depth++;
+            ok = *p == '{' ? readObject(reader, value) : readArray(reader, value);
+            reader->depth--;
+            return ok;
+        case '"': {
+            str_t *string;
+            if (!readString(reader, false, &string)) return false;
+            *value = VAL_OBJ(string);
+            return true;
+        }
+    }
+
+    reader->at++;
+    int length = scalarLength(reader, start);
+
+    if (length == 4 && memcmp(p, "true", 4) == 0) *value = VAL_TRUE;
+    else if (length == 5 && memcmp(p, "false", 5) == 0) *value = VAL_FALSE;
+    else if (length == 4 && memcmp(p, "null", 4) == 0) *value = VAL_NULL;
+    else return readNumber(p, length, value);
+
+    return true;
+}
+
+static val_t json_parse(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 1 || !IS_STR(args[0])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    index_list_t list = { NULL, 0, 0 };
+    val_t result = VAL_NULL;
+    val_t *top = vm->top;
+
+    // str_cstr() guarantees the terminator the index ends on.
+    const char *text = str_cstr(string);
+
+    // Everything allocated below stays reachable until the parse ends.
+    vm->gc->paused++;
+
+    if (structuralIndex(text, (uint32_t)string->length, &list)) {
+        reader_t reader = { vm, string, text, list.indexes, list.count, 0, 0 };
+        if (!readValue(&reader, &result) || reader.at != reader.count) {
+            result = VAL_NULL;
+        }
+    }
+
+    vm->gc->paused--;
+    vm->top = top;
+    free(list.indexes);
+    return result;
+}
+
+// The serializer appends to one growable buffer that becomes the
+// result string as is.
+typedef struct {
+    char *chars;
+    size_t length;
+    size_t capacity;
+    int indent;
+    int depth;
+} writer_t;
+
+static void reserve(writer_t *writer, size_t size)
+{
+    if (writer->length + size <= writer->capacity) return;
+
+    while (writer->length + size > writer->capacity) {
+        writer->capacity = GROW_CAP(writer->capacity);
+    }
+    writer->chars = realloc(writer->chars, writer->capacity);
+}
+
+static inline void append(writer_t *writer, const char *chars, size_t length)
+{
+    reserve(writer, length);
+    memcpy(writer->chars + writer->length, chars, length);
+    writer->length += length;
+}
+
+static inline void writeChar(writer_t *writer, char c)
+{
+    reserve(writer, 1);
+    writer->chars[writer->length++] = c;
+}
+
+static void newline(writer_t *writer)
+{
+    if (writer->indent <= 0) return;
+
+    size_t count = (size_t)writer->indent * writer->depth;
+    reserve(writer, count + 1);
+    writer->chars[writer->length++] = '\n';
+    memset(writer->chars + writer->length, ' ', count);
+    writer->length += count;
+}
+
+static void writeString(writer_t *writer, const char *chars, int length)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *end = chars + length;
+
+    writeChar(writer, '"');
+
+    while (chars < end) {
+        const char *run = chars;
+        while (run < end && (uint8_t)*run >= 0x20 && *run != '"' && *run != '\\') run++;
+        append(writer, chars, run - chars);
+        if (run == end) break;
+
+        char c = *run;
+        char escape[6] = { '\\', 0 };
+        int size = 2;
+
+        switch (c) {
+            case '"': escape[1] = '"'; break;
+            case '\\': escape[1] = '\\'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            default:
+                memcpy(escape + 1, "u00", 3);
+                escape[4] = hex[(c >> 4) & 0xF];
+                escape[5] = hex[c & 0xF];
+                size = 6;
+                break;
+        }
+
+        append(writer, escape, size);
+        chars = run + 1;
+    }
+
+    writeChar(writer, '"');
+}
+
+static void writeInt(writer_t *writer, int64_t value)
+{
+    char buffer[24];
+    char *p = buffer + sizeof(buffer);
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) *--p = '-';
+
+    append(writer, p, buffer + sizeof(buffer) - p);
+}
+
+// Shortest of %.15g, %.16g and %.17g that reads back the same double.
+static void writeNumber(writer_t *writer, double value)
+{
+    char buffer[32];
+    int length = 0;
+
+    if (!isfinite(value)) {
+        append(writer, "null", 4);
+        return;
+    }
+
+    for (int precision = 15; precision <= 17; precision++) {
+        length = snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (strtod(buffer, NULL) == value) break;
+    }
+    append(writer, buffer, length);
+}
+
+static bool writeValue(writer_t *writer, val_t value);
+
+static void openContainer(writer_t *writer, char c)
+{
+    writeChar(writer, c);
+    writer->depth++;
+}
+
+static void closeContainer(writer_t *writer, char c, bool empty)
+{
+    writer->depth--;
+    if (!empty) newline(writer);
+    writeChar(writer, c);
+}
+
+static void separate(writer_t *writer, bool first)
+{
+    if (!first) writeChar(writer, ',');
+    newline(writer);
+}
+
+static void writeKey(writer_t *writer, const char *chars, int length)
+{
+    writeString(writer, chars, length);
+    writeChar(writer, ':');
+    if (writer->indent > 0) writeChar(writer, ' ');
+}
+
+// Maps keyed exactly 0 to n-1 are written back as arrays, empty ones
+// only when they were parsed from one.
+static bool isSequence(map_t *map)
+{
+    val_t value;
+
+    if (map->table.count > 0) return false;
+    if (map->hash.count == 0) return map->isArray;
+    for (int64_t i = 0; i < map->hash.count; i++) {
+        if (!hash_get(&map->hash, i, &value)) return false;
+    }
+    return true;
+}
+
+static bool writeMap(writer_t *writer, map_t *map)
+{
+    bool first = true;
+
+    if (isSequence(map)) {
+        openContainer(writer, '[');
+        for (int64_t i = 0; i < map->hash.count; i++) {
+            val_t value;
+            hash_get(&map->hash, i, &value);
+            separate(writer, i == 0);
+            if (!writeValue(writer, value)) return false;
+        }
+        closeContainer(writer, ']', map->hash.count == 0);
+        return true;
+    }
+
+    openContainer(writer, '{');
+
+    for (int i = 0; i < map->table.capacity; i++) {
+        ent_t *entry = &map->table.entries[i];
+        if (entry->key == NULL) continue;
+
+        separate(writer, first);
+        first = false;
+        writeKey(writer, str_flatten(entry->key), entry->key->length);
+        if (!writeValue(writer, entry->value)) return false;
+    }
+
+    for (int i = 0; i < map->hash.capacity; i++) {
+        index_t *index = &map->hash.indexes[i];
+        if (!index->used) continue;
+
+        char key[24];
+        separate(writer, first);
+        first = false;
+        writeKey(writer, key, snprintf(key, sizeof(key), "%lld", (long long)index->key));
+        if (!writeValue(writer, index->value)) return false;
+    }
+
+    closeContainer(writer, '}', first);
+    return true;
+}
+
+// Multi-dimensional arrays nest one JSON array per dimension.
+static bool writeArray(writer_t *writer, ary_t *array, int dim, int offset)
+{
+    int size = array->sizes[dim];
+
+    openContainer(writer, '[');
+    for (int i = 0; i < size; i++) {
+        separate(writer, i == 0);
+        bool ok = dim + 1 < array->dims
+            ? writeArray(writer, array, dim + 1, (offset + i) * array->sizes[dim + 1])
+            : writeValue(writer, array->values[offset + i]);
+        if (!ok) return false;
+    }
+    closeContainer(writer, ']', size == 0);
+    return true;
+}
+
+static bool writeValue(writer_t *writer, val_t value)
+{
+    if (writer->depth == JSON_DEPTH_MAX) return false;
+
+    switch (AS_TYPE(value)) {
+        case VT_NULL:
+            append(writer, "null", 4);
+            return true;
+        case VT_BOOL:
+            if (AS_BOOL(value)) append(writer, "true", 4);
+            else append(writer, "false", 5);
+            return true;
+        case VT_INT:
+            writeInt(writer, AS_INT(value));
+            return true;
+        case VT_NUM:
+            writeNumber(writer, AS_NUM(value));
+            return true;
+        case VT_OBJ:
+            break;
+        default:
+            append(writer, "null", 4);
+            return true;
+    }
+
+    switch (OBJ_TYPE(value)) {
+        case OT_STR: {
+            str_t *string = AS_STR(value);
+            writeString(writer, str_flatten(string), string->length);
+            return true;
+        }
+        case OT_MAP:
+            return writeMap(writer, AS_MAP(value));
+        case OT_ARR:
+            return writeArray(writer, AS_ARR(value), 0, 0);
+        case OT_VEC: {
+            vec_t *vector = AS_VEC(value);
+            openContainer(writer, '[');
+            for (int i = 0; i < vector->count; i++) {
+                separate(writer, i == 0);
+                writeNumber(writer, vector->data[i]);
+            }
+            closeContainer(writer, ']', vector->count == 0);
+            return true;
+        }
+        default:
+            append(writer, "null", 4);
+            return true;
+    }
+}
+
+// json.stringify(value [, indent]), null when the value nests too
+// deep, as a cycle does. The indent is clamped to 0..10.
+static val_t json_stringify(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 1) return VAL_NULL;
+
+    writer_t writer = { NULL, 0, 0, 0, 0 };
+    if (argc > 1 && IS_NUMBER(args[1])) {
+        int64_t indent = val_toint(args[1]);
+        writer.indent = indent < 0 ? 0 : indent > JSON_INDENT_MAX ? JSON_INDENT_MAX : (int)indent;
+    }
+
+    if (!writeValue(&writer, args[0]) || writer.length > INT32_MAX - 1) {
+        free(writer.chars);
+        return VAL_NULL;
+    }
+
+    reserve(&writer, 1);
+    writer.chars[writer.length] = '\0';
+    return VAL_OBJ(str_take(vm, writer.chars, (int)writer.length));
+}
+
+#ifdef JSON_X86
+// Picked once as the program loads, before VMs on other threads read it.
+__attribute__((constructor))
+static void selectClassify(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        classify = avx2_classify;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        classify = sse2_classify;
+    }
+}
+#endif
+
+void load_libjson(vm_t *vm)
+{
+    map_t *json = map_new(vm);
+    vm_push(vm, VAL_OBJ(json));
+
+    map_set(vm, json, "parse", VAL_CFN(json_parse));
+    map_set(vm, json, "stringify", VAL_CFN(json_stringify));
+
+    set_global(vm, "json", VAL_OBJ(json));
+    vm_pop(vm);
+}
@@ -1,13 +1,196 @@
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "libs.h"
 #include "vm.h"
 #include "object.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MATH_X86
+#include <immintrin.h>
+#endif
+
+// Bulk kernels over packed doubles, load_libmath() picks the widest
+// set the CPU supports. Transcendentals have no SIMD instruction and
+// run through libm element by element.
+typedef void (*vbinary_t)(double *r, const double *a, const double *b, int n);
+typedef double (*vreduce_t)(const double *a, int n);
+
+typedef struct {
+    const char *name;
+    vbinary_t add, sub, mul, div;
+    void (*scale)(double *r, const double *a, double k, int n);
+    void (*sqrt)(double *r, const double *a, int n);
+    double (*dot)(const double *a, const double *b, int n);
+    vreduce_t sum, min, max;
+} kernels_t;
+
+#define SCALAR_BINARY(name, op) \
+    static void scalar_##name(double *r, const double *a, const double *b, int n) \
+    { \
+        for (int i = 0; i < n; i++) r[i] = a[i] op b[i]; \
+    }
+
+SCALAR_BINARY(add, +)
+SCALAR_BINARY(sub, -)
+SCALAR_BINARY(mul, *)
+SCALAR_BINARY(div, /)
+
+static void scalar_scale(double *r, const double *a, double k, int n)
+{
+    for (int i = 0; i < n; i++) r[i] = a[i] * k;
+}
+
+static void scalar_sqrt(double *r, const double *a, int n)
+{
+    for (int i = 0; i < n; i++) r[i] = sqrt(a[i]);
+}
+
+static double scalar_dot(const double *a, const double *b, int n)
+{
+    double result = 0;
+    for (int i = 0; i < n; i++) result += a[i] * b[i];
+    return result;
+}
+
+static double scalar_sum(const double *a, int n)
+{
+    double result = 0;
+    for (int i = 0; i < n; i++) result += a[i];
+    return result;
+}
+
+static double scalar_min(const double *a, int n)
+{
+    double result = a[0];
+    for (int i = 1; i < n; i++) if (a[i] < result) result = a[i];
+    return result;
+}
+
+static double scalar_max(const double *a, int n)
+{
+    double result = a[0];
+    for (int i = 1; i < n; i++) if (a[i] > result) result = a[i];
+    return result;
+}
+
+static const kernels_t scalarKernels = {
+    "scalar",
+    scalar_add, scalar_sub, scalar_mul, scalar_div,
+    scalar_scale, scalar_sqrt, scalar_dot,
+    scalar_sum, scalar_min, scalar_max
+};
+
+#ifdef MATH_X86
+// (isa) is the target attribute, (V) the register type, (W) its width
+// in doubles and (P) the prefix of the intrinsics.
+#define SIMD_KERNELS(isa, V, W, P) \
+    SIMD_BINARY(isa, V, W, P, add, +) \
+    SIMD_BINARY(isa, V, W, P, sub, -) \
+    SIMD_BINARY(isa, V, W, P, mul, *) \
+    SIMD_BINARY(isa, V, W, P, div, /) \
+    \
+    __attribute__((target(#isa))) \
+    static void isa##_scale(double *r, const double *a, double k, int n) \
+    { \
+        V vk = P##_set1_pd(k); \
+        int i = 0; \
+        for (; i + W <= n; i += W) \
+            P##_storeu_pd(r + i, P##_mul_pd(P##_loadu_pd(a + i), vk)); \
+        for (; i < n; i++) r[i] = a[i] * k; \
+    } \
+    \
+    __attribute__((target(#isa))) \
+    static void isa##_sqrt(double *r, const double *a, int n) \
+    { \
+        int i = 0; \
+        for (; i + W <= n; i += W) \
+            P##_storeu_pd(r + i, P##_sqrt_pd(P##_loadu_pd(a + i))); \
+        for (; i < n; i++) r[i] = sqrt(a[i]); \
+    } \
+    \
+    __attribute__((target(#isa))) \
+    static double isa##_dot(const double *a, const double *b, int n) \
+    { \
+        V acc = P##_setzero_pd(); \
+        int i = 0; \
+        for (; i + W <= n; i += W) \
+            acc = P##_add_pd(acc, P##_mul_pd(P##_loadu_pd(a + i), P##_loadu_pd(b + i))); \
+        double lanes[W]; \
+        P##_storeu_pd(lanes, acc); \
+        return scalar_sum(lanes, W) + scalar_dot(a + i, b + i, n - i); \
+    } \
+    \
+    __attribute__((target(#isa))) \
+    static double isa##_sum(const double *a, int n) \
+    { \
+        V acc = P##_setzero_pd(); \
+        int i = 0; \
+        for (; i + W <= n; i += W) \
+            acc = P##_add_pd(acc, P##_loadu_pd(a + i)); \
+        double lanes[W]; \
+        P##_storeu_pd(lanes, acc); \
+        return scalar_sum(lanes, W) + scalar_sum(a + i, n - i); \
+    } \
+    \
+    SIMD_EXTREME(isa, V, W, P, min, <) \
+    SIMD_EXTREME(isa, V, W, P, max, >)
+
+#define SIMD_BINARY(isa, V, W, P, name, op) \
+    __attribute__((target(#isa))) \
+    static void isa##_##name(double *r, const double *a, const double *b, int n) \
+    { \
+        int i = 0; \
+        for (; i + W <= n; i += W) \
+            P##_storeu_pd(r + i, P##_##name##_pd(P##_loadu_pd(a + i), P##_loadu_pd(b + i))); \
+        for (; i < n; i++) r[i] = a[i] op b[i]; \
+    }
+
+#define SIMD_EXTREME(isa, V, W, P, name, op) \
+    __attribute__((target(#isa))) \
+    static double isa##_##name(const double *a, int n) \
+    { \
+        if (n < W) return scalar_##name(a, n); \
+        V acc = P##_loadu_pd(a); \
+        int i = W; \
+        for (; i + W <= n; i += W) \
+            acc = P##_##name##_pd(acc, P##_loadu_pd(a + i)); \
+        double lanes[W]; \
+        P##_storeu_pd(lanes, acc); \
+        double result = scalar_##name(lanes, W); \
+        for (; i < n; i++) if (a[i] op result) result = a[i]; \
+        return result; \
+    }
+
+SIMD_KERNELS(sse2, __m128d, 2, _mm)
+SIMD_KERNELS(avx2, __m256d, 4, _mm256)
+
+static const kernels_t sse2Kernels = {
+    "sse2",
+    sse2_add, sse2_sub, sse2_mul, sse2_div,
+    sse2_scale, sse2_sqrt, sse2_dot,
+    sse2_sum, sse2_min, sse2_max
+};
+
+static const kernels_t avx2Kernels = {
+    "avx2",
+    avx2_add, avx2_sub, avx2_mul, avx2_div,
+    avx2_scale, avx2_sqrt, avx2_dot,
+    avx2_sum, avx2_min, avx2_max
+};
+#endif
+
+static const kernels_t *kernels = &scalarKernels;
+
 static val_t math_abs(vm_t *vm, int argc, val_t *args)
 {
-    double number = AS_NUM(args[0]);
+    if (IS_INT(args[0]) && AS_INT(args[0]) != INT64_MIN) {
+        int64_t i = AS_INT(args[0]);
+        return VAL_INT(i < 0 ? -i : i);
+    }
+
+    double number = val_tonum(args[0]);
     double result = (number < 0) ? (-number) : number;
 
     return VAL_NUM(result);
@@ -15,7 +198,7 @@ static val_t math_abs(vm_t *vm, int argc, val_t *args)
 
 static val_t math_ceil(vm_t *vm, int argc, val_t *args)
 {
-    double x = AS_NUM(args[0]);
+    double x = val_tonum(args[0]);
     double result = ceil(x);
 
     return VAL_NUM(result);
@@ -23,7 +206,7 @@ static val_t math_ceil(vm_t *vm, int argc, val_t *args)
 
 static val_t math_cos(vm_t *vm, int argc, val_t *args)
 {
-    double x = AS_NUM(args[0]);
+    double x = val_tonum(args[0]);
     double result = cos(x);
 
     return VAL_NUM(result);
@@ -31,7 +214,7 @@ static val_t math_cos(vm_t *vm, int argc, val_t *args)
 
 static val_t math_floor(vm_t *vm, int argc, val_t *args)
 {
-    double x = AS_NUM(args[0]);
+    double x = val_tonum(args[0]);
     double result = floor(x);
 
     return VAL_NUM(result);
@@ -39,7 +222,7 @@ static val_t math_floor(vm_t *vm, int argc, val_t *args)
 
 static val_t math_log(vm_t *vm, int argc, val_t *args)
 {
-    double x = AS_NUM(args[0]);
+    double x = val_tonum(args[0]);
     double result = log(x);
 
     return VAL_NUM(result);
@@ -47,7 +230,7 @@ static val_t math_log(vm_t *vm, int argc, val_t *args)
 
 static val_t math_log10(vm_t *vm, int argc, val_t *args)
 {
-    double x = AS_NUM(args[0]);
+    double x = val_tonum(args[0]);
     double result = log10(x);
 
     return VAL_NUM(result);
@@ -55,8 +238,8 @@ static val_t math_log10(vm_t *vm, int argc, val_t *args)
 
 static val_t math_pow(vm_t *vm, int argc, val_t *args)
 {
-    double x = AS_NUM(args[0]);
-    double y = AS_NUM(args[1]);
+    double x = val_tonum(args[0]);
+    double y = val_tonum(args[1]);
     double result = pow(x, y);
 
     return VAL_NUM(result);
@@ -64,7 +247,7 @@ static val_t math_pow(vm_t *vm, int argc, val_t *args)
 
 static val_t math_sin(vm_t *vm, int argc, val_t *args)
 {
-    double x = AS_NUM(args[0]);
+    double x = val_tonum(args[0]);
     double result = sin(x);
 
     return VAL_NUM(result);
@@ -72,15 +255,192 @@ static val_t math_sin(vm_t *vm, int argc, val_t *args)
 
 static val_t math_sqrt(vm_t *vm, int argc, val_t *args)
 {
-    double x = AS_NUM(args[0]);
+    double x = val_tonum(args[0]);
     double result = sqrt(x);
 
     return VAL_NUM(result);
 }
 
+// math.vec(n) makes n zeros, math.vec($a) copies the numbers of an
+// array, a map literal or another vector.
+static val_t math_vec(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 1) return VAL_NULL;
+
+    if (IS_NUMBER(args[0])) {
+        int64_t count = val_toint(args[0]);
+        if (count < 0 || count > ARY_COUNT_MAX) return VAL_NULL;
+        return VAL_OBJ(vec_new(vm, (int)count));
+    }
+    else if (IS_ARR(args[0])) {
+        ary_t *array = AS_ARR(args[0]);
+        vec_t *vector = vec_new(vm, array->count);
+        for (int i = 0; i < array->count; i++) {
+            val_t value = array->values[i];
+            vector->data[i] = IS_NUMBER(value) ? val_tonum(value) : 0;
+        }
+        return VAL_OBJ(vector);
+    }
+    else if (IS_MAP(args[0])) {
+        map_t *map = AS_MAP(args[0]);
+        vec_t *vector = vec_new(vm, map->hash.count);
+        for (int i = 0; i < map->hash.count; i++) {
+            val_t value = VAL_NULL;
+            hash_get(&map->hash, i, &value);
+            vector->data[i] = IS_NUMBER(value) ? val_tonum(value) : 0;
+        }
+        return VAL_OBJ(vector);
+    }
+    else if (IS_VEC(args[0])) {
+        vec_t *source = AS_VEC(args[0]);
+        vec_t *vector = vec_new(vm, source->count);
+        memcpy(vector->data, source->data, sizeof(double) * source->count);
+        return VAL_OBJ(vector);
+    }
+
+    return VAL_NULL;
+}
+
+static val_t vectorBinary(vm_t *vm, int argc, val_t *args, vbinary_t kernel)
+{
+    if (argc < 2 || !IS_VEC(args[0]) || !IS_VEC(args[1])) return VAL_NULL;
+
+    vec_t *a = AS_VEC(args[0]);
+    vec_t *b = AS_VEC(args[1]);
+    if (a->count != b->count) return VAL_NULL;
+
+    vec_t *result = vec_new(vm, a->count);
+    kernel(result->data, a->data, b->data, a->count);
+    return VAL_OBJ(result);
+}
+
+static val_t vectorMap(vm_t *vm, int argc, val_t *args, double (*fn)(double))
+{
+    if (argc < 1 || !IS_VEC(args[0])) return VAL_NULL;
+
+    vec_t *a = AS_VEC(args[0]);
+    vec_t *result = vec_new(vm, a->count);
+    for (int i = 0; i < a->count; i++) {
+        result->data[i] = fn(a->data[i]);
+    }
+    return VAL_OBJ(result);
+}
+
+static val_t vectorReduce(int argc, val_t *args, vreduce_t kernel)
+{
+    if (argc < 1 || !IS_VEC(args[0]) || AS_VEC(args[0])->count == 0) return VAL_NULL;
+
+    vec_t *a = AS_VEC(args[0]);
+    return VAL_NUM(kernel(a->data, a->count));
+}
+
+static val_t math_vadd(vm_t *vm, int argc, val_t *args)
+{
+    return vectorBinary(vm, argc, args, kernels->add);
+}
+
+static val_t math_vsub(vm_t *vm, int argc, val_t *args)
+{
+    return vectorBinary(vm, argc, args, kernels->sub);
+}
+
+static val_t math_vmul(vm_t *vm, int argc, val_t *args)
+{
+    return vectorBinary(vm, argc, args, kernels->mul);
+}
+
+static val_t math_vdiv(vm_t *vm, int argc, val_t *args)
+{
+    return vectorBinary(vm, argc, args, kernels->div);
+}
+
+static val_t math_vscale(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_VEC(args[0]) || !IS_NUMBER(args[1])) return VAL_NULL;
+
+    vec_t *a = AS_VEC(args[0]);
+    vec_t *result = vec_new(vm, a->count);
+    kernels->scale(result->data, a->data, val_tonum(args[1]), a->count);
+    return VAL_OBJ(result);
+}
+
+static val_t math_vsqrt(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 1 || !IS_VEC(args[0])) return VAL_NULL;
+
+    vec_t *a = AS_VEC(args[0]);
+    vec_t *result = vec_new(vm, a->count);
+    kernels->sqrt(result->data, a->data, a->count);
+    return VAL_OBJ(result);
+}
+
+static val_t math_vsin(vm_t *vm, int argc, val_t *args)
+{
+    return vectorMap(vm, argc, args, sin);
+}
+
+static val_t math_vcos(vm_t *vm, int argc, val_t *args)
+{
+    return vectorMap(vm, argc, args, cos);
+}
+
+static val_t math_vlog(vm_t *vm, int argc, val_t *args)
+{
+    return vectorMap(vm, argc, args, log);
+}
+
+static val_t math_dot(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_VEC(args[0]) || !IS_VEC(args[1])) return VAL_NULL;
+
+    vec_t *a = AS_VEC(args[0]);
+    vec_t *b = AS_VEC(args[1]);
+    if (a->count != b->count) return VAL_NULL;
+
+    return VAL_NUM(kernels->dot(a->data, b->data, a->count));
+}
+
+static val_t math_sum(vm_t *vm, int argc, val_t *args)
+{
+    if (argc >= 1 && IS_VEC(args[0]) && AS_VEC(args[0])->count == 0) return VAL_NUM(0);
+    return vectorReduce(argc, args, kernels->sum);
+}
+
+static val_t math_vmin(vm_t *vm, int argc, val_t *args)
+{
+    return vectorReduce(argc, args, kernels->min);
+}
+
+static val_t math_vmax(vm_t *vm, int argc, val_t *args)
+{
+    return vectorReduce(argc, args, kernels->max);
+}
+
+static val_t math_simd(vm_t *vm, int argc, val_t *args)
+{
+    const char *name = kernels->name;
+    return VAL_OBJ(str_new(vm, name, (int)strlen(name)));
+}
+
+#ifdef MATH_X86
+// Picked once as the program loads, before VMs on other threads read it.
+__attribute__((constructor))
+static void selectKernels(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels = &avx2Kernels;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        kernels = &sse2Kernels;
+    }
+}
+#endif
+
 void load_libmath(vm_t *vm)
 {
     map_t *math = map_new(vm);
+    vm_push(vm, VAL_OBJ(math));
 
     map_set(vm, math, "abs", VAL_CFN(math_abs));
     map_set(vm, math, "ceil", VAL_CFN(math_ceil));
@@ -92,5 +452,22 @@ void load_libmath(vm_t *vm)
     map_set(vm, math, "sin", VAL_CFN(math_sin));
     map_set(vm, math, "sqrt", VAL_CFN(math_sqrt));
 
+    map_set(vm, math, "vec", VAL_CFN(math_vec));
+    map_set(vm, math, "vadd", VAL_CFN(math_vadd));
+    map_set(vm, math, "vsub", VAL_CFN(math_vsub));
+    map_set(vm, math, "vmul", VAL_CFN(math_vmul));
+    map_set(vm, math, "vdiv", VAL_CFN(math_vdiv));
+    map_set(vm, math, "vscale", VAL_CFN(math_vscale));
+    map_set(vm, math, "vsqrt", VAL_CFN(math_vsqrt));
+    map_set(vm, math, "vsin", VAL_CFN(math_vsin));
+    map_set(vm, math, "vcos", VAL_CFN(math_vcos));
+    map_set(vm, math, "vlog", VAL_CFN(math_vlog));
+    map_set(vm, math, "dot", VAL_CFN(math_dot));
+    map_set(vm, math, "sum", VAL_CFN(math_sum));
+    map_set(vm, math, "vmin", VAL_CFN(math_vmin));
+    map_set(vm, math, "vmax", VAL_CFN(math_vmax));
+    map_set(vm, math, "simd", VAL_CFN(math_simd));
+
     set_global(vm, "math", VAL_OBJ(math));
+    vm_pop(vm);
 }
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "libs.h"
+#include "vm.h"
+#include "object.h"
+#include "regexp.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL    __declspec(thread)
+#else
+#define THREAD_LOCAL    _Thread_local
+#endif
+
+// Compiled patterns are kept in a small LRU cache per thread, looked
+// up by the pattern's string hash, which interned pattern constants
+// already carry. The bytes are compared too since a collected string
+// may hand its address and hash to another. A thread's cache is freed
+// when the thread exits.
+#define REGEX_CACHE_SIZE    16
+
+#define REGEX_MATCH         0
+#define REGEX_GROUPS        1
+#define REGEX_FULL          2
+#define REGEX_GROUPS_ALL    3
+#define REGEX_FULL_ALL      4
+
+typedef struct {
+    uint32_t hash;
+    int length;
+    char *pattern;
+    rx_t *rx;
+    uint64_t used;
+} cached_t;
+
+static THREAD_LOCAL cached_t cache[REGEX_CACHE_SIZE];
+static THREAD_LOCAL uint64_t ticks;
+
+#ifdef _WIN32
+static void NTAPI releaseCache(void *data)
+#else
+static void releaseCache(void *data)
+#endif
+{
+    cached_t *entries = data;
+
+    for (int i = 0; i < REGEX_CACHE_SIZE; i++) {
+        rx_free(entries[i].rx);
+        free(entries[i].pattern);
+        entries[i].rx = NULL;
+        entries[i].pattern = NULL;
+    }
+}
+
+#ifdef _WIN32
+static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+static DWORD key;
+
+static BOOL CALLBACK createKey(INIT_ONCE *init, void *param, void **context)
+{
+    key = FlsAlloc(releaseCache);
+    return TRUE;
+}
+
+// Has releaseCache() free this thread's cache when it exits.
+static void registerCache(void)
+{
+    InitOnceExecuteOnce(&once, createKey, NULL, NULL);
+    FlsSetValue(key, cache);
+}
+#else
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static void createKey(void)
+{
+    pthread_key_create(&key, releaseCache);
+}
+
+// Has releaseCache() free this thread's cache when it exits.
+static void registerCache(void)
+{
+    pthread_once(&once, createKey);
+    pthread_setspecific(key, cache);
+}
+#endif
+
+static rx_t *cached(str_t *pattern)
+{
+    uint32_t hash = str_hash(pattern);
+    const char *chars = str_flatten(pattern);
+    cached_t *victim = &cache[0];
+
+    for (int i = 0; i < REGEX_CACHE_SIZE; i++) {
+        cached_t *entry = &cache[i];
+        if (entry->rx != NULL && entry->hash == hash && entry->length == pattern->length &&
+            memcmp(entry->pattern, chars, pattern->length) == 0) {
+            entry->used = ++ticks;
+            return entry->rx;
+        }
+        if (entry->used < victim->used) victim = entry;
+    }
+
+    const char *error;
+    rx_t *rx = rx_compile(chars, pattern->length, &error);
+    if (rx == NULL) return NULL;
+
+    if (ticks == 0) registerCache();
+
+    rx_free(victim->rx);
+    free(victim->pattern);
+
+    victim->hash = hash;
+    victim->length = pattern->length;
+    victim->pattern = malloc(pattern->length + 1);
+    memcpy(victim->pattern, chars, pattern->length);
+    victim->rx = rx;
+    victim->used = ++ticks;
+    return rx;
+}
+
+static val_t capture(vm_t *vm, str_t *subject, const int *caps, int group)
+{
+    int start = caps[group * 2];
+    int end = caps[group * 2 + 1];
+    if (start < 0) return VAL_OBJ(str_view(vm, subject, 0, 0));
+    return VAL_OBJ(str_view(vm, subject, start, end - start));
+}
+
+// Fills (array) from (index) with groups (first) through (last).
+static void captures(vm_t *vm, ary_t *array, int index, str_t *subject,
+    const int *caps, int first, int last)
+{
+    for (int group = first; group <= last; group++) {
+        array->values[index++] = capture(vm, subject, caps, group);
+    }
+}
+
+// Scans (subject) for every match, each takes (ncap) slots in (*out).
+static int matchAll(rx_t *rx, const char *chars, int length, int ncap, int **out)
+{
+    int capacity = 0, count = 0;
+    int *matches = NULL;
+    int caps[(RX_GROUPS_MAX + 1) * 2];
+
+    for (int from = 0; rx_search(rx, chars, length, from, caps, true); ) {
+        if (count == ARY_COUNT_MAX) break;
+        if (capacity < count + 1) {
+            capacity = GROW_CAP(capacity);
+            matches = realloc(matches, capacity * ncap * sizeof(int));
+        }
+        memcpy(matches + count++ * ncap, caps, ncap * sizeof(int));
+
+        // An empty match moves on by one so the scan makes progress.
+        from = caps[1] > caps[0] ? caps[1] : caps[1] + 1;
+    }
+
+    *out = matches;
+    return count;
+}
+
+static val_t regexp(vm_t *vm, str_t *subject, str_t *pattern, int flag)
+{
+    rx_t *rx = cached(pattern);
+    if (rx == NULL) return VAL_NULL;
+
+    const char *chars = str_flatten(subject);
+    int groups = rx_groups(rx);
+    int ncap = (groups + 1) * 2;
+    int caps[(RX_GROUPS_MAX + 1) * 2];
+
+    // Without groups the whole match stands in for them.
+    int first = groups > 0 ? 1 : 0;
+    int count;
+
+    switch (flag) {
+        case REGEX_MATCH:
+            return VAL_BOOL(rx_search(rx, chars, subject->length, 0, caps, false));
+        case REGEX_GROUPS:
+        case REGEX_FULL: {
+            if (!rx_search(rx, chars, subject->length, 0, caps, true)) return VAL_NULL;
+            if (flag == REGEX_FULL) first = 0;
+
+            count = groups - first + 1;
+            ary_t *array = ary_new(vm, 1, &count);
+            vm_push(vm, VAL_OBJ(array));
+            captures(vm, array, 0, subject, caps, first, groups);
+            vm_pop(vm);
+            return VAL_OBJ(array);
+        }
+        case REGEX_GROUPS_ALL:
+        case REGEX_FULL_ALL: {
+            int *matches;
+            int found = matchAll(rx, chars, subject->length, ncap, &matches);
+            if (found == 0) return VAL_NULL;
+
+            int width = groups - first + 1;
+            int64_t total = flag == REGEX_FULL_ALL ? found : (int64_t)found * width;
+            if (total > ARY_COUNT_MAX) {
+                free(matches);
+                return VAL_NULL;
+            }
+
+            count = (int)total;
+            ary_t *array = ary_new(vm, 1, &count);
+            vm_push(vm, VAL_OBJ(array));
+
+            for (int i = 0; i < found; i++) {
+                int *match = matches + i * ncap;
+                if (flag == REGEX_GROUPS_ALL) {
+                    captures(vm, array, i * width, subject, match, first, groups);
+                    continue;
+                }
+
+                count = groups + 1;
+                ary_t *row = ary_new(vm, 1, &count);
+                array->values[i] = VAL_OBJ(row);
+                captures(vm, row, 0, subject, match, 0, groups);
+            }
+
+            vm_pop(vm);
+            free(matches);
+            return VAL_OBJ(array);
+        }
+    }
+
+    return VAL_NULL;
+}
+
+// StringRegExp($s, $pattern [, flag]), flag 0 tests for a match, 1 and
+// 2 give the groups of the first match without and with the whole
+// match, 3 gives the groups of every match in one array and 4 an array
+// per match.
+static val_t regex_stringregexp(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) return VAL_NULL;
+
+    int64_t flag = (argc > 2 && IS_NUMBER(args[2])) ? val_toint(args[2]) : REGEX_MATCH;
+    return regexp(vm, AS_STR(args[0]), AS_STR(args[1]), (int)flag);
+}
+
+static val_t regex_test(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) return VAL_NULL;
+    return regexp(vm, AS_STR(args[0]), AS_STR(args[1]), REGEX_MATCH);
+}
+
+static val_t regex_match(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) return VAL_NULL;
+    return regexp(vm, AS_STR(args[0]), AS_STR(args[1]), REGEX_FULL);
+}
+
+static val_t regex_matchall(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) return VAL_NULL;
+    return regexp(vm, AS_STR(args[0]), AS_STR(args[1]), REGEX_FULL_ALL);
+}
+
+void load_libregex(vm_t *vm)
+{
+    map_t *regex = map_new(vm);
+    vm_push(vm, VAL_OBJ(regex));
+
+    map_set(vm, regex, "test", VAL_CFN(regex_test));
+    map_set(vm, regex, "match", VAL_CFN(regex_match));
+    map_set(vm, regex, "matchall", VAL_CFN(regex_matchall));
+
+    set_global(vm, "regex", VAL_OBJ(regex));
+    vm_pop(vm);
+
+    set_global(vm, "StringRegExp", VAL_CFN(regex_stringregexp));
+}
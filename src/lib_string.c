@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libs.h"
+#include "vm.h"
+#include "object.h"
+#include "strscan.h"
+
+#define STRIP_LEADING   1
+#define STRIP_TRAILING  2
+#define STRIP_DOUBLE    4
+#define STRIP_ALL       8
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\0' || (c >= '\t' && c <= '\r');
+}
+
+static inline int clamp(int64_t value, int length)
+{
+    if (value < 0) return 0;
+    if (value > length) return length;
+    return (int)value;
+}
+
+// Slices are views of the subject, see str_view().
+static val_t slice(vm_t *vm, str_t *string, int start, int length)
+{
+    return VAL_OBJ(str_view(vm, string, start, length));
+}
+
+static val_t string_len(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 1 || !IS_STR(args[0])) return VAL_INT(0);
+    return VAL_INT(AS_STR(args[0])->length);
+}
+
+static val_t string_left(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_NUMBER(args[1])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    int count = clamp(val_toint(args[1]), string->length);
+    return slice(vm, string, 0, count);
+}
+
+static val_t string_right(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_NUMBER(args[1])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    int count = clamp(val_toint(args[1]), string->length);
+    return slice(vm, string, string->length - count, count);
+}
+
+// StringMid($s, start [, count]), (start) counts from 1 and a missing
+// or negative (count) takes the rest of the string.
+static val_t string_mid(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_NUMBER(args[1])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    int start = clamp(val_toint(args[1]) - 1, string->length);
+    int64_t count = (argc > 2 && IS_NUMBER(args[2])) ? val_toint(args[2]) : -1;
+    int rest = string->length - start;
+
+    return slice(vm, string, start, count < 0 ? rest : clamp(count, rest));
+}
+
+static val_t string_trimleft(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_NUMBER(args[1])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    int count = clamp(val_toint(args[1]), string->length);
+    return slice(vm, string, count, string->length - count);
+}
+
+static val_t string_trimright(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_NUMBER(args[1])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    int count = clamp(val_toint(args[1]), string->length);
+    return slice(vm, string, 0, string->length - count);
+}
+
+// StringStripWS($s, flags), leading and trailing strips are views,
+// only the inner ones need a copy.
+static val_t string_stripws(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_NUMBER(args[1])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    int64_t flags = val_toint(args[1]);
+    const char *chars = str_flatten(string);
+    int start = 0;
+    int end = string->length;
+
+    if (flags & (STRIP_LEADING | STRIP_ALL)) {
+        while (start < end && isSpace(chars[start])) start++;
+    }
+    if (flags & (STRIP_TRAILING | STRIP_ALL)) {
+        while (end > start && isSpace(chars[end - 1])) end--;
+    }
+
+    if (!(flags & (STRIP_DOUBLE | STRIP_ALL))) {
+        return slice(vm, string, start, end - start);
+    }
+
+    char *result = malloc((end - start + 1) * sizeof(char));
+    int length = 0;
+
+    for (int i = start; i < end; i++) {
+        if (isSpace(chars[i])) {
+            if (flags & STRIP_ALL) continue;
+            if (i > start && isSpace(chars[i - 1])) continue;
+        }
+        result[length++] = chars[i];
+    }
+    result[length] = '\0';
+
+    return VAL_OBJ(str_take(vm, result, length));
+}
+
+static inline bool ignoreCase(int argc, val_t *args, int index)
+{
+    return argc > index && !IS_FALSEY(args[index]);
+}
+
+// string.instr($s, $sub [, ignorecase]) is the 1-based position of
+// the first match, 0 when there is none.
+static val_t string_instr(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) return VAL_INT(0);
+
+    str_t *string = AS_STR(args[0]);
+    str_t *sub = AS_STR(args[1]);
+    const char *chars = str_flatten(string);
+    const char *found = scan_find(chars, string->length,
+        str_flatten(sub), sub->length, ignoreCase(argc, args, 2));
+
+    return VAL_INT(found != NULL ? found - chars + 1 : 0);
+}
+
+// string.split($s, $delim [, ignorecase]) gives an array of views.
+static val_t string_split(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    str_t *delim = AS_STR(args[1]);
+    bool ignorecase = ignoreCase(argc, args, 2);
+    const char *chars = str_flatten(string);
+    const char *end = chars + string->length;
+    const char *sep = str_flatten(delim);
+    int count = 1;
+
+    if (delim->length > 0) {
+        for (const char *p = chars;
+            (p = scan_find(p, end - p, sep, delim->length, ignorecase)) != NULL;
+            p += delim->length) {
+            count++;
+        }
+    }
+
+    if (count > ARY_COUNT_MAX) return VAL_NULL;
+
+    ary_t *array = ary_new(vm, 1, &count);
+    vm_push(vm, VAL_OBJ(array));
+
+    const char *p = chars;
+    for (int i = 0; i < count - 1; i++) {
+        const char *next = scan_find(p, end - p, sep, delim->length, ignorecase);
+        array->values[i] = VAL_OBJ(str_view(vm, string, (int)(p - chars), (int)(next - p)));
+        p = next + delim->length;
+    }
+    array->values[count - 1] = VAL_OBJ(str_view(vm, string, (int)(p - chars), (int)(end - p)));
+
+    vm_pop(vm);
+    return VAL_OBJ(array);
+}
+
+// string.replace($s, $find, $with [, ignorecase]) replaces every match.
+static val_t string_replace(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 3 || !IS_STR(args[0]) || !IS_STR(args[1]) || !IS_STR(args[2])) {
+        return VAL_NULL;
+    }
+
+    str_t *string = AS_STR(args[0]);
+    str_t *find = AS_STR(args[1]);
+    str_t *with = AS_STR(args[2]);
+    bool ignorecase = ignoreCase(argc, args, 3);
+    const char *chars = str_flatten(string);
+    const char *end = chars + string->length;
+    const char *pattern = str_flatten(find);
+    const char *replacement = str_flatten(with);
+
+    if (find->length == 0) return args[0];
+
+    int64_t count = 0;
+    for (const char *p = chars;
+        (p = scan_find(p, end - p, pattern, find->length, ignorecase)) != NULL;
+        p += find->length) {
+        count++;
+    }
+
+    if (count == 0) return args[0];
+
+    int64_t length = string->length + count * (with->length - find->length);
+    if (length > INT32_MAX) return VAL_NULL;
+
+    char *result = malloc((size_t)length + 1);
+    char *dest = result;
+    const char *p = chars;
+
+    for (const char *next;
+        (next = scan_find(p, end - p, pattern, find->length, ignorecase)) != NULL;
+        p = next + find->length) {
+        memcpy(dest, p, next - p);
+        dest += next - p;
+        memcpy(dest, replacement, with->length);
+        dest += with->length;
+    }
+    memcpy(dest, p, end - p);
+    result[length] = '\0';
+
+    return VAL_OBJ(str_take(vm, result, (int)length));
+}
+
+static val_t convertCase(vm_t *vm, int argc, val_t *args,
+    void (*convert)(char *dest, const char *src, size_t n))
+{
+    if (argc < 1 || !IS_STR(args[0])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    char *result = malloc(string->length + 1);
+    convert(result, str_flatten(string), string->length);
+    result[string->length] = '\0';
+
+    return VAL_OBJ(str_take(vm, result, string->length));
+}
+
+static val_t string_upper(vm_t *vm, int argc, val_t *args)
+{
+    return convertCase(vm, argc, args, scan_upper);
+}
+
+static val_t string_lower(vm_t *vm, int argc, val_t *args)
+{
+    return convertCase(vm, argc, args, scan_lower);
+}
+
+static val_t string_trim(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 1 || !IS_STR(args[0])) return VAL_NULL;
+
+    str_t *string = AS_STR(args[0]);
+    const char *chars = str_flatten(string);
+    int start = 0;
+    int end = string->length;
+
+    while (start < end && isSpace(chars[start])) start++;
+    while (end > start && isSpace(chars[end - 1])) end--;
+
+    return slice(vm, string, start, end - start);
+}
+
+static val_t string_startswith(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) return VAL_FALSE;
+
+    str_t *string = AS_STR(args[0]);
+    str_t *prefix = AS_STR(args[1]);
+    if (prefix->length > string->length) return VAL_FALSE;
+
+    return VAL_BOOL(scan_compare(str_flatten(string), prefix->length,
+        str_flatten(prefix), prefix->length, ignoreCase(argc, args, 2)) == 0);
+}
+
+// string.compare($a, $b [, ignorecase]) is -1, 0 or 1.
+static val_t string_compare(vm_t *vm, int argc, val_t *args)
+{
+    if (argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) return VAL_NULL;
+
+    str_t *a = AS_STR(args[0]);
+    str_t *b = AS_STR(args[1]);
+
+    return VAL_INT(scan_compare(str_flatten(a), a->length,
+        str_flatten(b), b->length, ignoreCase(argc, args, 2)));
+}
+
+static val_t string_simd(vm_t *vm, int argc, val_t *args)
+{
+    const char *name = scan_name();
+    return VAL_OBJ(str_new(vm, name, (int)strlen(name)));
+}
+
+void load_libstring(vm_t *vm)
+{
+    map_t *string = map_new(vm);
+    vm_push(vm, VAL_OBJ(string));
+
+    map_set(vm, string, "instr", VAL_CFN(string_instr));
+    map_set(vm, string, "split", VAL_CFN(string_split));
+    map_set(vm, string, "replace", VAL_CFN(string_replace));
+    map_set(vm, string, "upper", VAL_CFN(string_upper));
+    map_set(vm, string, "lower", VAL_CFN(string_lower));
+    map_set(vm, string, "trim", VAL_CFN(string_trim));
+    map_set(vm, string, "startswith", VAL_CFN(string_startswith));
+    map_set(vm, string, "compare", VAL_CFN(string_compare));
+    map_set(vm, string, "simd", VAL_CFN(string_simd));
+
+    set_global(vm, "string", VAL_OBJ(string));
+    vm_pop(vm);
+
+    set_global(vm, "StringLen", VAL_CFN(string_len));
+    set_global(vm, "StringLeft", VAL_CFN(string_left));
+    set_global(vm, "StringRight", VAL_CFN(string_right));
+    set_global(vm, "StringMid", VAL_CFN(string_mid));
+    set_global(vm, "StringTrimLeft", VAL_CFN(string_trimleft));
+    set_global(vm, "StringTrimRight", VAL_CFN(string_trimright));
+    set_global(vm, "StringStripWS", VAL_CFN(string_stripws));
+}
@@ -32,13 +32,14 @@ static DWORD WINAPI thread_routine(void *data)
 
     vm_call(thread->vm, VAL_OBJ(thread->routine), 0);
     vm_execute(thread->vm);
+    vm_flush(thread->vm);
 
     return 0;
 }
 
 static val_t thread_sleep(vm_t *vm, int argc, val_t *args)
 {
-    int ms = AS_INT(args[0]);
+    int ms = (int)val_toint(args[0]);
 
 #ifdef _WIN32
     Sleep(ms);
@@ -149,6 +150,7 @@ static val_t thread_close(vm_t *vm, int argc, val_t *args)
 void load_libthread(vm_t *vm)
 {
     map_t *thread = map_new(vm);
+    vm_push(vm, VAL_OBJ(thread));
 
     map_set(vm, thread, "sleep", VAL_CFN(thread_sleep));
     map_set(vm, thread, "create", VAL_CFN(thread_create));
@@ -159,4 +161,5 @@ void load_libthread(vm_t *vm)
     map_set(vm, thread, "close", VAL_CFN(thread_close));
 
     set_global(vm, "thread", VAL_OBJ(thread));
+    vm_pop(vm);
 }
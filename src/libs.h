@@ -3,5 +3,9 @@
 #include "common.h"
 #include "vm.h"
 
+void load_libgc(vm_t *vm);
+void load_libjson(vm_t *vm);
 void load_libmath(vm_t *vm);
+void load_libregex(vm_t *vm);
+void load_libstring(vm_t *vm);
 void load_libthread(vm_t *vm);
@@ -1,22 +1,62 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "vm.h"
 #include "libs.h"
 
+#define PROFILE_HZ  99
+
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        printf("usage: au3 [file]\n");
+        printf("usage: au3 [--profile=out.folded] [--profile-hz=n] [--allocs=out.txt] [--heap-limit=mb]\n"
+            "           [--image=in.img] [--snapshot=out.img] [file]\n");
         return 0;
     }
 
+    const char *profile = NULL;
+    const char *allocs = NULL;
+    const char *image = NULL;
+    const char *snapshot = NULL;
+    int hz = PROFILE_HZ;
+    long heapLimit = 0;
+
+    for (int i = 1; i < argc - 1; i++) {
+        if (strncmp(argv[i], "--profile=", 10) == 0) profile = argv[i] + 10;
+        else if (strncmp(argv[i], "--profile-hz=", 13) == 0) hz = atoi(argv[i] + 13);
+        else if (strncmp(argv[i], "--allocs=", 9) == 0) allocs = argv[i] + 9;
+        else if (strncmp(argv[i], "--heap-limit=", 13) == 0) heapLimit = atol(argv[i] + 13);
+        else if (strncmp(argv[i], "--image=", 8) == 0) image = argv[i] + 8;
+        else if (strncmp(argv[i], "--snapshot=", 11) == 0) snapshot = argv[i] + 11;
+    }
+
     vm_t *vm = vm_create();
     int ret = VM_INIT_ERROR;
 
     if (vm != NULL) {
         load_libmath(vm);
+        load_libstring(vm);
+        load_libregex(vm);
+        load_libjson(vm);
         load_libthread(vm);
-        ret = vm_dofile(vm, argv[argc - 1]);
+        load_libgc(vm);
+
+        if (heapLimit > 0) gc_set_limit(vm->gc, (size_t)heapLimit * 1024 * 1024);
+
+        if (profile != NULL && !vm_profile_start(vm, hz)) {
+            fprintf(stderr, "Could not start the profiler.\n");
+        }
+
+        if (allocs != NULL) vm_allocs_start(vm);
+
+        if (image == NULL || vm_restore(vm, image)) {
+            ret = vm_dofile(vm, argv[argc - 1]);
+            if (ret == VM_OK && snapshot != NULL && !vm_snapshot(vm, snapshot)) ret = VM_INIT_ERROR;
+        }
+
+        if (profile != NULL) vm_profile_stop(vm, profile);
+        if (allocs != NULL) vm_allocs_stop(vm, allocs);
         vm_close(vm);
     }
 
@@ -11,49 +11,129 @@
     gc_realloc(gc, NULL, 0, size)
 
 #define FREE(gc, type, pointer) \
-    gc_realloc(gc, pointer, sizeof(type), 0)
+    freeObj(gc, (obj_t *)(pointer), sizeof(type))
 
 #define ALLOC_OBJ(gc, type, objectType) \
-    (type *)allocObj(gc, sizeof(type), objectType)
+    (type *)allocObj(gc, sizeof(type), objectType, false)
 
-static obj_t *allocObj(gc_t *gc, size_t size, otype_t type)
+// Short strings made in a region keep their characters in its block,
+// right after the struct.
+#define STR_INLINE_MAX  (REGION_BLOCK / 16)
+
+// Objects go to the innermost open region, if any. Functions and
+// interned strings never do, they outlive the invocation making them.
+static obj_t *allocObj(gc_t *gc, size_t size, otype_t type, bool lasting)
 {
-    obj_t *object = ALLOC(gc, size);
+    obj_t *object;
+
+    if (gc->depth > 0 && !lasting) {
+        object = gc_bump(gc, size);
+    }
+    else {
+        object = ALLOC(gc, size);
+        object->isBumped = false;
+        object->region = 0;
+        object->next = gc->objects;
+        gc->objects = object;
+    }
+
     object->type = type;
+    object->isMarked = false;
 
-    object->next = gc->objects;
-    gc->objects = object;
+    if (gc->allocprof != NULL) allocprof_alloc(gc, object, size);
     return object;
 }
 
-static str_t *allocStr(vm_t *vm, char *chars, int length, uint32_t hash)
+// Region blocks are freed whole.
+static void freeObj(gc_t *gc, obj_t *object, size_t size)
+{
+    if (!object->isBumped) gc_realloc(gc, object, size, 0);
+}
+
+static inline bool hasInlineChars(str_t *string)
+{
+    return string->obj.isBumped && string->chars == (char *)(string + 1);
+}
+
+// Characters a string owns count towards its site.
+static inline void trackChars(vm_t *vm, str_t *string)
+{
+    str_charge(vm->gc, string);
+    if (vm->gc->allocprof != NULL) allocprof_grow(vm->gc, (obj_t *)string, string->length + 1);
+}
+
+// So do the value buffers of maps and arrays, by what they grow.
+static inline void trackGrowth(gc_t *gc, obj_t *object, size_t before, size_t after)
+{
+    if (gc->allocprof != NULL && after > before) allocprof_grow(gc, object, after - before);
+}
+
+static str_t *initStr(str_t *string, char *chars, int length)
 {
-    str_t *string = ALLOC_OBJ(vm->gc, str_t, OT_STR);
     string->length = length;
     string->chars = chars;
+    string->hash = 0;
+    string->isHashed = false;
+    string->isInterned = false;
+    string->isCharged = false;
+    string->left = NULL;
+    string->right = NULL;
+    string->parent = NULL;
+    return string;
+}
+
+static str_t *allocRaw(vm_t *vm, char *chars, int length)
+{
+    return initStr(ALLOC_OBJ(vm->gc, str_t, OT_STR), chars, length);
+}
+
+static str_t *allocStr(vm_t *vm, char *chars, int length, uint32_t hash)
+{
+    str_t *string = initStr((str_t *)allocObj(vm->gc, sizeof(str_t), OT_STR, true), chars, length);
     string->hash = hash;
+    string->isHashed = true;
+    string->isInterned = true;
+    trackChars(vm, string);
 
-    tab_set(vm->strings, string, VAL_NULL);
+    tab_set(vm->gc, vm->strings, string, VAL_NULL);
 
     return string;
 }
 
+// Strings made at runtime are not interned, they are hashed the
+// first time they are used as a key, see str_hash().
 str_t *str_take(vm_t *vm, char *chars, int length)
 {
-    uint32_t hash = hash_string(chars, length, false);
-    str_t *interned = tab_findstr(vm->strings, chars, length, hash);
-    if (interned != NULL) {
-        free(chars);
-        return interned;
+    str_t *string = allocRaw(vm, chars, length);
+    trackChars(vm, string);
+    return string;
+}
+
+str_t *str_new(vm_t *vm, const char *chars, int length)
+{
+    if (vm->gc->depth > 0 && length < STR_INLINE_MAX) {
+        str_t *string = (str_t *)allocObj(vm->gc, sizeof(str_t) + length + 1, OT_STR, false);
+        char *inlineChars = (char *)(string + 1);
+        memcpy(inlineChars, chars, length);
+        inlineChars[length] = '\0';
+        return initStr(string, inlineChars, length);
     }
 
-    return allocStr(vm, chars, length, hash);
+    char *heapChars = malloc((length + 1) * sizeof(char));
+    memcpy(heapChars, chars, length);
+    heapChars[length] = '\0';
+
+    str_t *string = allocRaw(vm, heapChars, length);
+    trackChars(vm, string);
+    return string;
 }
 
+// Interned copy, for identifiers and constants. Hashed and looked up
+// in place, only a string not interned yet is copied.
 str_t *str_copy(vm_t *vm, const char *chars, int length, bool ignorecase)
 {
     uint32_t hash = hash_string(chars, length, ignorecase);
-    str_t *interned = tab_findstr(vm->strings, chars, length, hash);
+    str_t *interned = tab_findstr(vm->strings, chars, length, hash, ignorecase);
     if (interned != NULL) return interned;
 
     char *heapChars = malloc((length + 1) * sizeof(char));
@@ -66,22 +146,182 @@ str_t *str_copy(vm_t *vm, const char *chars, int length, bool ignorecase)
     return allocStr(vm, heapChars, length, hash);
 }
 
+str_t *str_rope(vm_t *vm, str_t *left, str_t *right)
+{
+    str_t *rope = allocRaw(vm, NULL, left->length + right->length);
+    rope->left = left;
+    rope->right = right;
+    return rope;
+}
+
+// Substring sharing the characters of (string), short ones are copied
+// rather than keep a large parent alive.
+str_t *str_view(vm_t *vm, str_t *string, int start, int length)
+{
+    if (start == 0 && length == string->length) return string;
+
+    char *chars = str_flatten(string) + start;
+    if (length < STR_VIEW_MIN) return str_new(vm, chars, length);
+
+    if (string->parent != NULL) string = string->parent;
+
+    str_t *view = allocRaw(vm, chars, length);
+    view->parent = string;
+    return view;
+}
+
+// Ropes flattened and views made to own their characters where no
+// collector is at hand are charged when the next collection marks them.
+void str_charge(gc_t *gc, str_t *string)
+{
+    if (string->isCharged || string->chars == NULL || string->parent != NULL) return;
+    if (hasInlineChars(string)) return;
+
+    gc_account(gc, GC_STRINGS, 0, string->length + 1);
+    string->isCharged = true;
+}
+
+uint32_t str_hash(str_t *string)
+{
+    if (!string->isHashed) {
+        string->hash = hash_string(str_flatten(string), string->length, false);
+        string->isHashed = true;
+    }
+
+    return string->hash;
+}
+
+// Fills (dest) from the back while right pieces are flat and from the
+// front while left ones are, so ropes grown at either end need no stack.
+void str_write(str_t *string, char *dest)
+{
+    struct { str_t *node; char *lo; } stack[64];
+    int depth = 0;
+    str_t *node = string;
+    char *lo = dest;
+    char *hi = dest + string->length;
+
+    for (;;) {
+        if (node->chars != NULL) {
+            memcpy(lo, node->chars, node->length);
+
+            if (depth == 0) return;
+            depth--;
+            node = stack[depth].node;
+            lo = stack[depth].lo;
+            hi = lo + node->length;
+        }
+        else if (node->right->chars != NULL) {
+            hi -= node->right->length;
+            memcpy(hi, node->right->chars, node->right->length);
+            node = node->left;
+        }
+        else if (node->left->chars != NULL) {
+            memcpy(lo, node->left->chars, node->left->length);
+            lo += node->left->length;
+            node = node->right;
+        }
+        else if (depth < (int)(sizeof(stack) / sizeof(stack[0]))) {
+            stack[depth].node = node->right;
+            stack[depth].lo = lo + node->left->length;
+            depth++;
+            node = node->left;
+            hi = lo + node->length;
+        }
+        else {
+            // Too deep on both sides, settle the right half first.
+            str_flatten(node->right);
+        }
+    }
+}
+
+char *str_flatten(str_t *string)
+{
+    if (string->chars != NULL) return string->chars;
+
+    char *chars = malloc((string->length + 1) * sizeof(char));
+    str_write(string, chars);
+    chars[string->length] = '\0';
+
+    string->chars = chars;
+    string->left = NULL;
+    string->right = NULL;
+    return chars;
+}
+
+// Gives a view its own copy of the characters, the parent is released.
+void str_own(str_t *string)
+{
+    if (string->parent == NULL) return;
+
+    char *chars = malloc((string->length + 1) * sizeof(char));
+    memcpy(chars, string->chars, string->length);
+    chars[string->length] = '\0';
+
+    string->chars = chars;
+    string->parent = NULL;
+}
+
+char *str_cstr(str_t *string)
+{
+    str_flatten(string);
+    str_own(string);
+    return string->chars;
+}
+
+bool str_equal(str_t *a, str_t *b)
+{
+    if (a == b) return true;
+    if (a->length != b->length) return false;
+    if (a->isInterned && b->isInterned) return false;
+    if (a->isHashed && b->isHashed && a->hash != b->hash) return false;
+
+    return memcmp(str_flatten(a), str_flatten(b), a->length) == 0;
+}
+
 fun_t *fun_new(vm_t *vm, src_t *source)
 {
-    fun_t *function = ALLOC_OBJ(vm->gc, fun_t, OT_FUN);
+    fun_t *function = (fun_t *)allocObj(vm->gc, sizeof(fun_t), OT_FUN, true);
 
     function->arity = 0;
+    function->upvalueCount = 0;
     function->name = NULL;
+    function->program = NULL;
     chunk_init(&function->chunk, source);
     return function;
 }
 
+clo_t *clo_new(vm_t *vm, fun_t *function, bool onStack)
+{
+    void **captures = ALLOC(vm->gc, sizeof(void *) * function->upvalueCount);
+    for (int i = 0; i < function->upvalueCount; i++) {
+        captures[i] = NULL;
+    }
+
+    clo_t *closure = ALLOC_OBJ(vm->gc, clo_t, OT_CLO);
+    closure->function = function;
+    closure->onStack = onStack;
+    closure->upvalueCount = function->upvalueCount;
+    closure->upvalues = (upv_t **)captures;
+    return closure;
+}
+
+upv_t *upv_new(vm_t *vm, val_t *slot)
+{
+    upv_t *upvalue = ALLOC_OBJ(vm->gc, upv_t, OT_UPV);
+    upvalue->closed = VAL_NULL;
+    upvalue->location = slot;
+    upvalue->next = NULL;
+    return upvalue;
+}
+
 map_t *map_new(vm_t *vm)
 {
     map_t *map = ALLOC_OBJ(vm->gc, map_t, OT_MAP);
 
     hash_init(&map->hash);
     tab_init(&map->table);
+    map->isArray = false;
     return map;
 }
 
@@ -91,70 +331,310 @@ void map_set(vm_t *vm, map_t *map, const char *key, val_t value)
 
     vm_push(vm, value);
     vm_push(vm, VAL_OBJ(field));
-    tab_set(&map->table, field, value);
+    gc_barrier(vm->gc, &map->obj, value);
+    map_put(vm->gc, map, field, value);
 
     vm_pop(vm);
     vm_pop(vm);
 }
 
+// Stores into a map's tables, the growth is charged to the map.
+bool map_put(gc_t *gc, map_t *map, str_t *key, val_t value)
+{
+    int capacity = map->table.capacity;
+    bool isNewKey = tab_set(gc, &map->table, key, value);
+
+    trackGrowth(gc, &map->obj, capacity * sizeof(ent_t), map->table.capacity * sizeof(ent_t));
+    return isNewKey;
+}
+
+bool map_put_index(gc_t *gc, map_t *map, int64_t key, val_t value)
+{
+    int capacity = map->hash.capacity;
+    bool isNewKey = hash_set(gc, &map->hash, key, value);
+
+    trackGrowth(gc, &map->obj, capacity * sizeof(index_t), map->hash.capacity * sizeof(index_t));
+    return isNewKey;
+}
+
+static int aryCount(int dims, const int *sizes)
+{
+    int count = 1;
+    for (int i = 0; i < dims; i++) {
+        count *= sizes[i];
+    }
+    return count;
+}
+
+static inline size_t aryBytes(int capacity)
+{
+    return sizeof(val_t) * (capacity > 0 ? capacity : 1);
+}
+
+static val_t *aryBuffer(gc_t *gc, val_t *values, int old, int capacity)
+{
+    return gc_resize(gc, GC_TABLES, values, values != NULL ? aryBytes(old) : 0,
+        aryBytes(capacity));
+}
+
+ary_t *ary_new(vm_t *vm, int dims, const int *sizes)
+{
+    int count = aryCount(dims, sizes);
+    val_t *values = aryBuffer(vm->gc, NULL, 0, count);
+    for (int i = 0; i < count; i++) {
+        values[i] = VAL_NULL;
+    }
+
+    ary_t *array = ALLOC_OBJ(vm->gc, ary_t, OT_ARR);
+    array->count = count;
+    array->capacity = count;
+    array->dims = dims;
+    memcpy(array->sizes, sizes, sizeof(int) * dims);
+    array->values = values;
+    trackGrowth(vm->gc, &array->obj, 0, aryBytes(count));
+    return array;
+}
+
+void ary_resize(vm_t *vm, ary_t *array, int dims, const int *sizes)
+{
+    int count = aryCount(dims, sizes);
+    bool inPlace = dims == array->dims;
+
+    for (int i = 1; inPlace && i < dims; i++) {
+        inPlace = sizes[i] == array->sizes[i];
+    }
+
+    if (inPlace) {
+        // Only the first subscript changed, rows keep their offsets so
+        // the buffer is grown geometrically and repeated ReDims of
+        // one more row stay amortized O(1).
+        if (count > array->capacity) {
+            int capacity = GROW_CAP(array->capacity);
+            if (capacity < count) capacity = count;
+            array->values = aryBuffer(vm->gc, array->values, array->capacity, capacity);
+            trackGrowth(vm->gc, &array->obj, aryBytes(array->capacity), aryBytes(capacity));
+            array->capacity = capacity;
+        }
+
+        for (int i = array->count; i < count; i++) {
+            array->values[i] = VAL_NULL;
+        }
+        for (int i = count; i < array->count; i++) {
+            array->values[i] = VAL_NULL;
+        }
+    }
+    else {
+        val_t *values = aryBuffer(vm->gc, NULL, 0, count);
+        int index[ARY_DIMS_MAX] = { 0 };
+
+        // Copy what both shapes have in common, a change in the number
+        // of dimensions drops the old contents.
+        for (int i = 0; i < count; i++) {
+            int from = 0;
+            bool inside = dims == array->dims;
+
+            for (int d = 0; inside && d < dims; d++) {
+                inside = index[d] < array->sizes[d];
+                from = from * array->sizes[d] + index[d];
+            }
+
+            values[i] = inside ? array->values[from] : VAL_NULL;
+
+            for (int d = dims - 1; d >= 0 && ++index[d] == sizes[d]; d--) {
+                index[d] = 0;
+            }
+        }
+
+        gc_resize(vm->gc, GC_TABLES, array->values, aryBytes(array->capacity), 0);
+        trackGrowth(vm->gc, &array->obj, aryBytes(array->capacity), aryBytes(count));
+        array->values = values;
+        array->capacity = count;
+    }
+
+    array->count = count;
+    array->dims = dims;
+    memcpy(array->sizes, sizes, sizeof(int) * dims);
+}
+
+vec_t *vec_new(vm_t *vm, int count)
+{
+    double *data = calloc(count > 0 ? count : 1, sizeof(double));
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    gc_account(vm->gc, GC_TABLES, 0, sizeof(double) * (count > 0 ? count : 1));
+
+    vec_t *vector = ALLOC_OBJ(vm->gc, vec_t, OT_VEC);
+    vector->count = count;
+    vector->data = data;
+    return vector;
+}
+
 const char *obj_typeof(obj_t *object)
 {
     switch (object->type) {
         case OT_STR:
             return "str";
         case OT_FUN:
+        case OT_CLO:
             return "fn";
+        case OT_ARR:
+            return "arr";
+        case OT_VEC:
+            return "vec";
         default:
             return "obj";
     }
 }
 
-void obj_print(obj_t *object)
+void obj_print(out_t *out, obj_t *object)
 {
+    char buffer[FMT_NUM_MAX];
+    const char *format = "obj: %p";
+
     switch (object->type) {
         case OT_STR: {
             str_t *string = (str_t *)object;
-            printf("%.*s", string->length, string->chars);
-            break;
+            out_write(out, str_flatten(string), string->length);
+            return;
         }
         case OT_FUN: {
             fun_t *function = (fun_t *)object;
-            if (function->name == NULL)
-                printf("<script>");
-            else
-                printf("fn: %s", function->name->chars);
-            break;
+            if (function->name == NULL) {
+                out_write(out, "<script>", 8);
+            }
+            else {
+                out_write(out, "fn: ", 4);
+                out_write(out, function->name->chars, function->name->length);
+            }
+            return;
         }
+        case OT_CLO:
+            obj_print(out, (obj_t *)((clo_t *)object)->function);
+            return;
         case OT_MAP:
-            printf("map: %p", object);
+            format = "map: %p";
+            break;
+        case OT_ARR:
+            format = "arr: %p";
+            break;
+        case OT_VEC:
+            format = "vec: %p";
             break;
         default:
-            printf("obj: %p", object);
             break;
     }
+
+    out_write(out, buffer, snprintf(buffer, sizeof(buffer), format, (void *)object));
+}
+
+static size_t objSize(otype_t type)
+{
+    switch (type) {
+        case OT_STR: return sizeof(str_t);
+        case OT_FUN: return sizeof(fun_t);
+        case OT_CLO: return sizeof(clo_t);
+        case OT_UPV: return sizeof(upv_t);
+        case OT_MAP: return sizeof(map_t);
+        case OT_ARR: return sizeof(ary_t);
+        case OT_VEC: return sizeof(vec_t);
+    }
+    return 0;
+}
+
+// Heap copy of an object moved out of a region, taking over what the
+// original owns. Strings come out flat with characters of their own.
+obj_t *obj_copy(gc_t *gc, obj_t *object)
+{
+    size_t size = objSize(object->type);
+    obj_t *copy = gc_realloc(gc, NULL, 0, size);
+
+    memcpy(copy, object, size);
+    copy->isMarked = false;
+    copy->isBumped = false;
+    copy->region = 0;
+    copy->next = gc->objects;
+    gc->objects = copy;
+
+    if (object->type == OT_STR) {
+        str_t *from = (str_t *)object;
+        str_t *string = (str_t *)copy;
+
+        if (from->chars == NULL) {
+            string->chars = str_flatten(from);
+        }
+        else if (from->parent != NULL || hasInlineChars(from)) {
+            string->chars = malloc((from->length + 1) * sizeof(char));
+            memcpy(string->chars, from->chars, from->length);
+            string->chars[from->length] = '\0';
+        }
+
+        string->left = NULL;
+        string->right = NULL;
+        string->parent = NULL;
+        str_charge(gc, string);
+    }
+    else if (object->type == OT_UPV) {
+        upv_t *from = (upv_t *)object;
+        if (from->location == &from->closed) ((upv_t *)copy)->location = &((upv_t *)copy)->closed;
+    }
+
+    return copy;
 }
 
 void obj_free(gc_t *gc, obj_t *object)
 {
+    if (gc->allocprof != NULL) allocprof_free(gc, object);
+
     switch (object->type) {
         case OT_STR: {
             str_t *string = (str_t *)object;
-            free(string->chars);
+            if (string->parent == NULL && !hasInlineChars(string)) free(string->chars);
+            if (string->isCharged) gc_account(gc, GC_STRINGS, string->length + 1, 0);
             FREE(gc, str_t, string);
             break;
         }
         case OT_FUN: {
             fun_t *function = (fun_t *)object;
-            chunk_free(&function->chunk);
+            if (function->program != NULL) {
+                arr_free(gc, &function->chunk.constants);
+                program_release(function->program);
+            }
+            else {
+                chunk_free(gc, &function->chunk);
+            }
             FREE(gc, fun_t, function);
             break;
         }
+        case OT_CLO: {
+            clo_t *closure = (clo_t *)object;
+            gc_realloc(gc, closure->upvalues, sizeof(void *) * closure->upvalueCount, 0);
+            FREE(gc, clo_t, closure);
+            break;
+        }
+        case OT_UPV:
+            FREE(gc, upv_t, object);
+            break;
         case OT_MAP: {
             map_t *map = (map_t *)object;
-            hash_free(&map->hash);
-            tab_free(&map->table);
+            hash_free(gc, &map->hash);
+            tab_free(gc, &map->table);
             FREE(gc, map_t, map);
             break;
         }
+        case OT_ARR: {
+            ary_t *array = (ary_t *)object;
+            gc_resize(gc, GC_TABLES, array->values, aryBytes(array->capacity), 0);
+            FREE(gc, ary_t, array);
+            break;
+        }
+        case OT_VEC: {
+            vec_t *vector = (vec_t *)object;
+            free(vector->data);
+            gc_account(gc, GC_TABLES, sizeof(double) * (vector->count > 0 ? vector->count : 1), 0);
+            FREE(gc, vec_t, vector);
+            break;
+        }
     }
 }
@@ -8,14 +8,28 @@
 struct _obj {
     otype_t type : 8;
     uint8_t isMarked : 1;
+    uint8_t isBumped : 1;   // in a region block, see gc_bump()
+    uint8_t region;         // depth of the region holding it, 0 is the heap
     obj_t *next;
 };
 
+// Long concatenations make a rope, (chars) stays NULL and the copy is
+// deferred to str_flatten() until the characters are needed. A view
+// points (chars) into its (parent) and is not terminated by '\0'.
+#define STR_ROPE_MIN    64
+#define STR_VIEW_MIN    16
+
 struct _str {
     obj_t obj;
     int length;
     uint32_t hash;
+    bool isHashed;
+    bool isInterned;
+    bool isCharged;     // its characters are counted by the collector
     char *chars;
+    str_t *left;
+    str_t *right;
+    str_t *parent;
 };
 
 struct _upv {
@@ -29,21 +43,59 @@ struct _fun {
     obj_t obj;
     int arity;
     int upvalueCount;
-    upv_t **upvalues;
     str_t *name;
     chunk_t chunk;
+    program_t *program;     // owner of the code when made by program_load()
+};
+
+struct _clo {
+    obj_t obj;
+    fun_t *function;
+    // Captures of a closure that never outlives its enclosing
+    // frame point straight into that frame, no upv_t is needed.
+    bool onStack;
+    int upvalueCount;
+    union {
+        upv_t **upvalues;
+        val_t **slots;
+    };
 };
 
 struct _map {
     obj_t obj;
     hash_t hash;
     tab_t table;
+    bool isArray;   // parsed from a JSON array, written back as one even when empty
+};
+
+// Dim arrays keep every element in one row-major buffer, the last
+// subscript varies fastest. Capacity may exceed count after ReDim.
+#define ARY_DIMS_MAX    8
+#define ARY_COUNT_MAX   (16 * 1024 * 1024)
+
+struct _ary {
+    obj_t obj;
+    int count;
+    int capacity;
+    int dims;
+    int sizes[ARY_DIMS_MAX];
+    val_t *values;
+};
+
+// Packed doubles for the bulk kernels of the math module.
+struct _vec {
+    obj_t obj;
+    int count;
+    double *data;
 };
 
 #define AS_STR(v)       ((str_t *)AS_OBJ(v))
-#define AS_CSTR(v)      (((str_t *)AS_OBJ(v))->chars)
+#define AS_CSTR(v)      (str_cstr((str_t *)AS_OBJ(v)))
 #define AS_FUN(v)       ((fun_t *)AS_OBJ(v))
+#define AS_CLO(v)       ((clo_t *)AS_OBJ(v))
 #define AS_MAP(v)       ((map_t *)AS_OBJ(v))
+#define AS_ARR(v)       ((ary_t *)AS_OBJ(v))
+#define AS_VEC(v)       ((vec_t *)AS_OBJ(v))
 
 #define OBJ_TYPE(v)     (AS_OBJ(v)->type)
 
@@ -53,16 +105,39 @@ static inline bool obj_is(val_t value, otype_t type) {
 
 #define IS_STR(v)       (obj_is(v, OT_STR))
 #define IS_FUN(v)       (obj_is(v, OT_FUN))
+#define IS_CLO(v)       (obj_is(v, OT_CLO))
 #define IS_MAP(v)       (obj_is(v, OT_MAP))
+#define IS_ARR(v)       (obj_is(v, OT_ARR))
+#define IS_VEC(v)       (obj_is(v, OT_VEC))
 
 str_t *str_take(vm_t *vm, char *chars, int length);
 str_t *str_copy(vm_t *vm, const char *chars, int length, bool ignorecase);
+str_t *str_new(vm_t *vm, const char *chars, int length);
+str_t *str_rope(vm_t *vm, str_t *left, str_t *right);
+void str_charge(gc_t *gc, str_t *string);
+str_t *str_view(vm_t *vm, str_t *string, int start, int length);
+uint32_t str_hash(str_t *string);
+char *str_flatten(str_t *string);
+char *str_cstr(str_t *string);
+void str_own(str_t *string);
+void str_write(str_t *string, char *dest);
+bool str_equal(str_t *a, str_t *b);
 
 fun_t *fun_new(vm_t *vm, src_t *source);
+clo_t *clo_new(vm_t *vm, fun_t *function, bool onStack);
+upv_t *upv_new(vm_t *vm, val_t *slot);
 
 map_t *map_new(vm_t *vm);
 void map_set(vm_t *vm, map_t *map, const char *key, val_t value);
+bool map_put(gc_t *gc, map_t *map, str_t *key, val_t value);
+bool map_put_index(gc_t *gc, map_t *map, int64_t key, val_t value);
+
+ary_t *ary_new(vm_t *vm, int dims, const int *sizes);
+void ary_resize(vm_t *vm, ary_t *array, int dims, const int *sizes);
+
+vec_t *vec_new(vm_t *vm, int count);
 
 const char *obj_typeof(obj_t *object);
-void obj_print(obj_t *object);
+void obj_print(out_t *out, obj_t *object);
 void obj_free(gc_t *gc, obj_t *object);
+obj_t *obj_copy(gc_t *gc, obj_t *object);
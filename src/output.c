@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "output.h"
+
+// Powers of ten exact in a double.
+static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+};
+
+#define NUM_DIGITS  14
+
+static void toStdout(void *user, const char *data, size_t length)
+{
+    (void)user;
+    fwrite(data, 1, length, stdout);
+}
+
+void out_init(out_t *out, out_fn write, void *user, flush_t mode)
+{
+    if (mode == OUT_FLUSH_AUTO) {
+        mode = (write == NULL && isatty(fileno(stdout))) ? OUT_FLUSH_LINE : OUT_FLUSH_FULL;
+    }
+
+    out->write = write != NULL ? write : toStdout;
+    out->user = write != NULL ? user : NULL;
+    out->mode = mode;
+    out->length = 0;
+}
+
+void out_flush(out_t *out)
+{
+    if (out->length > 0) {
+        out->write(out->user, out->data, out->length);
+        out->length = 0;
+    }
+
+    if (out->write == toStdout) fflush(stdout);
+}
+
+void out_write(out_t *out, const char *data, size_t length)
+{
+    if (out->length + length <= OUT_BUFFER_SIZE) {
+        memcpy(out->data + out->length, data, length);
+        out->length += length;
+        return;
+    }
+
+    // Anything that does not fit goes straight through.
+    if (out->length > 0) {
+        out->write(out->user, out->data, out->length);
+        out->length = 0;
+    }
+
+    if (length < OUT_BUFFER_SIZE) {
+        memcpy(out->data, data, length);
+        out->length = length;
+    }
+    else {
+        out->write(out->user, data, length);
+    }
+}
+
+void out_char(out_t *out, char c)
+{
+    if (out->length == OUT_BUFFER_SIZE) {
+        out->write(out->user, out->data, out->length);
+        out->length = 0;
+    }
+
+    out->data[out->length++] = c;
+}
+
+void out_num(out_t *out, double value)
+{
+    char buffer[FMT_NUM_MAX];
+    out_write(out, buffer, fmt_num(buffer, value));
+}
+
+void out_int(out_t *out, int64_t value)
+{
+    char buffer[FMT_NUM_MAX];
+    out_write(out, buffer, fmt_int(buffer, value));
+}
+
+void out_line(out_t *out)
+{
+    out_char(out, '\n');
+    if (out->mode == OUT_FLUSH_LINE) out_flush(out);
+}
+
+static int writeDigits(char *buffer, uint64_t value)
+{
+    char digits[20];
+    int count = 0;
+
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (int i = 0; i < count; i++) buffer[i] = digits[count - 1 - i];
+    return count;
+}
+
+int fmt_int(char *buffer, int64_t value)
+{
+    if (value >= 0) return writeDigits(buffer, (uint64_t)value);
+
+    buffer[0] = '-';
+    return 1 + writeDigits(buffer + 1, 0 - (uint64_t)value);
+}
+
+// The common case of "%.14g" is fixed notation, taken here from the
+// value scaled to a 14 digit integer. The one rounding of the scaling
+// is far below half a unit, only values that land close to a tie and
+// those printed with an exponent are left to snprintf().
+int fmt_num(char *buffer, double value)
+{
+    double magnitude = fabs(value);
+    char *s = buffer;
+
+    if (magnitude == 0) {
+        if (signbit(value)) *s++ = '-';
+        *s++ = '0';
+        return (int)(s - buffer);
+    }
+
+    if (!(magnitude >= 1e-4 && magnitude < 1e14)) goto _slow;
+
+    int exponent = (int)floor(log10(magnitude));
+    double scaled;
+
+    for (;;) {
+        int scale = NUM_DIGITS - 1 - exponent;
+        if (scale < 0 || scale > 18) goto _slow;
+
+        scaled = magnitude * powers[scale];
+        if (scaled < 1e13) exponent--;
+        else if (scaled >= 1e14) exponent++;
+        else break;
+    }
+
+    double whole = floor(scaled);
+    double fraction = scaled - whole;
+    if (fabs(fraction - 0.5) < 1.0 / 32) goto _slow;
+
+    uint64_t mantissa = (uint64_t)whole + (fraction > 0.5);
+    if (mantissa == 100000000000000ull) {
+        mantissa /= 10;
+        exponent++;
+        if (exponent >= NUM_DIGITS) goto _slow;
+    }
+
+    char digits[NUM_DIGITS];
+    writeDigits(digits, mantissa);
+
+    int count = NUM_DIGITS;
+    while (digits[count - 1] == '0') count--;
+
+    if (value < 0) *s++ = '-';
+
+    if (exponent >= 0) {
+        int integral = exponent + 1;
+        memcpy(s, digits, integral);
+        s += integral;
+        if (count > integral) {
+            *s++ = '.';
+            memcpy(s, digits + integral, count - integral);
+            s += count - integral;
+        }
+    }
+    else {
+        *s++ = '0';
+        *s++ = '.';
+        for (int i = -1; i > exponent; i--) *s++ = '0';
+        memcpy(s, digits, count);
+        s += count;
+    }
+
+    return (int)(s - buffer);
+
+_slow:
+    return snprintf(buffer, FMT_NUM_MAX, "%.14g", value);
+}
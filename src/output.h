@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.h"
+
+#define OUT_BUFFER_SIZE     8192
+
+// Longest text fmt_num() and fmt_int() produce, '\0' included.
+#define FMT_NUM_MAX         32
+
+// Receives flushed output in place of stdout.
+typedef void (*out_fn)(void *user, const char *data, size_t length);
+
+typedef enum {
+    OUT_FLUSH_AUTO,     // per line on a terminal, else when full
+    OUT_FLUSH_LINE,
+    OUT_FLUSH_FULL,
+} flush_t;
+
+typedef struct {
+    out_fn write;
+    void *user;
+    flush_t mode;
+    size_t length;
+    char data[OUT_BUFFER_SIZE];
+} out_t;
+
+void out_init(out_t *out, out_fn write, void *user, flush_t mode);
+void out_flush(out_t *out);
+
+void out_write(out_t *out, const char *data, size_t length);
+void out_char(out_t *out, char c);
+void out_num(out_t *out, double value);
+void out_int(out_t *out, int64_t value);
+
+// Ends a line, flushing when the mode asks for it.
+void out_line(out_t *out);
+
+// Formats (value) exactly as "%.14g" does, returns the length.
+int fmt_num(char *buffer, double value);
+int fmt_int(char *buffer, int64_t value);
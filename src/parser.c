@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,6 +6,7 @@
 
 #include "code.h"
 #include "object.h"
+#include "vm.h"
 
 typedef struct _parser   parser_t;
 typedef struct _compiler compiler_t;
@@ -18,6 +20,8 @@ struct _parser {
     tok_t current;
     tok_t previous;
     int subExprs;
+    int lastCall;
+    int lastString;
     bool hadCall;
     bool hadAssign;
     bool hadError;
@@ -49,8 +53,29 @@ typedef struct {
 typedef struct {
     tok_t name;
     int depth;
+    bool isCaptured;
+    // For a local holding a nested function: whether the function
+    // may outlive this frame, and where its closure is created.
+    bool escapes;
+    int closure;
 } local_t;
 
+typedef struct {
+    uint8_t index;
+    bool isLocal;
+} upvalue_t;
+
+typedef struct _loop loop_t;
+
+struct _loop {
+    loop_t *enclosing;
+    int scopeDepth;
+    int exitCount;
+    int exits[UINT8_COUNT];
+    int continueCount;
+    int continues[UINT8_COUNT];
+};
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_SCRIPT
@@ -61,9 +86,12 @@ struct _compiler
     compiler_t *enclosing;
     fun_t *function;
     funtype_t type;
+    loop_t *loop;
     local_t locals[UINT8_COUNT];
     int localCount;
+    upvalue_t upvalues[UINT8_COUNT];
     int scopeDepth;
+    int selfLocal;
 };
 
 static chunk_t *currentChunk(parser_t *parser)
@@ -144,11 +172,6 @@ static void consumes(parser_t *parser, toktype_t type1, toktype_t type2, const c
     errorAtCurrent(parser, message);
 }
 
-static bool checkPrev(parser_t *parser, toktype_t type)
-{
-    return parser->previous.type == type;
-}
-
 static bool check(parser_t *parser, toktype_t type)
 {
     return parser->current.type == type;
@@ -163,7 +186,7 @@ static bool match(parser_t *parser, toktype_t type)
 
 static void emitByte(parser_t *parser, uint8_t byte)
 {
-    chunk_emit(currentChunk(parser), byte,
+    chunk_emit(parser->vm->gc, currentChunk(parser), byte,
         parser->previous.line, parser->previous.column);
 }
 
@@ -188,6 +211,23 @@ static int emitJump(parser_t *parser, uint8_t instruction)
     return currentChunk(parser)->count - 2;
 }
 
+static void emitBackJump(parser_t *parser, int loopStart)
+{
+    // +2 to adjust for the bytecode for the jump offset itself.
+    int offset = currentChunk(parser)->count - loopStart + 2;
+    if (offset > UINT16_MAX) {
+        error(parser, "Loop body too large.");
+    }
+
+    emitBytes(parser, (offset >> 8) & 0xff, offset & 0xff);
+}
+
+static void emitLoop(parser_t *parser, int loopStart)
+{
+    emitByte(parser, OP_LOOP);
+    emitBackJump(parser, loopStart);
+}
+
 static void emitReturn(parser_t *parser)
 {
     emitByte(parser, OP_NIL);
@@ -196,7 +236,8 @@ static void emitReturn(parser_t *parser)
 
 static uint8_t makeConstant(parser_t *parser, val_t value)
 {
-    int constant = arr_add(&currentChunk(parser)->constants, value, false);
+    int constant = arr_add(parser->vm->gc, &currentChunk(parser)->constants,
+        value, false);
     if (constant > UINT8_MAX) {
         error(parser, "Too many constants in one chunk.");
         return 0;
@@ -234,10 +275,21 @@ static void initCompiler(parser_t *parser, compiler_t *compiler, funtype_t type)
     compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->loop = NULL;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->selfLocal = -1;
     compiler->function = fun_new(parser->vm, parser->source);
 
+    // Keep the function reachable while it is being compiled.
+    vm_push(parser->vm, VAL_OBJ(compiler->function));
+
+    // A function declared in a block lives in the enclosing local
+    // just added for it, see funDeclaration().
+    if (type == TYPE_FUNCTION && compiler->enclosing->scopeDepth > 0) {
+        compiler->selfLocal = compiler->enclosing->localCount - 1;
+    }
+
     if (type != TYPE_SCRIPT) {
         compiler->function->name = str_copy(parser->vm, parser->previous.start,
             parser->previous.length, true);
@@ -245,6 +297,9 @@ static void initCompiler(parser_t *parser, compiler_t *compiler, funtype_t type)
 
     local_t *local = &compiler->locals[compiler->localCount++];
     local->depth = 0;
+    local->isCaptured = false;
+    local->escapes = false;
+    local->closure = -1;
     local->name.start = "";
     local->name.length = 0;
 
@@ -263,6 +318,7 @@ static fun_t *endCompiler(parser_t *parser)
 #endif
 
     parser->compiler = parser->compiler->enclosing;
+    vm_pop(parser->vm);
     return function;
 }
 
@@ -280,7 +336,12 @@ static void endScope(parser_t *parser)
     while (current->localCount > 0 &&
         current->locals[current->localCount - 1].depth >
         current->scopeDepth) {
-        emitByte(parser, OP_POP);
+        if (current->locals[current->localCount - 1].isCaptured) {
+            emitByte(parser, OP_CLOSE);
+        }
+        else {
+            emitByte(parser, OP_POP);
+        }
         current->localCount--;
     }
 }
@@ -318,6 +379,65 @@ static int resolveLocal(parser_t *parser, compiler_t *compiler, tok_t *name)
     return -1;
 }
 
+static void escapeLocal(parser_t *parser, compiler_t *compiler, int index)
+{
+    local_t *local = &compiler->locals[index];
+    if (local->escapes) return;
+    local->escapes = true;
+
+    // The closure was created assuming it stays on the stack,
+    // switch it to heap upvalues.
+    if (local->closure != -1) {
+        compiler->function->chunk.code[local->closure] = OP_CLOSURE;
+    }
+}
+
+static int addUpvalue(parser_t *parser, compiler_t *compiler, uint8_t index, bool isLocal)
+{
+    int upvalueCount = compiler->function->upvalueCount;
+
+    for (int i = 0; i < upvalueCount; i++) {
+        upvalue_t *upvalue = &compiler->upvalues[i];
+        if (upvalue->index == index && upvalue->isLocal == isLocal) {
+            return i;
+        }
+    }
+
+    if (upvalueCount == UINT8_COUNT) {
+        error(parser, "Too many closure variables in function.");
+        return 0;
+    }
+
+    compiler->upvalues[upvalueCount].isLocal = isLocal;
+    compiler->upvalues[upvalueCount].index = index;
+    return compiler->function->upvalueCount++;
+}
+
+static int resolveUpvalue(parser_t *parser, compiler_t *compiler, tok_t *name, bool isCall)
+{
+    if (compiler->enclosing == NULL) return -1;
+
+    int local = resolveLocal(parser, compiler->enclosing, name);
+    if (local != -1) {
+        compiler->enclosing->locals[local].isCaptured = true;
+
+        // Only a function calling itself may capture its own local
+        // without letting the closure escape.
+        if (!isCall || local != compiler->selfLocal) {
+            escapeLocal(parser, compiler->enclosing, local);
+        }
+
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
+    }
+
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name, false);
+    if (upvalue != -1) {
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
+    }
+
+    return -1;
+}
+
 static void addLocal(parser_t *parser, tok_t name)
 {
     compiler_t *current = parser->compiler;
@@ -330,6 +450,9 @@ static void addLocal(parser_t *parser, tok_t name)
     local_t *local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1;
+    local->isCaptured = false;
+    local->escapes = false;
+    local->closure = -1;
 }
 
 static void declareVariable(parser_t *parser)
@@ -410,11 +533,48 @@ static void and_(parser_t *parser, bool canAssign)
     patchJump(parser, endJump);
 }
 
+// Once a chain of '+' meets a string literal every operand has to be a
+// string, anything else is a type error, so the rest of the chain is
+// pushed as is and joined by one CONCATN.
+static void addition(parser_t *parser)
+{
+    bool joined = parser->lastString == currentChunk(parser)->count;
+    int count = 1;
+
+    do {
+        parsePrecedence(parser, (prec_t)(PREC_TERM + 1));
+
+        if (joined || parser->lastString == currentChunk(parser)->count) {
+            joined = true;
+            if (++count == UINT8_MAX) {
+                emitBytes(parser, OP_CONCATN, (uint8_t)count);
+                count = 1;
+            }
+        }
+        else {
+            emitByte(parser, OP_ADD);
+        }
+    } while (parser->current.line == parser->previous.line &&
+        match(parser, TOKEN_PLUS));
+
+    if (count == 2) {
+        emitByte(parser, OP_ADD);
+    }
+    else if (count > 2) {
+        emitBytes(parser, OP_CONCATN, (uint8_t)count);
+    }
+}
+
 static void binary(parser_t *parser, bool canAssign)
 {
     // Remember the operator.                                
     toktype_t operatorType = parser->previous.type;
 
+    if (operatorType == TOKEN_PLUS) {
+        addition(parser);
+        return;
+    }
+
     // Compile the right operand.                            
     rule_t *rule = getRule(operatorType);
     parsePrecedence(parser, (prec_t)(rule->precedence + 1));
@@ -442,11 +602,18 @@ static void call(parser_t *parser, bool canAssign)
 {
     uint8_t argCount = argumentList(parser);
     emitBytes(parser, OP_CALL, argCount);
+    parser->lastCall = currentChunk(parser)->count - 2;
 }
 
 static void dot(parser_t *parser, bool canAssign)
 {
-    consume(parser, TOKEN_IDENTIFIER, "Expect member name.");
+    // A keyword after the dot is a member name, as in gc.step().
+    if (parser->current.type >= TOKEN_AND && parser->current.type <= TOKEN_WITH) {
+        advance(parser);
+    }
+    else {
+        consume(parser, TOKEN_IDENTIFIER, "Expect member name.");
+    }
     uint8_t name = identifierConstant(parser, &parser->previous);
 
     if (canAssign && match(parser, TOKEN_EQUAL)) {
@@ -460,17 +627,29 @@ static void dot(parser_t *parser, bool canAssign)
 
 static void index_(parser_t *parser, bool canAssign)
 {
-    expression(parser);
-    consume(parser, TOKEN_RBRACKET, "Expected closing ']'");
+    uint8_t count = 0;
+
+    // $a[i][j] is one GETI/SETI, so a multi-dimensional array resolves
+    // all of its subscripts at once.
+    do {
+        if (count == ARY_DIMS_MAX) {
+            error(parser, "Too many subscripts.");
+        }
+
+        expression(parser);
+        consume(parser, TOKEN_RBRACKET, "Expected closing ']'");
+        count++;
+    } while (parser->current.line == parser->previous.line &&
+        match(parser, TOKEN_LBRACKET));
 
     if (canAssign && match(parser, TOKEN_EQUAL)) {
         expression(parser);
-        emitByte(parser, OP_SETI);
+        emitBytes(parser, OP_SETI, count);
 
         parser->hadAssign = true;
     }
     else {
-        emitByte(parser, OP_GETI);
+        emitBytes(parser, OP_GETI, count);
     }
 }
 
@@ -480,7 +659,14 @@ static void literal(parser_t *parser, bool canAssign)
         case TOKEN_FALSE:   emitByte(parser, OP_FALSE); break;
         case TOKEN_NULL:    emitByte(parser, OP_NIL); break;
         case TOKEN_TRUE:    emitByte(parser, OP_TRUE); break;
-        case TOKEN_FUNC:    emitBytes(parser, OP_LD, 0); break;
+        case TOKEN_FUNC: {
+            compiler_t *current = parser->compiler;
+            if (current->selfLocal != -1 && !check(parser, TOKEN_LPAREN)) {
+                escapeLocal(parser, current->enclosing, current->selfLocal);
+            }
+            emitBytes(parser, OP_LD, 0);
+            break;
+        }
         default:
             return; // Unreachable.                   
     }
@@ -492,8 +678,32 @@ static void grouping(parser_t *parser, bool canAssign)
     consume(parser, TOKEN_RPAREN, "Expect ')' after expression.");
 }
 
+static bool parseInteger(tok_t *token, int64_t *value)
+{
+    const char *start = token->start;
+    errno = 0;
+
+    if (token->length > 2 && start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) {
+        *value = (int64_t)strtoull(start + 2, NULL, 16);
+    }
+    else {
+        *value = strtoll(start, NULL, 10);
+    }
+
+    // Too large for an int, the literal becomes a number.
+    return errno != ERANGE;
+}
+
 static void number(parser_t *parser, bool canAssign)
 {
+    int64_t i;
+
+    if (parser->previous.type == TOKEN_INTEGER &&
+        parseInteger(&parser->previous, &i)) {
+        emitConstant(parser, VAL_INT(i));
+        return;
+    }
+
     double n = strtod(parser->previous.start, NULL);
     emitConstant(parser, VAL_NUM(n));
 }
@@ -504,6 +714,7 @@ static void string(parser_t *parser, bool canAssign)
         parser->previous.start + 1, parser->previous.length - 2, false);
 
     emitConstant(parser, VAL_OBJ(s));
+    parser->lastString = currentChunk(parser)->count;
 }
 
 static void map(parser_t *parser, bool canAssign)
@@ -524,11 +735,21 @@ static void map(parser_t *parser, bool canAssign)
 static void namedVariable(parser_t *parser, tok_t name, bool canAssign)
 {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(parser, parser->compiler, &name);
+    compiler_t *current = parser->compiler;
+    bool isCall = check(parser, TOKEN_LPAREN);
+    int arg = resolveLocal(parser, current, &name);
 
     if (arg != -1) {
         getOp = OP_LD;
         setOp = OP_ST;
+
+        // Any use of a local function other than a direct call
+        // may leak it out of this frame.
+        if (!isCall) escapeLocal(parser, current, arg);
+    }
+    else if ((arg = resolveUpvalue(parser, current, &name, isCall)) != -1) {
+        getOp = OP_ULD;
+        setOp = OP_UST;
     }
     else {
         arg = identifierConstant(parser, &name);
@@ -609,6 +830,7 @@ static rule_t rules[MAX_TOKENS] = {
     [TOKEN_IDENTIFIER]      = { variable, NULL,    PREC_NONE },
     [TOKEN_STRING]          = { string,   NULL,    PREC_NONE },
     [TOKEN_NUMBER]          = { number,   NULL,    PREC_NONE },
+    [TOKEN_INTEGER]         = { number,   NULL,    PREC_NONE },
 
     [TOKEN_AND]             = { NULL,     and_,    PREC_AND },
     [TOKEN_CLASS]           = { NULL,     NULL,    PREC_NONE },
@@ -677,20 +899,6 @@ static void block(parser_t *parser)
     consume(parser, TOKEN_RBRACE, "Expect '}' after block.");
 }
 
-static void inlineBlock(parser_t *parser)
-{
-    if (parser->current.line == parser->previous.line &&
-        !check(parser, TOKEN_EOF)) {
-        declaration(parser);
-        return;
-    }
-
-    while (!check(parser, TOKEN_ELSE) &&
-        !check(parser, TOKEN_EOF)) {
-        declaration(parser);
-    }
-}
-
 static void function(parser_t *parser, funtype_t type)
 {
     compiler_t compiler;
@@ -722,7 +930,24 @@ static void function(parser_t *parser, funtype_t type)
     fun_t *function = endCompiler(parser);
     uint8_t constant = makeConstant(parser, VAL_OBJ(function));
 
-    emitSmart(parser, OP_CONST, constant);
+    if (function->upvalueCount == 0) {
+        emitSmart(parser, OP_CONST, constant);
+        return;
+    }
+
+    // Closures start on the stack; escapeLocal() patches the
+    // instruction once a use lets the function outlive us.
+    local_t *self = compiler.selfLocal != -1 ?
+        &parser->compiler->locals[compiler.selfLocal] : NULL;
+    bool onStack = self != NULL && !self->escapes;
+
+    emitSmart(parser, onStack ? OP_STKCLOSURE : OP_CLOSURE, constant);
+    if (self != NULL) self->closure = currentChunk(parser)->count - 2;
+
+    for (int i = 0; i < function->upvalueCount; i++) {
+        emitBytes(parser, compiler.upvalues[i].isLocal ? 1 : 0,
+            compiler.upvalues[i].index);
+    }
 }
 
 static void funDeclaration(parser_t *parser)
@@ -733,32 +958,172 @@ static void funDeclaration(parser_t *parser)
     defineVariable(parser, global);
 }
 
-static void varDeclaration(parser_t *parser)
+typedef struct {
+    int dims;
+    int sizes[ARY_DIMS_MAX];
+    int count;
+} dim_t;
+
+// Sizes that are integer literals, -1 otherwise.
+static int constantSize(parser_t *parser, int start)
 {
-    uint8_t global = parseVariable(parser, "Expect variable name.");
+    chunk_t *chunk = currentChunk(parser);
+
+    if (chunk->count == start + 2 && chunk->code[start] == OP_CONST) {
+        val_t size = chunk->constants.values[chunk->code[start + 1]];
+        if (IS_INT(size) && AS_INT(size) >= 0 && AS_INT(size) <= ARY_COUNT_MAX) {
+            return (int)AS_INT(size);
+        }
+    }
+
+    return -1;
+}
+
+// Values go in row-major order, a short row is padded with nulls
+// so the next one starts at its own offset.
+static void arrayValues(parser_t *parser, dim_t *dim, int depth, int offset)
+{
+    int stride = 1;
+    for (int d = depth + 1; d < dim->dims; d++) {
+        stride *= dim->sizes[d];
+    }
+
+    int i = 0;
+    if (!check(parser, TOKEN_RBRACKET)) {
+        do {
+            if (dim->sizes[depth] != -1 && i == dim->sizes[depth]) {
+                error(parser, "Too many values for the array size.");
+                return;
+            }
+
+            int position = offset + i * stride;
+
+            if (depth + 1 < dim->dims) {
+                consume(parser, TOKEN_LBRACKET, "Expect '[' before a row of values.");
+                arrayValues(parser, dim, depth + 1, position);
+            }
+            else {
+                if (position >= UINT8_MAX) {
+                    error(parser, "Too many values in array initializer.");
+                    return;
+                }
+
+                while (dim->count < position) {
+                    emitByte(parser, OP_NIL);
+                    dim->count++;
+                }
+
+                expression(parser);
+                dim->count++;
+            }
+
+            i++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+
+    consume(parser, TOKEN_RBRACKET, "Expected closing ']'.");
+}
+
+// [size]... [= [values]] after the name of a Dim, Global or var.
+static void arrayDeclaration(parser_t *parser)
+{
+    dim_t dim = { 0 };
+    bool implicit = false;
+
+    do {
+        if (dim.dims == ARY_DIMS_MAX) {
+            error(parser, "Too many array dimensions.");
+            return;
+        }
+
+        if (dim.dims == 0 && check(parser, TOKEN_RBRACKET)) {
+            implicit = true;
+            dim.sizes[dim.dims++] = -1;
+        }
+        else {
+            int start = currentChunk(parser)->count;
+            expression(parser);
+            dim.sizes[dim.dims++] = constantSize(parser, start);
+        }
+
+        consume(parser, TOKEN_RBRACKET, "Expected closing ']'.");
+    } while (!implicit && match(parser, TOKEN_LBRACKET));
 
     if (match(parser, TOKEN_EQUAL)) {
+        for (int d = 1; d < dim.dims; d++) {
+            if (dim.sizes[d] == -1) {
+                error(parser, "Array initializer needs constant sizes.");
+                return;
+            }
+        }
+
+        consume(parser, TOKEN_LBRACKET, "Expect '[' before array values.");
+        arrayValues(parser, &dim, 0, 0);
+    }
+    else if (implicit) {
+        error(parser, "Array without a size needs values.");
+    }
+
+    emitBytes(parser, OP_ARRAY, implicit ? 0 : (uint8_t)dim.dims);
+    emitByte(parser, (uint8_t)dim.count);
+}
+
+static void initializer(parser_t *parser)
+{
+    if (parser->current.line == parser->previous.line &&
+        match(parser, TOKEN_LBRACKET)) {
+        arrayDeclaration(parser);
+    }
+    else if (match(parser, TOKEN_EQUAL)) {
         expression(parser);
     }
     else {
         emitByte(parser, OP_NIL);
     }
+}
 
+static void varDeclaration(parser_t *parser)
+{
+    uint8_t global = parseVariable(parser, "Expect variable name.");
+    initializer(parser);
     defineVariable(parser, global);
 }
 
-static void globalDeclaration(parser_t *parser)
+static void dimDeclaration(parser_t *parser)
 {
     do {
         uint8_t global = parseVariable(parser, "Expect variable name.");
+        initializer(parser);
+        defineVariable(parser, global);
+    } while (match(parser, TOKEN_COMMA));
+}
 
-        if (match(parser, TOKEN_EQUAL)) {
-            expression(parser);
-        }
-        else {
-            emitByte(parser, OP_NIL);
+static void redimStatement(parser_t *parser)
+{
+    consume(parser, TOKEN_IDENTIFIER, "Expect array name after 'ReDim'.");
+    namedVariable(parser, parser->previous, false);
+
+    uint8_t dims = 0;
+    consume(parser, TOKEN_LBRACKET, "Expect '[' after array name.");
+    do {
+        if (dims == ARY_DIMS_MAX) {
+            error(parser, "Too many array dimensions.");
+            return;
         }
 
+        expression(parser);
+        consume(parser, TOKEN_RBRACKET, "Expected closing ']'.");
+        dims++;
+    } while (match(parser, TOKEN_LBRACKET));
+
+    emitBytes(parser, OP_REDIM, dims);
+}
+
+static void globalDeclaration(parser_t *parser)
+{
+    do {
+        uint8_t global = parseVariable(parser, "Expect variable name.");
+        initializer(parser);
         emitSmart(parser, OP_DEF, global);
 
     } while (match(parser, TOKEN_COMMA));
@@ -779,6 +1144,17 @@ static void expressionStatement(parser_t *parser)
     }
 }
 
+static void ifBlock(parser_t *parser)
+{
+    beginScope(parser);
+    while (!check(parser, TOKEN_ELSE) && !check(parser, TOKEN_ELSEIF) &&
+        !check(parser, TOKEN_END) && !check(parser, TOKEN_ENDIF) &&
+        !check(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    endScope(parser);
+}
+
 static void ifStatement(parser_t *parser)
 {
     expression(parser);
@@ -787,14 +1163,23 @@ static void ifStatement(parser_t *parser)
 
     int thenJump = emitJump(parser, OP_JMPF);
     emitByte(parser, OP_POP);
-    statement(parser);
+    if (isInline) statement(parser); else ifBlock(parser);
 
     int elseJump = emitJump(parser, OP_JMP);
 
     patchJump(parser, thenJump);
     emitByte(parser, OP_POP);
 
-    if (match(parser, TOKEN_ELSE)) statement(parser);
+    if (!isInline && match(parser, TOKEN_ELSEIF)) {
+        // The nested 'If' consumes the closing 'EndIf'.
+        ifStatement(parser);
+        patchJump(parser, elseJump);
+        return;
+    }
+
+    if (match(parser, TOKEN_ELSE)) {
+        if (isInline) statement(parser); else ifBlock(parser);
+    }
     patchJump(parser, elseJump);
 
     if (!isInline) {
@@ -803,6 +1188,595 @@ static void ifStatement(parser_t *parser)
     }
 }
 
+static void beginLoop(parser_t *parser, loop_t *loop)
+{
+    compiler_t *current = parser->compiler;
+
+    loop->enclosing = current->loop;
+    loop->scopeDepth = current->scopeDepth;
+    loop->exitCount = 0;
+    loop->continueCount = 0;
+
+    current->loop = loop;
+}
+
+static void patchContinues(parser_t *parser)
+{
+    loop_t *loop = parser->compiler->loop;
+
+    for (int i = 0; i < loop->continueCount; i++) {
+        patchJump(parser, loop->continues[i]);
+    }
+}
+
+static void endLoop(parser_t *parser)
+{
+    loop_t *loop = parser->compiler->loop;
+
+    for (int i = 0; i < loop->exitCount; i++) {
+        patchJump(parser, loop->exits[i]);
+    }
+
+    parser->compiler->loop = loop->enclosing;
+}
+
+static void loopBody(parser_t *parser, toktype_t end)
+{
+    beginScope(parser);
+    while (!check(parser, end) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    endScope(parser);
+}
+
+static void forStatement(parser_t *parser)
+{
+    compiler_t *current = parser->compiler;
+    beginScope(parser);
+
+    // The counter, limit and step live in three consecutive slots,
+    // the counter being the loop variable itself.
+    consume(parser, TOKEN_IDENTIFIER, "Expect loop variable name.");
+    tok_t name = parser->previous;
+    consume(parser, TOKEN_EQUAL, "Expect '=' after loop variable.");
+    expression(parser);
+    addLocal(parser, name);
+    markInitialized(parser);
+
+    consume(parser, TOKEN_TO, "Expect 'To' after initial value.");
+    expression(parser);
+    addLocal(parser, (tok_t){ .start = "", .length = 0 });
+    markInitialized(parser);
+
+    if (match(parser, TOKEN_STEP)) {
+        expression(parser);
+    }
+    else {
+        emitConstant(parser, VAL_INT(1));
+    }
+    addLocal(parser, (tok_t){ .start = "", .length = 0 });
+    markInitialized(parser);
+
+    uint8_t slot = (uint8_t)(current->localCount - 3);
+    emitBytes(parser, OP_FORPREP, slot);
+    emitBytes(parser, 0, 0);
+    int prepJump = currentChunk(parser)->count - 2;
+
+    loop_t loop;
+    beginLoop(parser, &loop);
+    int bodyStart = currentChunk(parser)->count;
+    loopBody(parser, TOKEN_NEXT);
+    consume(parser, TOKEN_NEXT, "Expect 'Next' after loop body.");
+
+    patchContinues(parser);
+    emitBytes(parser, OP_FORLOOP, slot);
+    emitBackJump(parser, bodyStart);
+
+    patchJump(parser, prepJump);
+    endLoop(parser);
+    endScope(parser);
+}
+
+static void whileStatement(parser_t *parser)
+{
+    int loopStart = currentChunk(parser)->count;
+    expression(parser);
+
+    int exitJump = emitJump(parser, OP_JMPF);
+    emitByte(parser, OP_POP);
+
+    loop_t loop;
+    beginLoop(parser, &loop);
+    loopBody(parser, TOKEN_WEND);
+    consume(parser, TOKEN_WEND, "Expect 'WEnd' after loop body.");
+
+    patchContinues(parser);
+    emitLoop(parser, loopStart);
+
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
+    endLoop(parser);
+}
+
+static void doStatement(parser_t *parser)
+{
+    int loopStart = currentChunk(parser)->count;
+
+    loop_t loop;
+    beginLoop(parser, &loop);
+    loopBody(parser, TOKEN_UNTIL);
+    consume(parser, TOKEN_UNTIL, "Expect 'Until' after loop body.");
+
+    patchContinues(parser);
+    expression(parser);
+
+    int loopJump = emitJump(parser, OP_JMPF);
+    emitByte(parser, OP_POP);
+    int exitJump = emitJump(parser, OP_JMP);
+
+    patchJump(parser, loopJump);
+    emitByte(parser, OP_POP);
+    emitLoop(parser, loopStart);
+
+    patchJump(parser, exitJump);
+    endLoop(parser);
+}
+
+typedef enum {
+    SWITCH_CHAIN,
+    SWITCH_INT,
+    SWITCH_STR
+} switchmode_t;
+
+typedef struct {
+    double low;
+    double high;
+    uint8_t constant;
+    int body;
+} label_t;
+
+static bool isIntegral(double n)
+{
+    return n == (double)(int32_t)n;
+}
+
+static bool scanNumber(lexer_t *lexer, tok_t *token, double *value)
+{
+    bool negate = false;
+
+    if (token->type == TOKEN_MINUS) {
+        negate = true;
+        *token = lexer_scan(lexer);
+    }
+
+    if (token->type != TOKEN_NUMBER && token->type != TOKEN_INTEGER) return false;
+
+    *value = strtod(token->start, NULL);
+    if (negate) *value = -*value;
+
+    *token = lexer_scan(lexer);
+    return true;
+}
+
+static switchmode_t scanSwitch(parser_t *parser, double *low, double *high)
+{
+    // Look ahead over the labels without emitting any code, a jump
+    // table needs all of them to be constants of the same kind.
+    lexer_t saved = *parser->lexer;
+    lexer_t *lexer = parser->lexer;
+    tok_t token = parser->current;
+
+    int depth = 0;
+    int ints = 0, strs = 0;
+    double covered = 0;
+    bool chain = false;
+
+    while (token.type != TOKEN_EOF && !chain) {
+        switch (token.type) {
+            case TOKEN_SWITCH:
+            case TOKEN_SELECT:
+                depth++;
+                break;
+            case TOKEN_ENDSELECT:
+                depth--;
+                break;
+            case TOKEN_ENDSWITCH:
+                if (depth-- == 0) goto done;
+                break;
+            case TOKEN_CASE: {
+                if (depth > 0) break;
+
+                int line = token.line;
+                token = lexer_scan(lexer);
+                if (token.type == TOKEN_ELSE) break;
+
+                for (;;) {
+                    double from, to;
+
+                    if (token.type == TOKEN_STRING) {
+                        token = lexer_scan(lexer);
+                        strs++;
+                    }
+                    else if (scanNumber(lexer, &token, &from)) {
+                        to = from;
+                        if (token.type == TOKEN_TO) {
+                            token = lexer_scan(lexer);
+                            if (!scanNumber(lexer, &token, &to)) chain = true;
+                        }
+
+                        if (!isIntegral(from) || !isIntegral(to) || to < from) {
+                            chain = true;
+                        }
+
+                        if (ints == 0 || from < *low) *low = from;
+                        if (ints == 0 || to > *high) *high = to;
+                        covered += to - from + 1;
+                        ints++;
+                    }
+                    else {
+                        chain = true;
+                    }
+
+                    if (chain || token.type != TOKEN_COMMA) break;
+                    token = lexer_scan(lexer);
+                }
+
+                // The labels must be the only thing on the line.
+                if (token.line == line && token.type != TOKEN_EOF) chain = true;
+                continue;
+            }
+            default:
+                break;
+        }
+
+        token = lexer_scan(lexer);
+    }
+
+done:
+    *parser->lexer = saved;
+
+    if (chain || (ints > 0 && strs > 0)) return SWITCH_CHAIN;
+    if (strs > 0) return SWITCH_STR;
+    if (ints == 0) return SWITCH_CHAIN;
+
+    // Sparse integer labels would make a mostly empty table.
+    double span = *high - *low + 1;
+    if (span > 4096 || span > covered * 2 + 16) return SWITCH_CHAIN;
+
+    return SWITCH_INT;
+}
+
+static double constantNumber(parser_t *parser)
+{
+    bool negate = match(parser, TOKEN_MINUS);
+    if (!match(parser, TOKEN_INTEGER)) {
+        consume(parser, TOKEN_NUMBER, "Expect a number.");
+    }
+
+    double n = strtod(parser->previous.start, NULL);
+    return negate ? -n : n;
+}
+
+static void caseBody(parser_t *parser)
+{
+    beginScope(parser);
+    while (!check(parser, TOKEN_CASE) && !check(parser, TOKEN_ENDSWITCH) &&
+        !check(parser, TOKEN_ENDSELECT) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    endScope(parser);
+}
+
+static void emitDistance(parser_t *parser, int from, int to)
+{
+    // Targets precede the dispatch, zero means no match.
+    int distance = to == -1 ? 0 : from - to;
+
+    if (distance > UINT16_MAX) {
+        error(parser, "Too much code to jump over.");
+    }
+
+    emitBytes(parser, (distance >> 8) & 0xff, distance & 0xff);
+}
+
+static void emitIntTable(parser_t *parser, label_t *labels, int count,
+    int elseBody, double low, double high)
+{
+    int start = currentChunk(parser)->count;
+    int span = (int)(high - low) + 1;
+
+    emitSmart(parser, OP_JMPTABLE, makeConstant(parser, VAL_NUM(low)));
+    emitBytes(parser, (span >> 8) & 0xff, span & 0xff);
+    emitDistance(parser, start, elseBody);
+
+    for (int i = 0; i < span; i++) {
+        double value = low + i;
+        int body = -1;
+
+        // The first matching label wins.
+        for (int j = 0; j < count; j++) {
+            if (labels[j].low <= value && value <= labels[j].high) {
+                body = labels[j].body;
+                break;
+            }
+        }
+
+        emitDistance(parser, start, body);
+    }
+}
+
+static void emitStrTable(parser_t *parser, label_t *labels, int count, int elseBody)
+{
+    int start = currentChunk(parser)->count;
+    int slots[UINT8_COUNT * 2];
+    int capacity = 4;
+
+    while (capacity < count * 2) capacity *= 2;
+    for (int i = 0; i < capacity; i++) slots[i] = -1;
+
+    arr_t *constants = &currentChunk(parser)->constants;
+    for (int i = 0; i < count; i++) {
+        uint8_t constant = labels[i].constant;
+        uint32_t index = AS_STR(constants->values[constant])->hash & (capacity - 1);
+
+        while (slots[index] != -1 &&
+            labels[slots[index]].constant != constant) {
+            index = (index + 1) & (capacity - 1);
+        }
+
+        // The first matching label wins.
+        if (slots[index] == -1) slots[index] = i;
+    }
+
+    emitByte(parser, OP_JMPSTR);
+    emitBytes(parser, (capacity >> 8) & 0xff, capacity & 0xff);
+    emitDistance(parser, start, elseBody);
+
+    for (int i = 0; i < capacity; i++) {
+        if (slots[i] == -1) {
+            emitByte(parser, 0);
+            emitDistance(parser, start, -1);
+        }
+        else {
+            emitByte(parser, labels[slots[i]].constant);
+            emitDistance(parser, start, labels[slots[i]].body);
+        }
+    }
+}
+
+static void switchChain(parser_t *parser)
+{
+    // The subject stays in a hidden local while the labels are compared.
+    beginScope(parser);
+    addLocal(parser, (tok_t){ .start = "", .length = 0 });
+    markInitialized(parser);
+
+    uint8_t subject = (uint8_t)(parser->compiler->localCount - 1);
+    int endJumps[UINT8_COUNT];
+    int endCount = 0;
+
+    while (match(parser, TOKEN_CASE)) {
+        if (match(parser, TOKEN_ELSE)) {
+            caseBody(parser);
+            break;
+        }
+
+        int bodyJumps[UINT8_COUNT];
+        int bodyCount = 0;
+
+        do {
+            if (bodyCount == UINT8_COUNT) {
+                error(parser, "Too many labels in one 'Case'.");
+                break;
+            }
+
+            emitBytes(parser, OP_LD, subject);
+            expression(parser);
+
+            if (match(parser, TOKEN_TO)) {
+                // low <= subject
+                emitBytes(parser, OP_LT, OP_NOT);
+                int lowJump = emitJump(parser, OP_JMPF);
+                emitByte(parser, OP_POP);
+
+                // subject <= high
+                emitBytes(parser, OP_LD, subject);
+                expression(parser);
+                emitByte(parser, OP_LE);
+                int highJump = emitJump(parser, OP_JMPF);
+
+                bodyJumps[bodyCount++] = emitJump(parser, OP_JMP);
+                patchJump(parser, lowJump);
+                patchJump(parser, highJump);
+            }
+            else {
+                emitByte(parser, OP_EQ);
+                int nextJump = emitJump(parser, OP_JMPF);
+
+                bodyJumps[bodyCount++] = emitJump(parser, OP_JMP);
+                patchJump(parser, nextJump);
+            }
+
+            emitByte(parser, OP_POP);
+        } while (match(parser, TOKEN_COMMA));
+
+        int skipJump = emitJump(parser, OP_JMP);
+
+        for (int i = 0; i < bodyCount; i++) {
+            patchJump(parser, bodyJumps[i]);
+        }
+        emitByte(parser, OP_POP);
+
+        caseBody(parser);
+
+        if (endCount == UINT8_COUNT) {
+            error(parser, "Too many cases in one 'Switch'.");
+            break;
+        }
+        endJumps[endCount++] = emitJump(parser, OP_JMP);
+        patchJump(parser, skipJump);
+    }
+
+    consume(parser, TOKEN_ENDSWITCH, "Expect 'EndSwitch' after cases.");
+
+    for (int i = 0; i < endCount; i++) {
+        patchJump(parser, endJumps[i]);
+    }
+
+    endScope(parser);
+}
+
+static void switchStatement(parser_t *parser)
+{
+    double low = 0, high = 0;
+    expression(parser);
+
+    switchmode_t mode = scanSwitch(parser, &low, &high);
+    if (mode == SWITCH_CHAIN) {
+        switchChain(parser);
+        return;
+    }
+
+    // The case bodies come first, the dispatch goes at the end and
+    // jumps back to them, as only then all the labels are known.
+    label_t labels[UINT8_COUNT];
+    int labelCount = 0;
+    int endJumps[UINT8_COUNT];
+    int endCount = 0;
+    int elseBody = -1;
+
+    int dispatchJump = emitJump(parser, OP_JMP);
+
+    while (match(parser, TOKEN_CASE)) {
+        int body = currentChunk(parser)->count;
+
+        if (match(parser, TOKEN_ELSE)) {
+            elseBody = body;
+        }
+        else do {
+            if (labelCount == UINT8_COUNT) {
+                error(parser, "Too many labels in one 'Switch'.");
+                break;
+            }
+
+            label_t *label = &labels[labelCount++];
+            label->body = body;
+
+            if (mode == SWITCH_STR) {
+                consume(parser, TOKEN_STRING, "Expect a string.");
+                str_t *s = str_copy(parser->vm, parser->previous.start + 1,
+                    parser->previous.length - 2, false);
+                label->constant = makeConstant(parser, VAL_OBJ(s));
+            }
+            else {
+                label->low = constantNumber(parser);
+                label->high = match(parser, TOKEN_TO) ?
+                    constantNumber(parser) : label->low;
+            }
+        } while (match(parser, TOKEN_COMMA));
+
+        caseBody(parser);
+
+        if (endCount == UINT8_COUNT) {
+            error(parser, "Too many cases in one 'Switch'.");
+            break;
+        }
+        endJumps[endCount++] = emitJump(parser, OP_JMP);
+    }
+
+    consume(parser, TOKEN_ENDSWITCH, "Expect 'EndSwitch' after cases.");
+    patchJump(parser, dispatchJump);
+
+    if (mode == SWITCH_INT) {
+        emitIntTable(parser, labels, labelCount, elseBody, low, high);
+    }
+    else {
+        emitStrTable(parser, labels, labelCount, elseBody);
+    }
+
+    for (int i = 0; i < endCount; i++) {
+        patchJump(parser, endJumps[i]);
+    }
+}
+
+static void selectStatement(parser_t *parser)
+{
+    int endJumps[UINT8_COUNT];
+    int endCount = 0;
+
+    while (match(parser, TOKEN_CASE)) {
+        if (match(parser, TOKEN_ELSE)) {
+            caseBody(parser);
+            break;
+        }
+
+        expression(parser);
+        int nextJump = emitJump(parser, OP_JMPF);
+        emitByte(parser, OP_POP);
+
+        caseBody(parser);
+
+        if (endCount == UINT8_COUNT) {
+            error(parser, "Too many cases in one 'Select'.");
+            break;
+        }
+        endJumps[endCount++] = emitJump(parser, OP_JMP);
+
+        patchJump(parser, nextJump);
+        emitByte(parser, OP_POP);
+    }
+
+    consume(parser, TOKEN_ENDSELECT, "Expect 'EndSelect' after cases.");
+
+    for (int i = 0; i < endCount; i++) {
+        patchJump(parser, endJumps[i]);
+    }
+}
+
+static void discardLocals(parser_t *parser, int depth)
+{
+    compiler_t *current = parser->compiler;
+
+    for (int i = current->localCount - 1;
+        i >= 0 && current->locals[i].depth > depth; i--) {
+        emitByte(parser, current->locals[i].isCaptured ? OP_CLOSE : OP_POP);
+    }
+}
+
+static void exitLoopStatement(parser_t *parser)
+{
+    loop_t *loop = parser->compiler->loop;
+    if (loop == NULL) {
+        error(parser, "Cannot use 'ExitLoop' outside of a loop.");
+        return;
+    }
+
+    if (loop->exitCount == UINT8_COUNT) {
+        error(parser, "Too many 'ExitLoop' in one loop.");
+        return;
+    }
+
+    discardLocals(parser, loop->scopeDepth);
+    loop->exits[loop->exitCount++] = emitJump(parser, OP_JMP);
+}
+
+static void continueLoopStatement(parser_t *parser)
+{
+    loop_t *loop = parser->compiler->loop;
+    if (loop == NULL) {
+        error(parser, "Cannot use 'ContinueLoop' outside of a loop.");
+        return;
+    }
+
+    if (loop->continueCount == UINT8_COUNT) {
+        error(parser, "Too many 'ContinueLoop' in one loop.");
+        return;
+    }
+
+    discardLocals(parser, loop->scopeDepth);
+    loop->continues[loop->continueCount++] = emitJump(parser, OP_JMP);
+}
+
 static void printStatement(parser_t *parser)
 {
     int count = 0;
@@ -819,6 +1793,17 @@ static void printStatement(parser_t *parser)
     emitBytes(parser, OP_PRINT, count);
 }
 
+static bool hasCaptures(parser_t *parser)
+{
+    compiler_t *current = parser->compiler;
+
+    for (int i = 0; i < current->localCount; i++) {
+        if (current->locals[i].isCaptured) return true;
+    }
+
+    return false;
+}
+
 static void returnStatement(parser_t *parser)
 {
     if (parser->compiler->type == TYPE_SCRIPT) {
@@ -833,7 +1818,16 @@ static void returnStatement(parser_t *parser)
         emitReturn(parser);
     }
     else {
+        parser->lastCall = -1;
         expression(parser);
+
+        // A call in tail position reuses the current frame, unless
+        // closures still refer to its slots.
+        chunk_t *chunk = currentChunk(parser);
+        if (parser->lastCall == chunk->count - 2 && !hasCaptures(parser)) {
+            chunk->code[parser->lastCall] = OP_TAILCALL;
+        }
+
         emitByte(parser, OP_RET);
     }
 }
@@ -865,9 +1859,11 @@ static void synchronize(parser_t *parser)
             case TOKEN_CLASS:
             case TOKEN_FUNC:
             case TOKEN_VAR:
+            case TOKEN_DIM:
             case TOKEN_FOR:
             case TOKEN_IF:
             case TOKEN_WHILE:
+            case TOKEN_DO:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
                 return;
@@ -889,6 +1885,9 @@ static void declaration(parser_t *parser)
     else if (match(parser, TOKEN_GLOBAL)) {
         globalDeclaration(parser);
     }
+    else if (match(parser, TOKEN_DIM)) {
+        dimDeclaration(parser);
+    }
     else {
         statement(parser);
     }
@@ -907,6 +1906,30 @@ static void statement(parser_t *parser)
     else if (match(parser, TOKEN_RETURN)) {
         returnStatement(parser);
     }
+    else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    }
+    else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    }
+    else if (match(parser, TOKEN_DO)) {
+        doStatement(parser);
+    }
+    else if (match(parser, TOKEN_SWITCH)) {
+        switchStatement(parser);
+    }
+    else if (match(parser, TOKEN_SELECT)) {
+        selectStatement(parser);
+    }
+    else if (match(parser, TOKEN_EXITLOOP)) {
+        exitLoopStatement(parser);
+    }
+    else if (match(parser, TOKEN_CONTINUELOOP)) {
+        continueLoopStatement(parser);
+    }
+    else if (match(parser, TOKEN_REDIM)) {
+        redimStatement(parser);
+    }
     else if (match(parser, TOKEN_EXIT)) {
         exitStatement(parser);
     }
@@ -915,18 +1938,6 @@ static void statement(parser_t *parser)
         block(parser);
         endScope(parser);
     }
-    else if (checkPrev(parser, TOKEN_THEN)) {
-        beginScope(parser);
-        inlineBlock(parser);
-        endScope(parser);
-    }
-    else if (checkPrev(parser, TOKEN_ELSE)) {
-        beginScope(parser);
-        while (!check(parser, TOKEN_ENDIF) && !check(parser, TOKEN_EOF)) {
-            declaration(parser);
-        }
-        endScope(parser);
-    }
     else {
         expressionStatement(parser);
     }
@@ -942,6 +1953,8 @@ fun_t *compile(vm_t *vm, src_t *source)
     parser.source = source;
     parser.lexer = &lexer;
     parser.compiler = NULL;
+    parser.lastCall = -1;
+    parser.lastString = -1;
     parser.hadError = false;
     parser.panicMode = false;
 
@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#include "profile.h"
+#include "object.h"
+#include "vm.h"
+
+#define SAMPLE_HZ_MAX   10000
+#define STACK_TEXT_MAX  8192
+
+// The VM the timer samples, set while a profile runs.
+static vm_t *volatile sampled;
+
+#ifdef _WIN32
+static HANDLE timer;
+
+// Timer queue callbacks run on a pool thread, so samples follow wall
+// clock time here rather than CPU time.
+static VOID CALLBACK onTimer(PVOID param, BOOLEAN fired)
+{
+    vm_t *vm = sampled;
+    if (vm != NULL) vm->sample = 1;
+}
+
+static bool timerStart(int hz)
+{
+    DWORD period = 1000 / hz > 0 ? 1000 / hz : 1;
+    return CreateTimerQueueTimer(&timer, NULL, onTimer, NULL, period, period,
+        WT_EXECUTEDEFAULT) != 0;
+}
+
+static void timerStop(void)
+{
+    DeleteTimerQueueTimer(NULL, timer, INVALID_HANDLE_VALUE);
+}
+#else
+static struct sigaction previous;
+
+static void onProf(int signal)
+{
+    (void)signal;
+    vm_t *vm = sampled;
+    if (vm != NULL) vm->sample = 1;
+}
+
+static bool timerStart(int hz)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onProf;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous) != 0) return false;
+
+    struct itimerval interval;
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_usec = 1000000 / hz;
+    interval.it_value = interval.it_interval;
+    if (setitimer(ITIMER_PROF, &interval, NULL) != 0) {
+        sigaction(SIGPROF, &previous, NULL);
+        return false;
+    }
+
+    return true;
+}
+
+static void timerStop(void)
+{
+    struct itimerval interval;
+    memset(&interval, 0, sizeof(interval));
+    setitimer(ITIMER_PROF, &interval, NULL);
+    sigaction(SIGPROF, &previous, NULL);
+}
+#endif
+
+static sample_t *sampleFind(sample_t *samples, int capacity, const char *stack, uint32_t hash)
+{
+    uint32_t index = hash & (capacity - 1);
+
+    for (;;) {
+        sample_t *sample = &samples[index];
+        if (sample->stack == NULL) return sample;
+        if (sample->hash == hash && strcmp(sample->stack, stack) == 0) return sample;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void samplesGrow(sampler_t *sampler)
+{
+    int capacity = sampler->capacity < 256 ? 256 : sampler->capacity * 2;
+    sample_t *samples = calloc(capacity, sizeof(sample_t));
+
+    for (int i = 0; i < sampler->capacity; i++) {
+        sample_t *sample = &sampler->samples[i];
+        if (sample->stack != NULL) *sampleFind(samples, capacity, sample->stack, sample->hash) = *sample;
+    }
+
+    free(sampler->samples);
+    sampler->samples = samples;
+    sampler->capacity = capacity;
+}
+
+// Frames as name:line, the top level under the script's file name.
+static int frameText(char *dest, int size, frame_t *frame)
+{
+    fun_t *function = frame->function;
+    chunk_t *chunk = &function->chunk;
+    const char *name = function->name != NULL ? function->name->chars
+        : chunk->source != NULL ? chunk->source->fname : "<script>";
+
+    int offset = (int)(frame->ip - chunk->code) - 1;
+    int line = offset >= 0 && offset < chunk->count ? chunk->lines[offset] : 0;
+    return snprintf(dest, size, "%s:%d", name, line);
+}
+
+void sampler_record(vm_t *vm)
+{
+    sampler_t *sampler = vm->sampler;
+    if (sampler == NULL || vm->frameCount == 0) return;
+
+    char text[STACK_TEXT_MAX];
+    int length = 0;
+
+    for (int i = 0; i < vm->frameCount && length < STACK_TEXT_MAX - 1; i++) {
+        if (i > 0) text[length++] = ';';
+        int n = frameText(text + length, STACK_TEXT_MAX - length, &vm->frames[i]);
+        length += n < STACK_TEXT_MAX - length ? n : STACK_TEXT_MAX - 1 - length;
+    }
+    text[length] = '\0';
+
+    if (sampler->count + 1 > sampler->capacity / 2) samplesGrow(sampler);
+
+    uint32_t hash = hash_string(text, length, false);
+    sample_t *sample = sampleFind(sampler->samples, sampler->capacity, text, hash);
+    if (sample->stack == NULL) {
+        sample->stack = strdup(text);
+        sample->hash = hash;
+        sampler->count++;
+    }
+
+    sample->count++;
+    sampler->total++;
+}
+
+bool vm_profile_start(vm_t *vm, int hz)
+{
+    if (sampled != NULL || hz <= 0 || hz > SAMPLE_HZ_MAX) return false;
+
+    sampler_t *sampler = calloc(1, sizeof(sampler_t));
+    if (sampler == NULL) return false;
+    sampler->hz = hz;
+
+    vm->sampler = sampler;
+    vm->sample = 0;
+    sampled = vm;
+
+    if (!timerStart(hz)) {
+        sampled = NULL;
+        vm->sampler = NULL;
+        free(sampler);
+        return false;
+    }
+
+    return true;
+}
+
+// Writes "frame;frame;frame count" lines to (path), none for NULL.
+bool vm_profile_stop(vm_t *vm, const char *path)
+{
+    sampler_t *sampler = vm->sampler;
+    if (sampler == NULL) return false;
+
+    timerStop();
+    sampled = NULL;
+    vm->sampler = NULL;
+    vm->sample = 0;
+
+    bool written = path == NULL;
+    FILE *file = path != NULL ? fopen(path, "w") : NULL;
+    if (file != NULL) {
+        for (int i = 0; i < sampler->capacity; i++) {
+            sample_t *sample = &sampler->samples[i];
+            if (sample->stack != NULL) {
+                fprintf(file, "%s %llu\n", sample->stack, (unsigned long long)sample->count);
+            }
+        }
+        written = fclose(file) == 0;
+    }
+    else if (path != NULL) {
+        fprintf(stderr, "Could not write profile \"%s\".\n", path);
+    }
+
+    for (int i = 0; i < sampler->capacity; i++) free(sampler->samples[i].stack);
+    free(sampler->samples);
+    free(sampler);
+    return written;
+}
+
+static inline uint32_t pointerHash(const void *pointer)
+{
+    uint64_t h = (uint64_t)(uintptr_t)pointer * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h >> 32);
+}
+
+// Sites are found by instruction address and type. Like the opcode
+// sites the place is written down when first seen.
+static int allocSite(allocprof_t *prof, vm_t *vm, obj_t *object)
+{
+    const uint8_t *ip = NULL;
+    frame_t *frame = NULL;
+    int type = object->type;
+
+    if (vm->frameCount > 0) {
+        frame = &vm->frames[vm->frameCount - 1];
+        ip = frame->ip;
+    }
+
+    if (prof->siteCount + 1 > prof->indexCapacity / 2) {
+        prof->indexCapacity = prof->indexCapacity < 256 ? 256 : prof->indexCapacity * 2;
+        free(prof->index);
+        prof->index = calloc(prof->indexCapacity, sizeof(int));
+
+        for (int i = 0; i < prof->siteCount; i++) {
+            uint32_t slot = (pointerHash(prof->sites[i].ip) + prof->sites[i].type) & (prof->indexCapacity - 1);
+            while (prof->index[slot] != 0) slot = (slot + 1) & (prof->indexCapacity - 1);
+            prof->index[slot] = i + 1;
+        }
+    }
+
+    uint32_t slot = (pointerHash(ip) + type) & (prof->indexCapacity - 1);
+    for (; prof->index[slot] != 0; slot = (slot + 1) & (prof->indexCapacity - 1)) {
+        alsite_t *site = &prof->sites[prof->index[slot] - 1];
+        if (site->ip == ip && site->type == type) return prof->index[slot] - 1;
+    }
+    prof->index[slot] = prof->siteCount + 1;
+
+    if (prof->siteCount == prof->siteCapacity) {
+        prof->siteCapacity = GROW_CAP(prof->siteCapacity);
+        prof->sites = realloc(prof->sites, prof->siteCapacity * sizeof(alsite_t));
+    }
+
+    char where[256];
+    if (frame != NULL) {
+        fun_t *function = frame->function;
+        chunk_t *chunk = &function->chunk;
+        int offset = (int)(ip - chunk->code) - 1;
+        if (offset < 0) offset = 0;
+
+        snprintf(where, sizeof(where), "%s %s:%d:%d",
+            function->name != NULL ? function->name->chars : "<script>",
+            chunk->source != NULL ? chunk->source->fname : "?",
+            chunk->lines[offset], chunk->columns[offset]);
+    }
+    else {
+        snprintf(where, sizeof(where), "<host>");
+    }
+
+    alsite_t *site = &prof->sites[prof->siteCount];
+    memset(site, 0, sizeof(alsite_t));
+    site->ip = ip;
+    site->type = type;
+    site->where = strdup(where);
+    return prof->siteCount++;
+}
+
+static alive_t *liveFind(alive_t *live, int capacity, const obj_t *object, bool insert)
+{
+    uint32_t index = pointerHash(object) & (capacity - 1);
+    alive_t *tombstone = NULL;
+
+    for (;;) {
+        alive_t *entry = &live[index];
+        if (entry->object == object) return entry;
+        if (entry->object == NULL) {
+            if (entry->site == 0) return insert && tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL) tombstone = entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void liveGrow(allocprof_t *prof)
+{
+    int capacity = prof->liveCapacity < 1024 ? 1024 : prof->liveCapacity;
+    if (prof->liveCount * 4 >= capacity) capacity *= 2;
+
+    alive_t *live = calloc(capacity, sizeof(alive_t));
+    for (int i = 0; i < prof->liveCapacity; i++) {
+        alive_t *entry = &prof->live[i];
+        if (entry->object != NULL) *liveFind(live, capacity, entry->object, true) = *entry;
+    }
+
+    free(prof->live);
+    prof->live = live;
+    prof->liveCapacity = capacity;
+    prof->liveUsed = prof->liveCount;
+}
+
+// Live entries keep their site one up so a zeroed slot is empty and an
+// emptied one with a site left is a tombstone.
+void allocprof_alloc(gc_t *gc, obj_t *object, size_t size)
+{
+    allocprof_t *prof = gc->allocprof;
+    int site = allocSite(prof, gc->vm, object);
+
+    if (prof->liveUsed + 1 > prof->liveCapacity / 2) liveGrow(prof);
+
+    alive_t *entry = liveFind(prof->live, prof->liveCapacity, object, true);
+    if (entry->site == 0) prof->liveUsed++;
+    entry->object = object;
+    entry->site = site + 1;
+    entry->size = size;
+    prof->liveCount++;
+
+    prof->sites[site].allocs++;
+    prof->sites[site].bytes += size;
+}
+
+void allocprof_grow(gc_t *gc, obj_t *object, size_t size)
+{
+    allocprof_t *prof = gc->allocprof;
+    if (prof->liveCapacity == 0) return;
+
+    alive_t *entry = liveFind(prof->live, prof->liveCapacity, object, false);
+    if (entry->object == NULL) return;
+
+    entry->size += size;
+    prof->sites[entry->site - 1].bytes += size;
+}
+
+// Objects made before tracking started are not found and not counted.
+void allocprof_free(gc_t *gc, obj_t *object)
+{
+    allocprof_t *prof = gc->allocprof;
+    if (prof->liveCapacity == 0) return;
+
+    alive_t *entry = liveFind(prof->live, prof->liveCapacity, object, false);
+    if (entry->object == NULL) return;
+
+    alsite_t *site = &prof->sites[entry->site - 1];
+    site->frees++;
+    site->freed += entry->size;
+
+    entry->object = NULL;
+    prof->liveCount--;
+}
+
+// An object copied out of a region stays charged to the site that made
+// it, under its new address.
+void allocprof_move(gc_t *gc, obj_t *from, obj_t *to)
+{
+    allocprof_t *prof = gc->allocprof;
+    if (prof->liveCapacity == 0) return;
+
+    alive_t *entry = liveFind(prof->live, prof->liveCapacity, from, false);
+    if (entry->object == NULL) return;
+
+    int site = entry->site;
+    size_t size = entry->size;
+    entry->object = NULL;
+
+    entry = liveFind(prof->live, prof->liveCapacity, to, true);
+    if (entry->site == 0) prof->liveUsed++;
+    entry->object = to;
+    entry->site = site;
+    entry->size = size;
+    if (prof->liveUsed + 1 > prof->liveCapacity / 2) liveGrow(prof);
+}
+
+bool vm_allocs_start(vm_t *vm)
+{
+    if (vm->gc->allocprof != NULL) return false;
+
+    allocprof_t *prof = calloc(1, sizeof(allocprof_t));
+    if (prof == NULL) return false;
+
+    prof->started = wall_clock();
+    vm->gc->allocprof = prof;
+    return true;
+}
+
+static int compareAllocSites(const void *a, const void *b)
+{
+    const alsite_t *x = a, *y = b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+// Sites by bytes allocated, with the rate since tracking started and
+// what is still live.
+bool vm_allocs_report(vm_t *vm, const char *path)
+{
+    allocprof_t *prof = vm->gc->allocprof;
+    if (prof == NULL) return false;
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write allocation report \"%s\".\n", path);
+        return false;
+    }
+
+    double seconds = wall_clock() - prof->started;
+    if (seconds <= 0) seconds = 1e-9;
+
+    alsite_t *sites = malloc((prof->siteCount + 1) * sizeof(alsite_t));
+    memcpy(sites, prof->sites, prof->siteCount * sizeof(alsite_t));
+    qsort(sites, prof->siteCount, sizeof(alsite_t), compareAllocSites);
+
+    fprintf(file, "# %.3f s, %d live objects\n", seconds, prof->liveCount);
+    fprintf(file, "# %12s %12s %12s %10s %12s  %-4s %s\n",
+        "allocs", "bytes", "bytes/s", "live", "live bytes", "type", "site");
+
+    for (int i = 0; i < prof->siteCount; i++) {
+        alsite_t *site = &sites[i];
+        fprintf(file, "%14llu %12llu %12.0f %10llu %12llu  %-4s %s\n",
+            (unsigned long long)site->allocs, (unsigned long long)site->bytes,
+            site->bytes / seconds, (unsigned long long)(site->allocs - site->frees),
+            (unsigned long long)(site->bytes - site->freed), gc_typename(site->type), site->where);
+    }
+
+    free(sites);
+    return fclose(file) == 0;
+}
+
+bool vm_allocs_stop(vm_t *vm, const char *path)
+{
+    allocprof_t *prof = vm->gc->allocprof;
+    if (prof == NULL) return false;
+
+    bool written = path == NULL || vm_allocs_report(vm, path);
+    vm->gc->allocprof = NULL;
+
+    for (int i = 0; i < prof->siteCount; i++) free(prof->sites[i].where);
+    free(prof->sites);
+    free(prof->index);
+    free(prof->live);
+    free(prof);
+    return written;
+}
+
+#ifdef AU3_PROFILE_OPCODES
+
+#define DUMP_TOP    40
+
+typedef struct {
+    uint64_t count;
+    int first;
+    int second;
+} pair_t;
+
+opprof_t *opprof_new(void)
+{
+    opprof_t *profile = calloc(1, sizeof(opprof_t));
+    if (profile == NULL) return NULL;
+
+    profile->previous = -1;
+    return profile;
+}
+
+void opprof_free(opprof_t *profile)
+{
+    if (profile == NULL) return;
+
+    for (int i = 0; i < profile->siteCapacity; i++) free(profile->sites[i].where);
+    free(profile->sites);
+    free(profile);
+}
+
+static inline uint32_t siteHash(const uint8_t *ip)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ip * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h >> 32);
+}
+
+static site_t *siteFind(site_t *sites, int capacity, const uint8_t *ip)
+{
+    uint32_t index = siteHash(ip) & (capacity - 1);
+
+    for (;;) {
+        site_t *site = &sites[index];
+        if (site->ip == ip || site->ip == NULL) return site;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void sitesGrow(opprof_t *profile)
+{
+    int capacity = profile->siteCapacity < 1024 ? 1024 : profile->siteCapacity * 2;
+    site_t *sites = calloc(capacity, sizeof(site_t));
+
+    for (int i = 0; i < profile->siteCapacity; i++) {
+        site_t *site = &profile->sites[i];
+        if (site->ip != NULL) *siteFind(sites, capacity, site->ip) = *site;
+    }
+
+    free(profile->sites);
+    profile->sites = sites;
+    profile->siteCapacity = capacity;
+}
+
+// Sites are keyed by address. The function and its source may be gone
+// by the time of the dump, so the place is written down on first use.
+void opprof_site(opprof_t *profile, fun_t *function, const uint8_t *ip)
+{
+    if (profile->siteCount + 1 > profile->siteCapacity / 2) sitesGrow(profile);
+
+    site_t *site = siteFind(profile->sites, profile->siteCapacity, ip);
+    if (site->ip == NULL) {
+        chunk_t *chunk = &function->chunk;
+        const char *name = function->name != NULL ? function->name->chars : "<script>";
+        const char *fname = chunk->source != NULL ? chunk->source->fname : "?";
+        char where[256];
+
+        snprintf(where, sizeof(where), "%s %s:%d", name, fname, chunk->lines[ip - chunk->code]);
+        site->ip = ip;
+        site->op = *ip;
+        site->where = strdup(where);
+        profile->siteCount++;
+    }
+
+    site->count++;
+}
+
+static int compareOps(const void *a, const void *b)
+{
+    const pair_t *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+static int compareSites(const void *a, const void *b)
+{
+    const site_t *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+void opprof_dump(opprof_t *profile)
+{
+    if (profile == NULL) return;
+
+    uint64_t total = 0;
+    pair_t ops[MAX_OPCODES];
+    for (int i = 0; i < MAX_OPCODES; i++) {
+        ops[i] = (pair_t){ profile->ops[i], i, -1 };
+        total += profile->ops[i];
+    }
+    if (total == 0) return;
+
+    qsort(ops, MAX_OPCODES, sizeof(pair_t), compareOps);
+    fprintf(stderr, "== opcodes, %llu executed\n", (unsigned long long)total);
+    for (int i = 0; i < MAX_OPCODES && ops[i].count > 0; i++) {
+        fprintf(stderr, "%14llu %6.2f%%  %s\n", (unsigned long long)ops[i].count,
+            100.0 * ops[i].count / total, opcode_tostr(ops[i].first));
+    }
+
+    pair_t *pairs = malloc(MAX_OPCODES * MAX_OPCODES * sizeof(pair_t));
+    int pairCount = 0;
+    for (int i = 0; i < MAX_OPCODES; i++) {
+        for (int j = 0; j < MAX_OPCODES; j++) {
+            if (profile->pairs[i][j] > 0) pairs[pairCount++] = (pair_t){ profile->pairs[i][j], i, j };
+        }
+    }
+
+    qsort(pairs, pairCount, sizeof(pair_t), compareOps);
+    fprintf(stderr, "== opcode pairs, top %d of %d\n", pairCount < DUMP_TOP ? pairCount : DUMP_TOP, pairCount);
+    for (int i = 0; i < pairCount && i < DUMP_TOP; i++) {
+        fprintf(stderr, "%14llu %6.2f%%  %s %s\n", (unsigned long long)pairs[i].count,
+            100.0 * pairs[i].count / total, opcode_tostr(pairs[i].first),
+            opcode_tostr(pairs[i].second));
+    }
+    free(pairs);
+
+    site_t *sites = malloc((profile->siteCount + 1) * sizeof(site_t));
+    int siteCount = 0;
+    for (int i = 0; i < profile->siteCapacity; i++) {
+        if (profile->sites[i].ip != NULL) sites[siteCount++] = profile->sites[i];
+    }
+
+    qsort(sites, siteCount, sizeof(site_t), compareSites);
+    fprintf(stderr, "== sites, top %d of %d\n", siteCount < DUMP_TOP ? siteCount : DUMP_TOP, siteCount);
+    for (int i = 0; i < siteCount && i < DUMP_TOP; i++) {
+        fprintf(stderr, "%14llu %6.2f%%  %-10s %s\n", (unsigned long long)sites[i].count,
+            100.0 * sites[i].count / total, opcode_tostr(sites[i].op), sites[i].where);
+    }
+    free(sites);
+}
+
+#endif
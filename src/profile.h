@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.h"
+#include "code.h"
+
+// Sampling profiler: a timer raises vm->sample and the next safepoint
+// records the frames of the script as a collapsed stack, outermost
+// first, each frame as name:line. Counts are written in the folded
+// format flamegraph tools read.
+typedef struct {
+    char *stack;
+    uint32_t hash;
+    uint64_t count;
+} sample_t;
+
+typedef struct {
+    int hz;
+    uint64_t total;
+    int count;
+    int capacity;
+    sample_t *samples;
+} sampler_t;
+
+void sampler_record(vm_t *vm);
+
+// Allocation tracking: every object made while it runs is charged to
+// the source line of the executing frame. Sites keep counts and bytes
+// per object type, live objects point back to their site so frees can
+// be taken off.
+typedef struct {
+    const uint8_t *ip;
+    int type;
+    char *where;    // function name, file, line and column
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes;
+    uint64_t freed;
+} alsite_t;
+
+typedef struct {
+    const obj_t *object;
+    int site;
+    size_t size;
+} alive_t;
+
+typedef struct {
+    double started;
+    int siteCount;
+    int siteCapacity;
+    alsite_t *sites;
+    int indexCapacity;
+    int *index;         // sites by ip and type, one up, 0 is free
+    int liveCount;
+    int liveUsed;       // live entries and tombstones
+    int liveCapacity;
+    alive_t *live;
+} allocprof_t;
+
+void allocprof_alloc(gc_t *gc, obj_t *object, size_t size);
+void allocprof_grow(gc_t *gc, obj_t *object, size_t size);
+void allocprof_free(gc_t *gc, obj_t *object);
+void allocprof_move(gc_t *gc, obj_t *from, obj_t *to);
+
+#ifdef AU3_PROFILE_OPCODES
+// Opcode counters for vm_execute(), built with -DAU3_PROFILE_OPCODES
+// only. Every dispatch counts the opcode, the pair it forms with the
+// one before it and its site, the instruction's address in a chunk.
+typedef struct {
+    const uint8_t *ip;
+    int op;
+    uint64_t count;
+    char *where;    // function name, file and line, taken when first seen
+} site_t;
+
+typedef struct {
+    uint64_t ops[MAX_OPCODES];
+    uint64_t pairs[MAX_OPCODES][MAX_OPCODES];
+    int previous;
+
+    int siteCount;
+    int siteCapacity;
+    site_t *sites;
+} opprof_t;
+
+opprof_t *opprof_new(void);
+void opprof_free(opprof_t *profile);
+void opprof_site(opprof_t *profile, fun_t *function, const uint8_t *ip);
+
+// Sorted counts, opcodes by name, to stderr.
+void opprof_dump(opprof_t *profile);
+
+static inline void opprof_count(opprof_t *profile, fun_t *function, const uint8_t *ip)
+{
+    int op = *ip;
+
+    profile->ops[op]++;
+    if (profile->previous >= 0) profile->pairs[profile->previous][op]++;
+    profile->previous = op;
+
+    opprof_site(profile, function, ip);
+}
+#endif
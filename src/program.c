@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "code.h"
+#include "object.h"
+#include "vm.h"
+#include "gc.h"
+
+#ifdef _MSC_VER
+#include <windows.h>
+#define REF_INC(p)      InterlockedIncrement(p)
+#define REF_DEC(p)      InterlockedDecrement(p)
+#else
+#define REF_INC(p)      __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define REF_DEC(p)      __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#endif
+
+static void *copyOf(const void *data, size_t size)
+{
+    void *copy = malloc(size > 0 ? size : 1);
+    memcpy(copy, data, size);
+    return copy;
+}
+
+static int countFunctions(fun_t *function)
+{
+    int count = 1;
+    arr_t *constants = &function->chunk.constants;
+
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUN(constants->values[i])) count += countFunctions(AS_FUN(constants->values[i]));
+    }
+    return count;
+}
+
+// Copies (function) and the functions nested in it out of the heap of
+// the VM that compiled them, in depth first order.
+static int freezeFunction(program_t *program, fun_t *function, int *next)
+{
+    int index = (*next)++;
+    proto_t *proto = &program->protos[index];
+    chunk_t *chunk = &function->chunk;
+
+    proto->arity = function->arity;
+    proto->upvalueCount = function->upvalueCount;
+    proto->name = function->name != NULL ? copyOf(function->name->chars, function->name->length) : NULL;
+    proto->nameLength = function->name != NULL ? function->name->length : 0;
+    proto->count = chunk->count;
+    proto->code = copyOf(chunk->code, chunk->count * sizeof(uint8_t));
+    proto->lines = copyOf(chunk->lines, chunk->count * sizeof(uint16_t));
+    proto->columns = copyOf(chunk->columns, chunk->count * sizeof(uint16_t));
+    proto->constantCount = chunk->constants.count;
+    proto->constants = malloc((chunk->constants.count + 1) * sizeof(pconst_t));
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        val_t value = chunk->constants.values[i];
+        pconst_t *constant = &proto->constants[i];
+
+        if (IS_STR(value)) {
+            str_t *string = AS_STR(value);
+            constant->type = PK_STRING;
+            constant->length = string->length;
+            constant->chars = copyOf(str_flatten(string), string->length);
+        }
+        else if (IS_FUN(value)) {
+            constant->type = PK_FUNCTION;
+            constant->index = freezeFunction(program, AS_FUN(value), next);
+        }
+        else {
+            constant->type = PK_VALUE;
+            constant->value = value;
+        }
+    }
+
+    return index;
+}
+
+// Compiles (fname) in a scratch VM and keeps the result apart from it.
+// Errors are reported as vm_dofile() reports them and give NULL.
+program_t *program_compile(const char *fname)
+{
+    src_t *source = src_new(fname);
+    if (source == NULL) return NULL;
+
+    vm_t *vm = vm_create();
+    if (vm == NULL) {
+        src_free(source);
+        return NULL;
+    }
+
+    fun_t *function = compile(vm, source);
+    src_release(source);
+
+    program_t *program = NULL;
+    if (function != NULL) {
+        program = malloc(sizeof(program_t));
+        program->refs = 1;
+        program->source = source;
+        program->protoCount = countFunctions(function);
+        program->protos = malloc(program->protoCount * sizeof(proto_t));
+
+        int next = 0;
+        freezeFunction(program, function, &next);
+    }
+    else {
+        src_free(source);
+    }
+
+    vm_close(vm);
+    return program;
+}
+
+program_t *program_retain(program_t *program)
+{
+    REF_INC(&program->refs);
+    return program;
+}
+
+void program_release(program_t *program)
+{
+    if (REF_DEC(&program->refs) != 0) return;
+
+    for (int i = 0; i < program->protoCount; i++) {
+        proto_t *proto = &program->protos[i];
+        for (int k = 0; k < proto->constantCount; k++) {
+            if (proto->constants[k].type == PK_STRING) free(proto->constants[k].chars);
+        }
+        free(proto->constants);
+        free(proto->name);
+        free(proto->code);
+        free(proto->lines);
+        free(proto->columns);
+    }
+
+    free(program->protos);
+    src_free(program->source);
+    free(program);
+}
+
+// Makes the functions of (program) in (vm). They borrow the code and
+// line tables, the constants are built again here since strings are
+// interned per VM. The script function is returned unrooted.
+fun_t *program_load(vm_t *vm, program_t *program)
+{
+    gc_t *gc = vm->gc;
+    fun_t **functions = malloc(program->protoCount * sizeof(fun_t *));
+
+    gc->paused++;
+
+    for (int i = 0; i < program->protoCount; i++) {
+        proto_t *proto = &program->protos[i];
+        fun_t *function = fun_new(vm, program->source);
+        chunk_t *chunk = &function->chunk;
+
+        function->arity = proto->arity;
+        function->upvalueCount = proto->upvalueCount;
+        if (proto->name != NULL) function->name = str_copy(vm, proto->name, proto->nameLength, false);
+        function->program = program_retain(program);
+
+        chunk->count = proto->count;
+        chunk->capacity = proto->count;
+        chunk->code = proto->code;
+        chunk->lines = proto->lines;
+        chunk->columns = proto->columns;
+        functions[i] = function;
+    }
+
+    for (int i = 0; i < program->protoCount; i++) {
+        proto_t *proto = &program->protos[i];
+        arr_t *constants = &functions[i]->chunk.constants;
+
+        constants->values = gc_resize(gc, GC_CODE, NULL, 0, proto->constantCount * sizeof(val_t));
+        constants->capacity = proto->constantCount;
+
+        for (int k = 0; k < proto->constantCount; k++) {
+            pconst_t *constant = &proto->constants[k];
+            val_t value;
+
+            if (constant->type == PK_STRING) {
+                value = VAL_OBJ(str_copy(vm, constant->chars, constant->length, false));
+            }
+            else if (constant->type == PK_FUNCTION) {
+                value = VAL_OBJ(functions[constant->index]);
+            }
+            else {
+                value = constant->value;
+            }
+            constants->values[constants->count++] = value;
+        }
+    }
+
+    gc->paused--;
+
+    fun_t *script = functions[0];
+    free(functions);
+    return script;
+}
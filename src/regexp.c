@@ -0,0 +1,1162 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "regexp.h"
+#include "strscan.h"
+
+// Patterns compile to a Thompson NFA. Searches run a lazily built DFA
+// forwards to find where the leftmost match ends, then a DFA over the
+// reversed program backwards from there to find where it starts. Only
+// when groups are wanted does a Pike VM run, anchored at that start.
+// The Pike VM is also the fallback for \b and for DFAs that outgrow
+// their state budget.
+#define RX_CODE_MAX     8192
+#define RX_REPEAT_MAX   1000
+#define RX_PREFIX_MAX   32
+#define DFA_STATES_MAX  1024
+
+typedef enum {
+    RX_SET,
+    RX_SPLIT,
+    RX_JMP,
+    RX_SAVE,
+    RX_BOL,
+    RX_EOL,
+    RX_WORDB,
+    RX_NWORDB,
+    RX_MATCH,
+} rxop_t;
+
+typedef struct {
+    uint8_t op;
+    int x, y;
+} inst_t;
+
+typedef struct {
+    uint32_t bits[8];
+} set_t;
+
+typedef enum {
+    N_EMPTY,
+    N_SET,
+    N_CAT,
+    N_ALT,
+    N_REPEAT,
+    N_GROUP,
+    N_BOL,
+    N_EOL,
+    N_WORDB,
+    N_NWORDB,
+} ntype_t;
+
+typedef struct {
+    uint8_t type;
+    bool greedy;
+    int min, max;
+    int a, b;
+    int literal;
+} node_t;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    const char *error;
+    bool ignorecase;
+    bool dotall;
+    int groups;
+
+    node_t *nodes;
+    int nodeCount, nodeCapacity;
+    set_t *sets;
+    int setCount, setCapacity;
+} parser_t;
+
+typedef struct {
+    int start, count;
+    uint32_t hash;
+    bool isMatch;
+} dstate_t;
+
+typedef struct {
+    inst_t *code;
+    int length;
+    int entry;
+    bool longest;
+
+    dstate_t *states;
+    int count, capacity;
+    int *pool;
+    int poolCount, poolCapacity;
+    int *trans;
+    int slots[DFA_STATES_MAX * 2];
+    int start[2];
+
+    int *list;
+    int listCount;
+    int *stack;
+    uint32_t *seen;
+    uint32_t gen;
+} dfa_t;
+
+typedef struct {
+    int *pcs;
+    int *caps;
+    int count;
+} tlist_t;
+
+typedef struct {
+    int pc, slot, value;
+} frame_t;
+
+struct _rx {
+    inst_t *code;
+    int length;
+    int groups;
+    int ncap;
+
+    set_t *sets;
+    int setCount;
+    uint8_t classes[256];
+    uint8_t reps[256];
+    int classCount;
+
+    char prefix[RX_PREFIX_MAX];
+    int prefixLength;
+    bool anchored;
+    bool useDfa;
+
+    dfa_t forward;
+    dfa_t reverse;
+
+    tlist_t lists[2];
+    uint32_t *seen;
+    uint32_t gen;
+    frame_t *stack;
+    int *work;
+    int *result;
+    int *blank;
+};
+
+static inline void setAdd(set_t *set, int c) { set->bits[c >> 5] |= 1u << (c & 31); }
+static inline bool setHas(const set_t *set, int c) { return (set->bits[c >> 5] >> (c & 31)) & 1; }
+
+static void setRange(set_t *set, int lo, int hi)
+{
+    for (int c = lo; c <= hi; c++) setAdd(set, c);
+}
+
+static void setNegate(set_t *set)
+{
+    for (int i = 0; i < 8; i++) set->bits[i] = ~set->bits[i];
+}
+
+static void setMerge(set_t *set, const set_t *other)
+{
+    for (int i = 0; i < 8; i++) set->bits[i] |= other->bits[i];
+}
+
+// Folds ASCII letters only, the same as the ignorecase of hash_string().
+static void setFold(set_t *set)
+{
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (setHas(set, c) || setHas(set, c - 0x20)) {
+            setAdd(set, c);
+            setAdd(set, c - 0x20);
+        }
+    }
+}
+
+static inline bool isWord(int c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+/* Parser */
+
+static int newNode(parser_t *parser, ntype_t type, int a, int b)
+{
+    if (parser->nodeCapacity < parser->nodeCount + 1) {
+        parser->nodeCapacity = GROW_CAP(parser->nodeCapacity);
+        parser->nodes = realloc(parser->nodes, parser->nodeCapacity * sizeof(node_t));
+    }
+
+    node_t *node = &parser->nodes[parser->nodeCount];
+    node->type = type;
+    node->greedy = true;
+    node->min = node->max = 0;
+    node->a = a;
+    node->b = b;
+    node->literal = -1;
+    return parser->nodeCount++;
+}
+
+static int newSet(parser_t *parser, const set_t *set, int literal)
+{
+    if (parser->setCapacity < parser->setCount + 1) {
+        parser->setCapacity = GROW_CAP(parser->setCapacity);
+        parser->sets = realloc(parser->sets, parser->setCapacity * sizeof(set_t));
+    }
+
+    set_t folded = *set;
+    if (parser->ignorecase) {
+        setFold(&folded);
+        if ((literal | 0x20) >= 'a' && (literal | 0x20) <= 'z') literal = -1;
+    }
+
+    parser->sets[parser->setCount] = folded;
+    int node = newNode(parser, N_SET, parser->setCount++, 0);
+    parser->nodes[node].literal = literal;
+    return node;
+}
+
+static int fail(parser_t *parser, const char *message)
+{
+    if (parser->error == NULL) parser->error = message;
+    return -1;
+}
+
+// \d \w \s and their negations, false for anything else.
+static bool classEscape(char c, set_t *set)
+{
+    memset(set, 0, sizeof(set_t));
+
+    switch (c | 0x20) {
+        case 'd': setRange(set, '0', '9'); break;
+        case 'w':
+            setRange(set, '0', '9');
+            setRange(set, 'a', 'z');
+            setRange(set, 'A', 'Z');
+            setAdd(set, '_');
+            break;
+        case 's':
+            setRange(set, '\t', '\r');
+            setAdd(set, ' ');
+            break;
+        default:
+            return false;
+    }
+
+    if (c >= 'A' && c <= 'Z') setNegate(set);
+    return true;
+}
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') return (c | 0x20) - 'a' + 10;
+    return -1;
+}
+
+// A single escaped byte, -1 when the escape is not one.
+static int byteEscape(parser_t *parser)
+{
+    char c = *parser->p++;
+
+    switch (c) {
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case 'e': return 0x1B;
+        case '0': return 0;
+        case 'x': {
+            int hi, lo;
+            if (parser->end - parser->p < 2 ||
+                (hi = hexDigit(parser->p[0])) < 0 ||
+                (lo = hexDigit(parser->p[1])) < 0) {
+                return fail(parser, "bad \\x escape");
+            }
+            parser->p += 2;
+            return hi << 4 | lo;
+        }
+    }
+
+    if (isWord((unsigned char)c)) return fail(parser, "unknown escape");
+    return (unsigned char)c;
+}
+
+static int parseClass(parser_t *parser)
+{
+    set_t set = { 0 };
+    bool negate = false;
+
+    if (parser->p < parser->end && *parser->p == '^') {
+        negate = true;
+        parser->p++;
+    }
+
+    bool first = true;
+    while (parser->p < parser->end && (*parser->p != ']' || first)) {
+        first = false;
+        int lo = (unsigned char)*parser->p++;
+
+        if (lo == '\\') {
+            if (parser->p == parser->end) break;
+            set_t escaped;
+            if (classEscape(*parser->p, &escaped)) {
+                parser->p++;
+                setMerge(&set, &escaped);
+                continue;
+            }
+            if ((lo = byteEscape(parser)) < 0) return -1;
+        }
+
+        int hi = lo;
+        if (parser->end - parser->p >= 2 && parser->p[0] == '-' && parser->p[1] != ']') {
+            parser->p++;
+            hi = (unsigned char)*parser->p++;
+            if (hi == '\\') {
+                if (parser->p == parser->end) break;
+                if ((hi = byteEscape(parser)) < 0) return -1;
+            }
+            if (hi < lo) return fail(parser, "bad class range");
+        }
+
+        setRange(&set, lo, hi);
+    }
+
+    if (parser->p == parser->end) return fail(parser, "missing ]");
+    parser->p++;
+
+    if (negate) {
+        if (parser->ignorecase) setFold(&set);
+        setNegate(&set);
+    }
+    return newSet(parser, &set, -1);
+}
+
+static int parseAlt(parser_t *parser);
+
+static int parseGroup(parser_t *parser)
+{
+    bool saveCase = parser->ignorecase;
+    bool saveDot = parser->dotall;
+    int group = -1;
+
+    if (parser->end - parser->p >= 1 && *parser->p == '?') {
+        parser->p++;
+        bool *flag = NULL;
+        for (; parser->p < parser->end; parser->p++) {
+            char c = *parser->p;
+            if (c == 'i') flag = &parser->ignorecase;
+            else if (c == 's') flag = &parser->dotall;
+            else break;
+            *flag = true;
+        }
+
+        if (parser->p == parser->end) return fail(parser, "missing )");
+
+        // (?i) holds until the enclosing group closes.
+        if (*parser->p == ')' && flag != NULL) {
+            parser->p++;
+            return newNode(parser, N_EMPTY, 0, 0);
+        }
+        if (*parser->p != ':') return fail(parser, "unsupported group");
+        parser->p++;
+    }
+    else {
+        if (parser->groups == RX_GROUPS_MAX) return fail(parser, "too many groups");
+        group = ++parser->groups;
+    }
+
+    int node = parseAlt(parser);
+    if (node < 0) return -1;
+    if (parser->p == parser->end || *parser->p != ')') return fail(parser, "missing )");
+    parser->p++;
+
+    parser->ignorecase = saveCase;
+    parser->dotall = saveDot;
+    return group < 0 ? node : newNode(parser, N_GROUP, node, group);
+}
+
+static int parseAtom(parser_t *parser)
+{
+    char c = *parser->p++;
+    set_t set = { 0 };
+
+    switch (c) {
+        case '(': return parseGroup(parser);
+        case '[': return parseClass(parser);
+        case '^': return newNode(parser, N_BOL, 0, 0);
+        case '$': return newNode(parser, N_EOL, 0, 0);
+        case '*':
+        case '+':
+        case '?':
+            return fail(parser, "nothing to repeat");
+        case '.':
+            setRange(&set, 0, 255);
+            if (!parser->dotall) set.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+            return newSet(parser, &set, -1);
+        case '\\': {
+            if (parser->p == parser->end) return fail(parser, "trailing \\");
+            char e = *parser->p;
+            if (e == 'b' || e == 'B') {
+                parser->p++;
+                return newNode(parser, e == 'b' ? N_WORDB : N_NWORDB, 0, 0);
+            }
+            if (e == 'A' || e == 'z') {
+                parser->p++;
+                return newNode(parser, e == 'A' ? N_BOL : N_EOL, 0, 0);
+            }
+            if (classEscape(e, &set)) {
+                parser->p++;
+                return newSet(parser, &set, -1);
+            }
+            int b = byteEscape(parser);
+            if (b < 0) return -1;
+            setAdd(&set, b);
+            return newSet(parser, &set, b);
+        }
+    }
+
+    setAdd(&set, (unsigned char)c);
+    return newSet(parser, &set, (unsigned char)c);
+}
+
+static int parseNumber(parser_t *parser)
+{
+    int value = -1;
+    while (parser->p < parser->end && *parser->p >= '0' && *parser->p <= '9') {
+        value = (value < 0 ? 0 : value * 10) + (*parser->p++ - '0');
+        if (value > RX_REPEAT_MAX) value = RX_REPEAT_MAX + 1;
+    }
+    return value;
+}
+
+// {n}, {n,} or {n,m}. Anything else leaves '{' to be a literal.
+static bool parseBraces(parser_t *parser, int *min, int *max)
+{
+    const char *start = parser->p;
+    parser->p++;
+
+    *min = parseNumber(parser);
+    *max = *min;
+    if (*min >= 0 && parser->p < parser->end && *parser->p == ',') {
+        parser->p++;
+        *max = parseNumber(parser);
+    }
+
+    if (*min < 0 || parser->p == parser->end || *parser->p != '}') {
+        parser->p = start;
+        return false;
+    }
+
+    parser->p++;
+    return true;
+}
+
+static int parseRepeat(parser_t *parser)
+{
+    int node = parseAtom(parser);
+
+    while (node >= 0 && parser->p < parser->end) {
+        int min, max;
+        char c = *parser->p;
+
+        if (c == '*') { min = 0; max = -1; parser->p++; }
+        else if (c == '+') { min = 1; max = -1; parser->p++; }
+        else if (c == '?') { min = 0; max = 1; parser->p++; }
+        else if (c != '{' || !parseBraces(parser, &min, &max)) break;
+
+        if (min > RX_REPEAT_MAX || max > RX_REPEAT_MAX) {
+            return fail(parser, "repeat count too large");
+        }
+        if (max >= 0 && max < min) return fail(parser, "bad repeat range");
+
+        bool greedy = true;
+        if (parser->p < parser->end && *parser->p == '?') {
+            greedy = false;
+            parser->p++;
+        }
+        else if (parser->p < parser->end && *parser->p == '+') {
+            parser->p++;
+        }
+
+        int repeat = newNode(parser, N_REPEAT, node, 0);
+        parser->nodes[repeat].min = min;
+        parser->nodes[repeat].max = max;
+        parser->nodes[repeat].greedy = greedy;
+        node = repeat;
+    }
+
+    return node;
+}
+
+static int parseCat(parser_t *parser)
+{
+    int node = newNode(parser, N_EMPTY, 0, 0);
+
+    while (parser->p < parser->end && *parser->p != '|' && *parser->p != ')') {
+        int atom = parseRepeat(parser);
+        if (atom < 0) return -1;
+        node = parser->nodes[node].type == N_EMPTY ? atom : newNode(parser, N_CAT, node, atom);
+    }
+
+    return node;
+}
+
+static int parseAlt(parser_t *parser)
+{
+    int node = parseCat(parser);
+
+    while (node >= 0 && parser->p < parser->end && *parser->p == '|') {
+        parser->p++;
+        int right = parseCat(parser);
+        if (right < 0) return -1;
+        node = newNode(parser, N_ALT, node, right);
+    }
+
+    return node;
+}
+
+/* Compiler */
+
+typedef struct {
+    parser_t *parser;
+    inst_t *code;
+    int length, capacity;
+    bool reverse;
+} compiler_t;
+
+static int emit(compiler_t *compiler, rxop_t op, int x, int y)
+{
+    if (compiler->length >= RX_CODE_MAX) return -1;
+
+    if (compiler->capacity < compiler->length + 1) {
+        compiler->capacity = GROW_CAP(compiler->capacity);
+        compiler->code = realloc(compiler->code, compiler->capacity * sizeof(inst_t));
+    }
+
+    compiler->code[compiler->length] = (inst_t){ op, x, y };
+    return compiler->length++;
+}
+
+static bool compileNode(compiler_t *compiler, int index)
+{
+    node_t node = compiler->parser->nodes[index];
+
+    switch (node.type) {
+        case N_EMPTY:
+            return true;
+        case N_SET:
+            return emit(compiler, RX_SET, node.a, 0) >= 0;
+        case N_CAT:
+            if (compiler->reverse) {
+                return compileNode(compiler, node.b) && compileNode(compiler, node.a);
+            }
+            return compileNode(compiler, node.a) && compileNode(compiler, node.b);
+        case N_ALT: {
+            int split = emit(compiler, RX_SPLIT, 0, 0);
+            if (split < 0 || !compileNode(compiler, node.a)) return false;
+            int jump = emit(compiler, RX_JMP, 0, 0);
+            if (jump < 0) return false;
+            compiler->code[split].x = split + 1;
+            compiler->code[split].y = compiler->length;
+            if (!compileNode(compiler, node.b)) return false;
+            compiler->code[jump].x = compiler->length;
+            return true;
+        }
+        case N_GROUP:
+            // The reversed program only locates match starts.
+            if (compiler->reverse) return compileNode(compiler, node.a);
+            return emit(compiler, RX_SAVE, node.b * 2, 0) >= 0 &&
+                compileNode(compiler, node.a) &&
+                emit(compiler, RX_SAVE, node.b * 2 + 1, 0) >= 0;
+        case N_REPEAT: {
+            for (int i = 0; i < node.min; i++) {
+                if (!compileNode(compiler, node.a)) return false;
+            }
+
+            if (node.max < 0) {
+                int split = emit(compiler, RX_SPLIT, 0, 0);
+                if (split < 0 || !compileNode(compiler, node.a)) return false;
+                if (emit(compiler, RX_JMP, split, 0) < 0) return false;
+                compiler->code[split].x = node.greedy ? split + 1 : compiler->length;
+                compiler->code[split].y = node.greedy ? compiler->length : split + 1;
+                return true;
+            }
+
+            // x{n,m} nests m-n optional copies, each split skips to the end.
+            int first = compiler->length;
+            for (int i = node.min; i < node.max; i++) {
+                if (emit(compiler, RX_SPLIT, 0, 0) < 0) return false;
+                if (!compileNode(compiler, node.a)) return false;
+            }
+            for (int pc = first; pc < compiler->length; pc++) {
+                inst_t *inst = &compiler->code[pc];
+                if (inst->op != RX_SPLIT || inst->x != 0 || inst->y != 0) continue;
+                inst->x = node.greedy ? pc + 1 : compiler->length;
+                inst->y = node.greedy ? compiler->length : pc + 1;
+            }
+            return true;
+        }
+        case N_BOL:
+            return emit(compiler, compiler->reverse ? RX_EOL : RX_BOL, 0, 0) >= 0;
+        case N_EOL:
+            return emit(compiler, compiler->reverse ? RX_BOL : RX_EOL, 0, 0) >= 0;
+        case N_WORDB:
+            return emit(compiler, RX_WORDB, 0, 0) >= 0;
+        case N_NWORDB:
+            return emit(compiler, RX_NWORDB, 0, 0) >= 0;
+    }
+
+    return false;
+}
+
+// Literal bytes every match begins with, false once the run ends.
+static bool collectPrefix(parser_t *parser, int index, rx_t *rx)
+{
+    node_t *node = &parser->nodes[index];
+
+    switch (node->type) {
+        case N_SET:
+            if (node->literal < 0 || rx->prefixLength == RX_PREFIX_MAX) return false;
+            rx->prefix[rx->prefixLength++] = (char)node->literal;
+            return true;
+        case N_CAT:
+            return collectPrefix(parser, node->a, rx) && collectPrefix(parser, node->b, rx);
+        case N_GROUP:
+            return collectPrefix(parser, node->a, rx);
+        case N_REPEAT:
+            if (node->min > 0) collectPrefix(parser, node->a, rx);
+            return false;
+        case N_EMPTY:
+            return true;
+    }
+
+    return false;
+}
+
+static bool startsAnchored(parser_t *parser, int index)
+{
+    node_t *node = &parser->nodes[index];
+
+    switch (node->type) {
+        case N_BOL: return true;
+        case N_CAT:
+        case N_GROUP:
+            return startsAnchored(parser, node->a);
+    }
+
+    return false;
+}
+
+// Splits the byte range into classes no set tells apart, so the DFA
+// keeps one transition per class rather than per byte.
+static void buildClasses(rx_t *rx)
+{
+    bool boundary[256] = { false };
+
+    for (int i = 0; i < rx->setCount; i++) {
+        for (int c = 0; c < 255; c++) {
+            if (setHas(&rx->sets[i], c) != setHas(&rx->sets[i], c + 1)) boundary[c] = true;
+        }
+    }
+
+    int class = 0;
+    rx->reps[0] = 0;
+    for (int c = 0; c < 256; c++) {
+        rx->classes[c] = (uint8_t)class;
+        if (boundary[c] && c < 255) rx->reps[++class] = (uint8_t)(c + 1);
+    }
+    rx->classCount = class + 1;
+}
+
+/* Lazy DFA */
+
+static int dfaIntern(dfa_t *dfa, int classCount);
+
+static void dfaReset(dfa_t *dfa, int classCount)
+{
+    dfa->count = 0;
+    dfa->poolCount = 0;
+    dfa->start[0] = dfa->start[1] = -1;
+    for (int i = 0; i < DFA_STATES_MAX * 2; i++) dfa->slots[i] = -1;
+
+    // State 0 is the dead state.
+    dfa->listCount = 0;
+    dfaIntern(dfa, classCount);
+}
+
+static void dfaInit(dfa_t *dfa, inst_t *code, int length, int entry, bool longest,
+    int classCount)
+{
+    memset(dfa, 0, sizeof(dfa_t));
+    dfa->code = code;
+    dfa->length = length;
+    dfa->entry = entry;
+    dfa->longest = longest;
+    dfa->list = malloc(length * sizeof(int));
+    dfa->stack = malloc((length * 2 + 2) * sizeof(int));
+    dfa->seen = calloc(length, sizeof(uint32_t));
+    dfaReset(dfa, classCount);
+}
+
+static void dfaFree(dfa_t *dfa)
+{
+    free(dfa->states);
+    free(dfa->pool);
+    free(dfa->trans);
+    free(dfa->list);
+    free(dfa->stack);
+    free(dfa->seen);
+}
+
+static int dfaIntern(dfa_t *dfa, int classCount)
+{
+    uint32_t hash = 2166136261u;
+    bool isMatch = false;
+
+    for (int i = 0; i < dfa->listCount; i++) {
+        hash = (hash ^ (uint32_t)dfa->list[i]) * 16777619;
+        isMatch |= dfa->code[dfa->list[i]].op == RX_MATCH;
+    }
+
+    int mask = DFA_STATES_MAX * 2 - 1;
+    int slot = hash & mask;
+    for (; dfa->slots[slot] >= 0; slot = (slot + 1) & mask) {
+        dstate_t *state = &dfa->states[dfa->slots[slot]];
+        if (state->hash == hash && state->count == dfa->listCount &&
+            memcmp(dfa->pool + state->start, dfa->list, dfa->listCount * sizeof(int)) == 0) {
+            return dfa->slots[slot];
+        }
+    }
+
+    if (dfa->count == DFA_STATES_MAX) return -1;
+
+    if (dfa->capacity < dfa->count + 1) {
+        dfa->capacity = GROW_CAP(dfa->capacity);
+        dfa->states = realloc(dfa->states, dfa->capacity * sizeof(dstate_t));
+        dfa->trans = realloc(dfa->trans, dfa->capacity * classCount * sizeof(int));
+    }
+    if (dfa->poolCapacity < dfa->poolCount + dfa->listCount) {
+        while (dfa->poolCapacity < dfa->poolCount + dfa->listCount) {
+            dfa->poolCapacity = GROW_CAP(dfa->poolCapacity);
+        }
+        dfa->pool = realloc(dfa->pool, dfa->poolCapacity * sizeof(int));
+    }
+
+    if (dfa->listCount > 0) {
+        memcpy(dfa->pool + dfa->poolCount, dfa->list, dfa->listCount * sizeof(int));
+    }
+    dfa->states[dfa->count] = (dstate_t){ dfa->poolCount, dfa->listCount, hash, isMatch };
+    dfa->poolCount += dfa->listCount;
+
+    int *row = dfa->trans + dfa->count * classCount;
+    for (int i = 0; i < classCount; i++) row[i] = -1;
+
+    dfa->slots[slot] = dfa->count;
+    return dfa->count++;
+}
+
+// Appends the threads reachable from (pc) in priority order. Leftmost
+// first search drops every thread behind a match, true when it did.
+static bool dfaClosure(dfa_t *dfa, int pc, bool atBegin, bool atEnd)
+{
+    int top = 0;
+    dfa->stack[top++] = pc;
+
+    while (top > 0) {
+        pc = dfa->stack[--top];
+        if (dfa->seen[pc] == dfa->gen) continue;
+        dfa->seen[pc] = dfa->gen;
+
+        inst_t *inst = &dfa->code[pc];
+        switch (inst->op) {
+            case RX_JMP:
+                dfa->stack[top++] = inst->x;
+                break;
+            case RX_SPLIT:
+                dfa->stack[top++] = inst->y;
+                dfa->stack[top++] = inst->x;
+                break;
+            case RX_SAVE:
+                dfa->stack[top++] = pc + 1;
+                break;
+            case RX_BOL:
+                if (atBegin) dfa->stack[top++] = pc + 1;
+                break;
+            case RX_EOL:
+                if (atEnd) dfa->stack[top++] = pc + 1;
+                else dfa->list[dfa->listCount++] = pc;
+                break;
+            case RX_MATCH:
+                dfa->list[dfa->listCount++] = pc;
+                if (!dfa->longest) return true;
+                break;
+            default:
+                dfa->list[dfa->listCount++] = pc;
+                break;
+        }
+    }
+
+    return false;
+}
+
+static int dfaStart(dfa_t *dfa, bool atBegin, int classCount)
+{
+    if (dfa->start[atBegin] < 0) {
+        dfa->gen++;
+        dfa->listCount = 0;
+        dfaClosure(dfa, dfa->entry, atBegin, false);
+        dfa->start[atBegin] = dfaIntern(dfa, classCount);
+    }
+    return dfa->start[atBegin];
+}
+
+static int dfaStep(dfa_t *dfa, rx_t *rx, int index, int class)
+{
+    int next = dfa->trans[index * rx->classCount + class];
+    if (next >= 0) return next;
+
+    dstate_t state = dfa->states[index];
+    int c = rx->reps[class];
+
+    dfa->gen++;
+    dfa->listCount = 0;
+
+    for (int i = 0; i < state.count; i++) {
+        inst_t *inst = &dfa->code[dfa->pool[state.start + i]];
+        if (inst->op == RX_SET && setHas(&rx->sets[inst->x], c)) {
+            if (dfaClosure(dfa, dfa->pool[state.start + i] + 1, false, false)) break;
+        }
+    }
+
+    next = dfaIntern(dfa, rx->classCount);
+    if (next >= 0) dfa->trans[index * rx->classCount + class] = next;
+    return next;
+}
+
+// Whether (index) matches once the input runs out, $ holds there.
+static bool dfaFinal(dfa_t *dfa, int index, bool atBegin)
+{
+    dstate_t state = dfa->states[index];
+    if (state.isMatch) return true;
+
+    dfa->gen++;
+    dfa->listCount = 0;
+
+    for (int i = 0; i < state.count; i++) {
+        int pc = dfa->pool[state.start + i];
+        if (dfa->code[pc].op == RX_EOL) dfaClosure(dfa, pc + 1, atBegin, true);
+    }
+
+    for (int i = 0; i < dfa->listCount; i++) {
+        if (dfa->code[dfa->list[i]].op == RX_MATCH) return true;
+    }
+    return false;
+}
+
+// End of the leftmost match at or after (from): 1 when found, 0 when
+// there is none and -1 when the DFA ran out of states.
+static int dfaForward(rx_t *rx, const char *s, int n, int from, int *end)
+{
+    dfa_t *dfa = &rx->forward;
+    int state = dfaStart(dfa, from == 0, rx->classCount);
+    int restart = dfaStart(dfa, false, rx->classCount);
+    int last = -1;
+
+    if (state < 0 || restart < 0) return -1;
+
+    for (int i = from; ; i++) {
+        if (dfa->states[state].isMatch) last = i;
+        if (state == 0) break;
+
+        // Between matches skip straight to the next copy of the prefix.
+        if (state == restart && rx->prefixLength > 0 && i < n) {
+            const char *found = scan_find(s + i, n - i, rx->prefix, rx->prefixLength, false);
+            if (found == NULL) break;
+            i = (int)(found - s);
+        }
+
+        if (i == n) {
+            if (dfaFinal(dfa, state, i == 0)) last = n;
+            break;
+        }
+
+        state = dfaStep(dfa, rx, state, rx->classes[(uint8_t)s[i]]);
+        if (state < 0) return -1;
+    }
+
+    *end = last;
+    return last >= 0;
+}
+
+// Start of the leftmost match ending at (end), the reversed program
+// read backwards takes the longest run, which is the earliest start.
+static int dfaReverse(rx_t *rx, const char *s, int n, int from, int end, int *start)
+{
+    dfa_t *dfa = &rx->reverse;
+    int state = dfaStart(dfa, end == n, rx->classCount);
+    int last = -1;
+
+    if (state < 0) return -1;
+
+    for (int i = end; ; i--) {
+        if (dfa->states[state].isMatch) last = i;
+        if (state == 0) break;
+
+        if (i == from) {
+            if (from == 0 && dfaFinal(dfa, state, i == n)) last = 0;
+            break;
+        }
+
+        state = dfaStep(dfa, rx, state, rx->classes[(uint8_t)s[i - 1]]);
+        if (state < 0) return -1;
+    }
+
+    *start = last;
+    return last >= 0;
+}
+
+/* Pike VM */
+
+static void addThread(rx_t *rx, tlist_t *list, int pc, const int *caps,
+    const char *s, int n, int pos)
+{
+    frame_t *stack = rx->stack;
+    int *work = rx->work;
+    int top = 0;
+
+    memcpy(work, caps, rx->ncap * sizeof(int));
+    stack[top++] = (frame_t){ pc, -1, 0 };
+
+    while (top > 0) {
+        frame_t frame = stack[--top];
+        if (frame.slot >= 0) {
+            work[frame.slot] = frame.value;
+            continue;
+        }
+
+        pc = frame.pc;
+        if (rx->seen[pc] == rx->gen) continue;
+        rx->seen[pc] = rx->gen;
+
+        inst_t *inst = &rx->code[pc];
+        switch (inst->op) {
+            case RX_JMP:
+                stack[top++] = (frame_t){ inst->x, -1, 0 };
+                break;
+            case RX_SPLIT:
+                stack[top++] = (frame_t){ inst->y, -1, 0 };
+                stack[top++] = (frame_t){ inst->x, -1, 0 };
+                break;
+            case RX_SAVE:
+                stack[top++] = (frame_t){ 0, inst->x, work[inst->x] };
+                work[inst->x] = pos;
+                stack[top++] = (frame_t){ pc + 1, -1, 0 };
+                break;
+            case RX_BOL:
+                if (pos == 0) stack[top++] = (frame_t){ pc + 1, -1, 0 };
+                break;
+            case RX_EOL:
+                if (pos == n) stack[top++] = (frame_t){ pc + 1, -1, 0 };
+                break;
+            case RX_WORDB:
+            case RX_NWORDB: {
+                bool before = pos > 0 && isWord((uint8_t)s[pos - 1]);
+                bool after = pos < n && isWord((uint8_t)s[pos]);
+                if ((before != after) == (inst->op == RX_WORDB)) {
+                    stack[top++] = (frame_t){ pc + 1, -1, 0 };
+                }
+                break;
+            }
+            default:
+                list->pcs[list->count] = pc;
+                memcpy(list->caps + list->count * rx->ncap, work, rx->ncap * sizeof(int));
+                list->count++;
+                break;
+        }
+    }
+}
+
+// Runs threads from (pc) at (from) without consuming past (limit).
+static bool pike(rx_t *rx, const char *s, int n, int from, int limit, int pc, int *caps)
+{
+    tlist_t *clist = &rx->lists[0];
+    tlist_t *nlist = &rx->lists[1];
+    bool matched = false;
+
+    rx->gen++;
+    clist->count = 0;
+    addThread(rx, clist, pc, rx->blank, s, n, from);
+
+    for (int i = from; clist->count > 0; i++) {
+        rx->gen++;
+        nlist->count = 0;
+
+        for (int t = 0; t < clist->count; t++) {
+            inst_t *inst = &rx->code[clist->pcs[t]];
+            int *tcaps = clist->caps + t * rx->ncap;
+
+            if (inst->op == RX_MATCH) {
+                memcpy(caps, tcaps, rx->ncap * sizeof(int));
+                matched = true;
+                break;
+            }
+            if (i < limit && setHas(&rx->sets[inst->x], (uint8_t)s[i])) {
+                addThread(rx, nlist, clist->pcs[t] + 1, tcaps, s, n, i + 1);
+            }
+        }
+
+        tlist_t *swap = clist;
+        clist = nlist;
+        nlist = swap;
+    }
+
+    return matched;
+}
+
+/* Public interface */
+
+// The forward program opens with a lazy loop over any byte, so the
+// first match found is the leftmost one:
+//
+//   0: split 3, 1      2: jmp 0
+//   1: set <any>       3: save 0 ... save 1, match
+#define RX_ANCHORED_PC  3
+
+rx_t *rx_compile(const char *pattern, int length, const char **error)
+{
+    parser_t parser = { 0 };
+    parser.p = pattern;
+    parser.end = pattern + length;
+
+    set_t any;
+    memset(&any, 0xFF, sizeof(set_t));
+    int anyNode = newSet(&parser, &any, -1);
+
+    int root = parseAlt(&parser);
+    if (root >= 0 && parser.p != parser.end) root = fail(&parser, "unmatched )");
+
+    rx_t *rx = NULL;
+    compiler_t forward = { &parser, NULL, 0, 0, false };
+    compiler_t reverse = { &parser, NULL, 0, 0, true };
+
+    if (root >= 0) {
+        bool ok = emit(&forward, RX_SPLIT, RX_ANCHORED_PC, 1) >= 0 &&
+            emit(&forward, RX_SET, parser.nodes[anyNode].a, 0) >= 0 &&
+            emit(&forward, RX_JMP, 0, 0) >= 0 &&
+            emit(&forward, RX_SAVE, 0, 0) >= 0 &&
+            compileNode(&forward, root) &&
+            emit(&forward, RX_SAVE, 1, 0) >= 0 &&
+            emit(&forward, RX_MATCH, 0, 0) >= 0 &&
+            compileNode(&reverse, root) &&
+            emit(&reverse, RX_MATCH, 0, 0) >= 0;
+        if (!ok) fail(&parser, "pattern too large");
+    }
+
+    if (parser.error == NULL) {
+        rx = calloc(1, sizeof(rx_t));
+        rx->code = forward.code;
+        rx->length = forward.length;
+        rx->groups = parser.groups;
+        rx->ncap = (parser.groups + 1) * 2;
+        rx->sets = parser.sets;
+        rx->setCount = parser.setCount;
+        rx->anchored = startsAnchored(&parser, root);
+        if (!rx->anchored) collectPrefix(&parser, root, rx);
+
+        rx->useDfa = true;
+        for (int pc = 0; pc < forward.length; pc++) {
+            if (forward.code[pc].op == RX_WORDB || forward.code[pc].op == RX_NWORDB) {
+                rx->useDfa = false;
+            }
+        }
+
+        buildClasses(rx);
+        dfaInit(&rx->forward, forward.code, forward.length,
+            rx->anchored ? RX_ANCHORED_PC : 0, false, rx->classCount);
+        dfaInit(&rx->reverse, reverse.code, reverse.length, 0, true, rx->classCount);
+
+        for (int i = 0; i < 2; i++) {
+            rx->lists[i].pcs = malloc(rx->length * sizeof(int));
+            rx->lists[i].caps = malloc(rx->length * rx->ncap * sizeof(int));
+        }
+        rx->seen = calloc(rx->length, sizeof(uint32_t));
+        rx->stack = malloc((rx->length * 2 + 2) * sizeof(frame_t));
+        rx->work = malloc(rx->ncap * sizeof(int));
+        rx->result = malloc(rx->ncap * sizeof(int));
+        rx->blank = malloc(rx->ncap * sizeof(int));
+        for (int i = 0; i < rx->ncap; i++) rx->blank[i] = -1;
+    }
+    else {
+        *error = parser.error;
+        free(forward.code);
+        free(reverse.code);
+        free(parser.sets);
+    }
+
+    free(parser.nodes);
+    return rx;
+}
+
+void rx_free(rx_t *rx)
+{
+    if (rx == NULL) return;
+
+    dfaFree(&rx->forward);
+    free(rx->reverse.code);
+    dfaFree(&rx->reverse);
+
+    for (int i = 0; i < 2; i++) {
+        free(rx->lists[i].pcs);
+        free(rx->lists[i].caps);
+    }
+    free(rx->code);
+    free(rx->sets);
+    free(rx->seen);
+    free(rx->stack);
+    free(rx->work);
+    free(rx->result);
+    free(rx->blank);
+    free(rx);
+}
+
+int rx_groups(rx_t *rx)
+{
+    return rx->groups;
+}
+
+bool rx_search(rx_t *rx, const char *s, int n, int from, int *caps, bool groups)
+{
+    if (from > n || (rx->anchored && from > 0)) return false;
+
+    if (rx->prefixLength > 0) {
+        const char *found = scan_find(s + from, n - from, rx->prefix, rx->prefixLength, false);
+        if (found == NULL) return false;
+        from = (int)(found - s);
+    }
+
+    int start = from, end = n, pc = 0;
+
+    if (rx->useDfa) {
+        int result = dfaForward(rx, s, n, from, &end);
+        if (result == 0) return false;
+        if (result > 0) result = dfaReverse(rx, s, n, from, end, &start);
+
+        if (result > 0 && (!groups || rx->groups == 0)) {
+            caps[0] = start;
+            caps[1] = end;
+            return true;
+        }
+
+        if (result > 0) {
+            pc = RX_ANCHORED_PC;
+        }
+        else {
+            // Out of states, start over with an empty cache next time.
+            dfaReset(&rx->forward, rx->classCount);
+            dfaReset(&rx->reverse, rx->classCount);
+            start = from;
+            end = n;
+        }
+    }
+
+    if (!pike(rx, s, n, start, end, pc, rx->result)) return false;
+
+    memcpy(caps, rx->result, (groups ? rx->ncap : 2) * sizeof(int));
+    return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "common.h"
+
+#define RX_GROUPS_MAX   64
+
+typedef struct _rx rx_t;
+
+// Compiles (pattern), on a syntax error returns NULL and points
+// (error) at a message.
+rx_t *rx_compile(const char *pattern, int length, const char **error);
+void rx_free(rx_t *rx);
+
+// Number of capture groups, the whole match not included.
+int rx_groups(rx_t *rx);
+
+// Finds the leftmost match in (s) that starts at or after (from).
+// (caps) receives start/end offset pairs, the whole match first and
+// then every group when (groups) is set, -1 for groups that did not
+// take part.
+bool rx_search(rx_t *rx, const char *s, int n, int from, int *caps, bool groups);
@@ -0,0 +1,231 @@
+#include <ctype.h>
+#include <string.h>
+
+#include "strscan.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    const char *name;
+    const char *(*byte)(const char *s, size_t n, char c, bool ignorecase);
+    const char *(*find)(const char *s, size_t n, const char *p, size_t m, bool ignorecase);
+    void (*lower)(char *dest, const char *src, size_t n);
+    void (*upper)(char *dest, const char *src, size_t n);
+} scanner_t;
+
+static inline char fold(char c)
+{
+    return (char)tolower((unsigned char)c);
+}
+
+static inline bool matchAt(const char *s, const char *p, size_t m, bool ignorecase)
+{
+    if (!ignorecase) return memcmp(s, p, m) == 0;
+
+    for (size_t i = 0; i < m; i++) {
+        if (fold(s[i]) != fold(p[i])) return false;
+    }
+    return true;
+}
+
+static const char *scalar_byte(const char *s, size_t n, char c, bool ignorecase)
+{
+    if (!ignorecase) return memchr(s, c, n);
+
+    c = fold(c);
+    for (size_t i = 0; i < n; i++) {
+        if (fold(s[i]) == c) return s + i;
+    }
+    return NULL;
+}
+
+static const char *scalar_find(const char *s, size_t n, const char *p, size_t m, bool ignorecase)
+{
+    if (m > n) return NULL;
+
+    char first = ignorecase ? fold(p[0]) : p[0];
+    for (size_t i = 0; i + m <= n; i++) {
+        char c = ignorecase ? fold(s[i]) : s[i];
+        if (c == first && matchAt(s + i + 1, p + 1, m - 1, ignorecase)) return s + i;
+    }
+    return NULL;
+}
+
+static void scalar_lower(char *dest, const char *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) dest[i] = fold(src[i]);
+}
+
+static void scalar_upper(char *dest, const char *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) dest[i] = (char)toupper((unsigned char)src[i]);
+}
+
+static const scanner_t scalarScanner = {
+    "scalar", scalar_byte, scalar_find, scalar_lower, scalar_upper
+};
+
+#ifdef SCAN_X86
+// Each width gets the same few primitives, the kernels below are
+// written once against them. (fold) lowers ASCII letters, as tolower()
+// does in the C locale.
+#define SSE2_FN     __attribute__((target("sse2"))) static inline
+#define AVX2_FN     __attribute__((target("avx2"))) static inline
+
+SSE2_FN __m128i sse2_load(const char *p) { return _mm_loadu_si128((const __m128i *)p); }
+SSE2_FN void sse2_store(char *p, __m128i v) { _mm_storeu_si128((__m128i *)p, v); }
+SSE2_FN __m128i sse2_set1(char c) { return _mm_set1_epi8(c); }
+SSE2_FN uint32_t sse2_eq(__m128i a, __m128i b) { return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)); }
+
+SSE2_FN __m128i sse2_shift(__m128i v, char lo, char hi, char delta)
+{
+    __m128i inside = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+    return _mm_add_epi8(v, _mm_and_si128(inside, _mm_set1_epi8(delta)));
+}
+
+AVX2_FN __m256i avx2_load(const char *p) { return _mm256_loadu_si256((const __m256i *)p); }
+AVX2_FN void avx2_store(char *p, __m256i v) { _mm256_storeu_si256((__m256i *)p, v); }
+AVX2_FN __m256i avx2_set1(char c) { return _mm256_set1_epi8(c); }
+AVX2_FN uint32_t avx2_eq(__m256i a, __m256i b) { return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)); }
+
+AVX2_FN __m256i avx2_shift(__m256i v, char lo, char hi, char delta)
+{
+    __m256i inside = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+    return _mm256_add_epi8(v, _mm256_and_si256(inside, _mm256_set1_epi8(delta)));
+}
+
+#define SCAN_KERNELS(isa, V, W) \
+    __attribute__((target(#isa))) \
+    static const char *isa##_byte(const char *s, size_t n, char c, bool ignorecase) \
+    { \
+        V needle = isa##_set1(ignorecase ? fold(c) : c); \
+        size_t i = 0; \
+        for (; i + W <= n; i += W) { \
+            V block = isa##_load(s + i); \
+            if (ignorecase) block = isa##_shift(block, 'A', 'Z', 0x20); \
+            uint32_t mask = isa##_eq(block, needle); \
+            if (mask != 0) return s + i + __builtin_ctz(mask); \
+        } \
+        return scalar_byte(s + i, n - i, c, ignorecase); \
+    } \
+    \
+    /* Candidates must match the first and the last byte of the needle, \
+       W positions are tested at once and only hits are compared. */ \
+    __attribute__((target(#isa))) \
+    static const char *isa##_find(const char *s, size_t n, const char *p, size_t m, bool ignorecase) \
+    { \
+        V first = isa##_set1(ignorecase ? fold(p[0]) : p[0]); \
+        V last = isa##_set1(ignorecase ? fold(p[m - 1]) : p[m - 1]); \
+        size_t i = 0; \
+        for (; i + m - 1 + W <= n; i += W) { \
+            V a = isa##_load(s + i); \
+            V b = isa##_load(s + i + m - 1); \
+            if (ignorecase) { \
+                a = isa##_shift(a, 'A', 'Z', 0x20); \
+                b = isa##_shift(b, 'A', 'Z', 0x20); \
+            } \
+            uint32_t mask = isa##_eq(a, first) & isa##_eq(b, last); \
+            while (mask != 0) { \
+                size_t k = (size_t)__builtin_ctz(mask); \
+                if (matchAt(s + i + k + 1, p + 1, m - 2, ignorecase)) return s + i + k; \
+                mask &= mask - 1; \
+            } \
+        } \
+        return scalar_find(s + i, n - i, p, m, ignorecase); \
+    } \
+    \
+    __attribute__((target(#isa))) \
+    static void isa##_lower(char *dest, const char *src, size_t n) \
+    { \
+        size_t i = 0; \
+        for (; i + W <= n; i += W) \
+            isa##_store(dest + i, isa##_shift(isa##_load(src + i), 'A', 'Z', 0x20)); \
+        scalar_lower(dest + i, src + i, n - i); \
+    } \
+    \
+    __attribute__((target(#isa))) \
+    static void isa##_upper(char *dest, const char *src, size_t n) \
+    { \
+        size_t i = 0; \
+        for (; i + W <= n; i += W) \
+            isa##_store(dest + i, isa##_shift(isa##_load(src + i), 'a', 'z', -0x20)); \
+        scalar_upper(dest + i, src + i, n - i); \
+    } \
+    \
+    static const scanner_t isa##Scanner = { \
+        #isa, isa##_byte, isa##_find, isa##_lower, isa##_upper \
+    };
+
+SCAN_KERNELS(sse2, __m128i, 16)
+SCAN_KERNELS(avx2, __m256i, 32)
+#endif
+
+static const scanner_t *scanner = &scalarScanner;
+
+#ifdef SCAN_X86
+// Runs once as the program loads, before any VM or thread exists, so
+// VMs on other threads only ever read (scanner).
+__attribute__((constructor))
+static void selectScanner(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scanner = &avx2Scanner;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        scanner = &sse2Scanner;
+    }
+}
+#endif
+
+const char *scan_name(void)
+{
+    return scanner->name;
+}
+
+const char *scan_byte(const char *s, size_t n, char c, bool ignorecase)
+{
+    return scanner->byte(s, n, c, ignorecase);
+}
+
+const char *scan_find(const char *s, size_t n, const char *p, size_t m, bool ignorecase)
+{
+    if (m == 0) return s;
+    if (m > n) return NULL;
+    if (m == 1) return scanner->byte(s, n, p[0], ignorecase);
+
+    return scanner->find(s, n, p, m, ignorecase);
+}
+
+int scan_compare(const char *a, size_t an, const char *b, size_t bn, bool ignorecase)
+{
+    size_t n = an < bn ? an : bn;
+    int result = 0;
+
+    if (!ignorecase) {
+        result = memcmp(a, b, n);
+    }
+    else {
+        for (size_t i = 0; i < n && result == 0; i++) {
+            result = (unsigned char)fold(a[i]) - (unsigned char)fold(b[i]);
+        }
+    }
+
+    if (result == 0) result = (an > bn) - (an < bn);
+    return (result > 0) - (result < 0);
+}
+
+void scan_lower(char *dest, const char *src, size_t n)
+{
+    scanner->lower(dest, src, n);
+}
+
+void scan_upper(char *dest, const char *src, size_t n)
+{
+    scanner->upper(dest, src, n);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "common.h"
+
+// Byte scanning kernels for the string module, the widest set the CPU
+// supports is picked once at startup. With (ignorecase) letters compare
+// the way hash_string() folds them, through tolower().
+const char *scan_name(void);
+
+const char *scan_byte(const char *s, size_t n, char c, bool ignorecase);
+const char *scan_find(const char *s, size_t n, const char *p, size_t m, bool ignorecase);
+int scan_compare(const char *a, size_t an, const char *b, size_t bn, bool ignorecase);
+void scan_lower(char *dest, const char *src, size_t n);
+void scan_upper(char *dest, const char *src, size_t n);
@@ -1,7 +1,10 @@
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 
 #include "table.h"
 #include "object.h"
+#include "gc.h"
 
 #define TABLE_MAX_LOAD  0.75
 
@@ -12,15 +15,27 @@ void tab_init(tab_t *table)
     table->entries = NULL;
 }
 
-void tab_free(tab_t *table)
+void tab_free(gc_t *gc, tab_t *table)
 {
-    free(table->entries);
+    gc_resize(gc, GC_TABLES, table->entries, table->capacity * sizeof(ent_t), 0);
     tab_init(table);
 }
 
+// Keys match by pointer first, runtime strings that are not interned
+// fall back to length, hash and contents.
+static inline bool keysEqual(str_t *a, str_t *b, uint32_t hash)
+{
+    if (a == b) return true;
+    if (a->isInterned && b->isInterned) return false;
+
+    return a->length == b->length && a->hash == hash &&
+        memcmp(a->chars, b->chars, a->length) == 0;
+}
+
 static ent_t *findEntry(ent_t *entries, int capacity, str_t *key)
 {
-    uint32_t index = key->hash % capacity;
+    uint32_t hash = str_hash(key);
+    uint32_t index = hash % capacity;
     ent_t *tombstone = NULL;
 
     for (;;) {
@@ -36,7 +51,7 @@ static ent_t *findEntry(ent_t *entries, int capacity, str_t *key)
                 if (tombstone == NULL) tombstone = entry;
             }
         }
-        else if (entry->key == key) {
+        else if (keysEqual(entry->key, key, hash)) {
             // We found the key.                           
             return entry;
         }
@@ -56,9 +71,9 @@ bool tab_get(tab_t *table, str_t *key, val_t *value)
     return true;
 }
 
-static void adjustCapacity(tab_t *table, int capacity)
+static void adjustCapacity(gc_t *gc, tab_t *table, int capacity)
 {
-    ent_t *entries = malloc(capacity * sizeof(ent_t));
+    ent_t *entries = gc_resize(gc, GC_TABLES, NULL, 0, capacity * sizeof(ent_t));
 
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
@@ -76,20 +91,23 @@ static void adjustCapacity(tab_t *table, int capacity)
         table->count++;
     }
 
-    free(table->entries);
+    gc_resize(gc, GC_TABLES, table->entries, table->capacity * sizeof(ent_t), 0);
     table->entries = entries;
     table->capacity = capacity;
 }
 
-bool tab_set(tab_t *table, str_t *key, val_t value)
+bool tab_set(gc_t *gc, tab_t *table, str_t *key, val_t value)
 {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAP(table->capacity);
-        adjustCapacity(table, capacity);
+        adjustCapacity(gc, table, capacity);
     }
 
     ent_t *entry = findEntry(table->entries, table->capacity, key);
 
+    // A view stored as a key must not pin its parent.
+    str_own(key);
+
     bool isNewKey = entry->key == NULL;
     if (isNewKey && IS_NULL(entry->value)) table->count++;
 
@@ -113,17 +131,28 @@ bool tab_remove(tab_t *table, str_t *key)
     return true;
 }
 
-void tab_add(tab_t *from, tab_t *to)
+void tab_add(gc_t *gc, tab_t *from, tab_t *to)
 {
     for (int i = 0; i < from->capacity; i++) {
         ent_t *entry = &from->entries[i];
         if (entry->key != NULL) {
-            tab_set(to, entry->key, entry->value);
+            tab_set(gc, to, entry->key, entry->value);
         }
     }
 }
 
-str_t *tab_findstr(tab_t *table, const char *chars, int length, uint32_t hash)
+// Compares (chars) folded to lowercase against an interned key, so
+// identifiers can be looked up straight from the source text.
+static bool equalsFolded(const char *key, const char *chars, int length)
+{
+    for (int i = 0; i < length; i++) {
+        if (key[i] != (char)tolower(chars[i])) return false;
+    }
+    return true;
+}
+
+str_t *tab_findstr(tab_t *table, const char *chars, int length, uint32_t hash,
+    bool ignorecase)
 {
     if (table->count == 0) return NULL;
 
@@ -137,7 +166,9 @@ str_t *tab_findstr(tab_t *table, const char *chars, int length, uint32_t hash)
             // Stop if we find an empty non-tombstone entry.                 
             if (IS_NULL(entry->value)) return NULL;
         }
-        else if (key->length == length && key->hash == hash) {
+        else if (key->length == length && key->hash == hash && (ignorecase
+            ? equalsFolded(key->chars, chars, length)
+            : memcmp(key->chars, chars, length) == 0)) {
             // We found it.                                                  
             return key;
         }
@@ -15,9 +15,10 @@ typedef struct {
 } tab_t;
 
 void tab_init(tab_t *table);
-void tab_free(tab_t *table);
+void tab_free(gc_t *gc, tab_t *table);
 bool tab_get(tab_t *table, str_t *key, val_t *value);
-bool tab_set(tab_t *table, str_t *key, val_t value);
+bool tab_set(gc_t *gc, tab_t *table, str_t *key, val_t value);
 bool tab_remove(tab_t *table, str_t *key);
-void tab_add(tab_t *from, tab_t *to);
-str_t *tab_findstr(tab_t *table, const char *chars, int length, uint32_t hash);
+void tab_add(gc_t *gc, tab_t *from, tab_t *to);
+str_t *tab_findstr(tab_t *table, const char *chars, int length, uint32_t hash,
+    bool ignorecase);
@@ -2,6 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "common.h"
 
@@ -17,6 +25,13 @@ uint32_t hash_string(const char *chars, int length, bool ignorecase)
     return hash;
 }
 
+double wall_clock(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 char *read_file(const char *path, size_t *size)
 {
     FILE *file = NULL;
@@ -55,3 +70,65 @@ _clean:
     if (buffer != NULL) free(buffer);
     return NULL;
 }
+
+#ifndef _WIN32
+// Bytes reserved for a mapping of (size), at least one past the end.
+static size_t mapSpan(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size / page + 1) * page;
+}
+
+// Maps a regular file read-only, NUL terminated like read_file(). The
+// span is reserved as zero pages first and the file mapped over its
+// front, so even a file filling its last page is followed by a zero.
+// Returns NULL without a message, the caller falls back to reading.
+char *map_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t fileSize = (size_t)st.st_size;
+    size_t span = mapSpan(fileSize);
+
+    char *base = mmap(NULL, span, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(base, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, span);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+    madvise(base, fileSize, MADV_SEQUENTIAL);
+
+    if (size) *size = fileSize;
+    return base;
+}
+
+void unmap_file(char *buffer, size_t size)
+{
+    munmap(buffer, mapSpan(size));
+}
+#else
+char *map_file(const char *path, size_t *size)
+{
+    (void)path; (void)size;
+    return NULL;
+}
+
+void unmap_file(char *buffer, size_t size)
+{
+    (void)buffer; (void)size;
+}
+#endif
@@ -3,6 +3,7 @@
 
 #include "value.h"
 #include "object.h"
+#include "gc.h"
 
 const char *val_typeof(val_t value)
 {
@@ -14,6 +15,8 @@ const char *val_typeof(val_t value)
             return "bool";
         case VT_NUM:
             return "num";
+        case VT_INT:
+            return "int";
         case VT_CFN:
             return "fn";
         case VT_PTR:
@@ -23,26 +26,32 @@ const char *val_typeof(val_t value)
     }
 }
 
-void val_print(val_t value)
+void val_print(out_t *out, val_t value)
 {
+    char buffer[FMT_NUM_MAX];
+
     switch (AS_TYPE(value)) {
         case VT_NULL:
-            printf("null");
+            out_write(out, "null", 4);
             break;
         case VT_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            if (AS_BOOL(value)) out_write(out, "true", 4);
+            else out_write(out, "false", 5);
             break;
         case VT_NUM:
-            printf("%.14g", AS_NUM(value));
+            out_num(out, AS_NUM(value));
+            break;
+        case VT_INT:
+            out_int(out, AS_INT(value));
             break;
         case VT_CFN:
-            printf("fn: %p", AS_CFN(value));
+            out_write(out, buffer, snprintf(buffer, sizeof(buffer), "fn: %p", (void *)AS_CFN(value)));
             break;
         case VT_PTR:
-            printf("ptr: %p", AS_PTR(value));
+            out_write(out, buffer, snprintf(buffer, sizeof(buffer), "ptr: %p", AS_PTR(value)));
             break;
         case VT_OBJ:
-            obj_print(AS_OBJ(value));
+            obj_print(out, AS_OBJ(value));
             break;
     }
 }
@@ -60,6 +69,7 @@ bool val_equal(val_t a, val_t b)
         case VT_NUM_NUM:
             return AS_NUM(a) == AS_NUM(b);
         case VT_OBJ_OBJ:
+            if (IS_STR(a) && IS_STR(b)) return str_equal(AS_STR(a), AS_STR(b));
             return AS_OBJ(a) == AS_OBJ(b);
         case VT_CFN_CFN:
             return AS_CFN(a) == AS_CFN(b);
@@ -69,6 +79,16 @@ bool val_equal(val_t a, val_t b)
             return (double)AS_BOOL(a) == AS_NUM(b);
         case VT_NUM_BOOL:
             return AS_NUM(a) == (double)AS_BOOL(b);
+        case VT_INT_INT:
+            return AS_INT(a) == AS_INT(b);
+        case VT_INT_NUM:
+            return (double)AS_INT(a) == AS_NUM(b);
+        case VT_NUM_INT:
+            return AS_NUM(a) == (double)AS_INT(b);
+        case VT_BOOL_INT:
+            return (int64_t)AS_BOOL(a) == AS_INT(b);
+        case VT_INT_BOOL:
+            return AS_INT(a) == (int64_t)AS_BOOL(b);
         default:
             return false;
     }
@@ -81,23 +101,26 @@ void arr_init(arr_t *array)
     array->values = NULL;
 }
 
-void arr_free(arr_t *array)
+void arr_free(gc_t *gc, arr_t *array)
 {
-    free(array->values);
+    gc_resize(gc, GC_CODE, array->values, array->capacity * sizeof(val_t), 0);
     arr_init(array);
 }
 
-int arr_add(arr_t *array, val_t value, bool allowdup)
+int arr_add(gc_t *gc, arr_t *array, val_t value, bool allowdup)
 {
     if (!allowdup) {
         for (int i = 0; i < array->count; i++)
-            if (val_equal(array->values[i], value))
+            if (AS_TYPE(array->values[i]) == AS_TYPE(value) &&
+                val_equal(array->values[i], value))
                 return i;
     }
 
     if (array->count >= array->capacity) {
-        array->capacity = GROW_CAP(array->capacity);
-        array->values = realloc(array->values, array->capacity * sizeof(val_t));
+        int capacity = GROW_CAP(array->capacity);
+        array->values = gc_resize(gc, GC_CODE, array->values,
+            array->capacity * sizeof(val_t), capacity * sizeof(val_t));
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
@@ -118,6 +141,8 @@ val_t cast_num(val_t value)
             return VAL_NUM((char)AS_BOOL(value));
         case VT_NUM:
             return value;
+        case VT_INT:
+            return VAL_NUM((double)AS_INT(value));
         case VT_OBJ:
             if (IS_STR(value))
                 return VAL_NUM(strtod(AS_CSTR(value), NULL));
@@ -1,17 +1,22 @@
 #pragma once
 
 #include "common.h"
+#include "output.h"
 
 typedef struct _obj obj_t;
 typedef struct _str str_t;
 typedef struct _fun fun_t;
 typedef struct _upv upv_t;
+typedef struct _clo clo_t;
 typedef struct _map map_t;
+typedef struct _ary ary_t;
+typedef struct _vec vec_t;
 
 typedef enum {
     VT_NULL_,
     VT_BOOL_,
     VT_NUM,
+    VT_INT,
     VT_OBJ,
     VT_CFN,
     VT_PTR_
@@ -23,29 +28,42 @@ typedef enum {
 typedef enum {
     OT_STR,
     OT_FUN,
+    OT_CLO,
     OT_UPV,
     OT_MAP,
+    OT_ARR,
+    OT_VEC,
 } otype_t;
 
 enum {
     VT_NULL_NULL    = CMB_BYTES(VT_NULL, VT_NULL),
     VT_NULL_BOOL    = CMB_BYTES(VT_NULL, VT_BOOL),
     VT_NULL_NUM     = CMB_BYTES(VT_NULL, VT_NUM),
+    VT_NULL_INT     = CMB_BYTES(VT_NULL, VT_INT),
     VT_NULL_OBJ     = CMB_BYTES(VT_NULL, VT_OBJ),
 
     VT_BOOL_NIL     = CMB_BYTES(VT_BOOL, VT_NULL),
     VT_BOOL_BOOL    = CMB_BYTES(VT_BOOL, VT_BOOL),
     VT_BOOL_NUM     = CMB_BYTES(VT_BOOL, VT_NUM),
+    VT_BOOL_INT     = CMB_BYTES(VT_BOOL, VT_INT),
     VT_BOOL_OBJ     = CMB_BYTES(VT_BOOL, VT_OBJ),
 
     VT_NUM_NIL      = CMB_BYTES(VT_NUM, VT_NULL),
     VT_NUM_BOOL     = CMB_BYTES(VT_NUM, VT_BOOL),
     VT_NUM_NUM      = CMB_BYTES(VT_NUM, VT_NUM),
+    VT_NUM_INT      = CMB_BYTES(VT_NUM, VT_INT),
     VT_NUM_OBJ      = CMB_BYTES(VT_NUM, VT_OBJ),
 
+    VT_INT_NIL      = CMB_BYTES(VT_INT, VT_NULL),
+    VT_INT_BOOL     = CMB_BYTES(VT_INT, VT_BOOL),
+    VT_INT_NUM      = CMB_BYTES(VT_INT, VT_NUM),
+    VT_INT_INT      = CMB_BYTES(VT_INT, VT_INT),
+    VT_INT_OBJ      = CMB_BYTES(VT_INT, VT_OBJ),
+
     VT_OBJ_NIL      = CMB_BYTES(VT_OBJ, VT_NULL),
     VT_OBJ_BOOL     = CMB_BYTES(VT_OBJ, VT_BOOL),
     VT_OBJ_NUM      = CMB_BYTES(VT_OBJ, VT_NUM),
+    VT_OBJ_INT      = CMB_BYTES(VT_OBJ, VT_INT),
     VT_OBJ_OBJ      = CMB_BYTES(VT_OBJ, VT_OBJ),
 
     VT_CFN_CFN      = CMB_BYTES(VT_CFN, VT_CFN),
@@ -57,6 +75,7 @@ struct _val {
     union {
         bool Bool : 1;
         double Num;
+        int64_t Int;
         cfn_t CFn;
         obj_t *Obj;
         void *Ptr;
@@ -77,12 +96,14 @@ static const val_t VAL_NULLPTR = { .type = VT_PTR, .Ptr = NULL };
 
 #define VAL_BOOL(b)     ((val_t){ .type = VT_BOOL, .Bool = (b) })
 #define VAL_NUM(n)      ((val_t){ .type = VT_NUM, .Num = (n) })
+#define VAL_INT(i)      ((val_t){ .type = VT_INT, .Int = (i) })
 #define VAL_OBJ(o)      ((val_t){ .type = VT_OBJ, .Obj = (obj_t *)(o) })
 #define VAL_CFN(c)      ((val_t){ .type = VT_CFN, .CFn = (c) })
 #define VAL_PTR(p)      ((val_t){ .type = VT_PTR, .Ptr = (void *)(p) })
 
 #define AS_BOOL(v)      ((v).Bool)
 #define AS_NUM(v)       ((v).Num)
+#define AS_INT(v)       ((v).Int)
 #define AS_OBJ(v)       ((v).Obj)
 #define AS_CFN(v)       ((v).CFn)
 #define AS_PTR(v)       ((v).Ptr)
@@ -90,20 +111,31 @@ static const val_t VAL_NULLPTR = { .type = VT_PTR, .Ptr = NULL };
 #define IS_NULL(v)      (AS_TYPE(v) == VT_NULL)
 #define IS_BOOL(v)      (AS_TYPE(v) == VT_BOOL)
 #define IS_NUM(v)       (AS_TYPE(v) == VT_NUM)
+#define IS_INT(v)       (AS_TYPE(v) == VT_INT)
+#define IS_NUMBER(v)    (IS_NUM(v) || IS_INT(v))
 #define IS_OBJ(v)       (AS_TYPE(v) == VT_OBJ)
 #define IS_CFN(v)       (AS_TYPE(v) == VT_CFN)
 #define IS_PTR(v)       (AS_TYPE(v) == VT_PTR)
 
-#define AS_INT(v)       ((int)AS_NUM(v))
-#define AS_INT64(v)     ((int64_t)AS_NUM(v))
 #define AS_RAW(v)       ((v).Raw)
 #define AS_TYPE(v)      ((v).type)
 
 #define IS_FALSEY(v)    (!(bool)AS_RAW(v))
 
-void val_print(val_t value);
+// Numeric value of an int or a number, as used by natives.
+static inline double val_tonum(val_t value)
+{
+    return IS_INT(value) ? (double)AS_INT(value) : AS_NUM(value);
+}
+
+static inline int64_t val_toint(val_t value)
+{
+    return IS_INT(value) ? AS_INT(value) : (int64_t)AS_NUM(value);
+}
+
+void val_print(out_t *out, val_t value);
 bool val_equal(val_t a, val_t b);
 
 void arr_init(arr_t *array);
-void arr_free(arr_t *array);
-int arr_add(arr_t *array, val_t value, bool allowdup);
+void arr_free(gc_t *gc, arr_t *array);
+int arr_add(gc_t *gc, arr_t *array, val_t value, bool allowdup);
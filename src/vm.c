@@ -9,6 +9,38 @@
 #include "code.h"
 #include "object.h"
 
+// Integer arithmetic, overflowing results are promoted to numbers.
+#if defined(__GNUC__) || defined(__clang__)
+#define ADD_OVERFLOW(a, b, r)   __builtin_add_overflow(a, b, r)
+#define SUB_OVERFLOW(a, b, r)   __builtin_sub_overflow(a, b, r)
+#define MUL_OVERFLOW(a, b, r)   __builtin_mul_overflow(a, b, r)
+#else
+static inline bool ADD_OVERFLOW(int64_t a, int64_t b, int64_t *r)
+{
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return true;
+    *r = a + b;
+    return false;
+}
+
+static inline bool SUB_OVERFLOW(int64_t a, int64_t b, int64_t *r)
+{
+    if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) return true;
+    *r = a - b;
+    return false;
+}
+
+static inline bool MUL_OVERFLOW(int64_t a, int64_t b, int64_t *r)
+{
+    if (a > 0 ? (b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a)
+              : (b > 0 ? a < INT64_MIN / b : (a != 0 && b < INT64_MAX / a))) return true;
+    *r = a * b;
+    return false;
+}
+#endif
+
+static void defineNative(vm_t *vm, const char *name, cfn_t function);
+static val_t uboundNative(vm_t *vm, int argc, val_t *args);
+
 static void resetStack(vm_t *vm)
 {
     vm->top = vm->stack;
@@ -19,6 +51,7 @@ static void runtimeError(vm_t *vm, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
+    out_flush(&vm->out);
     fprintf(stderr, "Error: ");
     vfprintf(stderr, format, args);
     va_end(args);
@@ -56,12 +89,18 @@ vm_t *vm_create()
     vm->gc = malloc(sizeof(gc_t));
     vm->globals = malloc(sizeof(tab_t));
     vm->strings = malloc(sizeof(tab_t));
+    vm->natives = calloc(1, sizeof(catalog_t));
 
     gc_init(vm->gc);
+    vm->gc->vm = vm;
+    gc_account(vm->gc, GC_STACKS, 0, sizeof(vm_t));
     tab_init(vm->globals);
     tab_init(vm->strings);
 
+    out_init(&vm->out, NULL, NULL, OUT_FLUSH_AUTO);
+
     resetStack(vm);
+    defineNative(vm, "UBound", uboundNative);
     return vm;
 }
 
@@ -69,10 +108,26 @@ void vm_close(vm_t *vm)
 {
     if (vm == NULL) return;
 
-    tab_free(vm->globals);
-    tab_free(vm->strings);
+    out_flush(&vm->out);
+    vm_profile_stop(vm, NULL);
+    vm_allocs_stop(vm, NULL);
+
+#ifdef AU3_PROFILE_OPCODES
+    opprof_dump(vm->opprof);
+    opprof_free(vm->opprof);
+#endif
+
+    tab_free(vm->gc, vm->globals);
+    tab_free(vm->gc, vm->strings);
     gc_free(vm->gc);
 
+    for (int i = 0; i < vm->sourceCount; i++) src_free(vm->sources[i]);
+    free(vm->sources);
+
+    for (int i = 0; i < vm->natives->count; i++) free(vm->natives->natives[i].name);
+    free(vm->natives->natives);
+    free(vm->natives);
+
     free(vm->globals);
     free(vm->strings);
     free(vm->gc);
@@ -90,6 +145,8 @@ vm_t *vm_clone(vm_t *from)
     vm->gc = from->gc;
     vm->globals = from->globals;
     vm->strings = from->strings;
+    vm->natives = from->natives;
+    out_init(&vm->out, from->out.write, from->out.user, from->out.mode);
 
     resetStack(vm);
     return vm;
@@ -106,7 +163,8 @@ static void defineNative(vm_t *vm, const char *name, cfn_t function)
     val_t gname = VAL_OBJ(str_copy(vm, name, (int)strlen(name), true));
 
     PUSH(gname);
-    tab_set(vm->globals, AS_STR(gname), native);
+    tab_set(vm->gc, vm->globals, AS_STR(gname), native);
+    vm_register(vm, name, native);
     POP();
 }
 
@@ -115,22 +173,328 @@ static val_t clockNative(vm_t *vm, int argc, val_t *args)
     return VAL_NUM((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void concatenate(vm_t *vm)
+// UBound($a) is the size of the first dimension, UBound($a, 0) the
+// number of dimensions and UBound($a, n) the size of the n-th one.
+static val_t uboundNative(vm_t *vm, int argc, val_t *args)
+{
+    if (argc >= 1 && IS_VEC(args[0])) return VAL_INT(AS_VEC(args[0])->count);
+    if (argc < 1 || !IS_ARR(args[0])) return VAL_INT(0);
+
+    ary_t *array = AS_ARR(args[0]);
+    int64_t dim = argc > 1 ? val_toint(args[1]) : 1;
+
+    if (dim == 0) return VAL_INT(array->dims);
+    if (dim < 0 || dim > array->dims) return VAL_INT(0);
+    return VAL_INT(array->sizes[dim - 1]);
+}
+
+// Long results become ropes, so a string built up in a loop is copied
+// once when it is flattened instead of on every step.
+static const char *concatenate(vm_t *vm)
+{
+    str_t *b = AS_STR(PEEK(0));
+    str_t *a = AS_STR(PEEK(1));
+    str_t *result;
+
+    int64_t total = (int64_t)a->length + b->length;
+    if (total > INT32_MAX) return "String too long.";
+
+    int length = (int)total;
+    if (length >= STR_ROPE_MIN) {
+        result = str_rope(vm, a, b);
+    }
+    else {
+        char *chars = malloc((length + 1) * sizeof(char));
+        str_write(a, chars);
+        str_write(b, chars + a->length);
+        chars[length] = '\0';
+        result = str_take(vm, chars, length);
+    }
+
+    POPN(2);
+    PUSH(VAL_OBJ(result));
+    return NULL;
+}
+
+// Joins (count) strings on top of the stack with a single copy. A long
+// first operand, as in $s = $s + ..., is not copied but becomes the
+// left side of a rope.
+static const char *concatenateN(vm_t *vm, int count)
 {
-    str_t *b = AS_STR(POP());
-    str_t *a = AS_STR(POP());
+    val_t *args = vm->top - count;
+    int64_t length = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (!IS_STR(args[i])) return "Operands must be strings.";
+        length += AS_STR(args[i])->length;
+    }
+
+    if (length > INT32_MAX) return "String too long.";
+
+    str_t *first = AS_STR(args[0]);
+    int skip = first->length >= STR_ROPE_MIN ? 1 : 0;
+    if (skip) length -= first->length;
+
+    char *chars = malloc((size_t)(length + 1) * sizeof(char));
+    char *dest = chars;
+    for (int i = skip; i < count; i++) {
+        str_write(AS_STR(args[i]), dest);
+        dest += AS_STR(args[i])->length;
+    }
+    *dest = '\0';
+
+    str_t *result = str_take(vm, chars, (int)length);
 
-    int length = a->length + b->length;
-    char *chars = malloc((length + 1) * sizeof(char));
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    if (skip) {
+        PUSH(VAL_OBJ(result));
+        result = str_rope(vm, first, result);
+        POP();
+    }
 
-    str_t *result = str_take(vm, chars, length);
+    POPN(count);
     PUSH(VAL_OBJ(result));
+    return NULL;
 }
 
-static bool prepareCall(vm_t *vm, fun_t *function, int argCount)
+// Integral numbers share the integer keys of a map.
+static bool toIndex(val_t key, int64_t *index)
+{
+    if (!IS_NUM(key)) return false;
+
+    double n = AS_NUM(key);
+    if (n < (double)INT64_MIN || n >= (double)INT64_MAX || n != (int64_t)n) {
+        return false;
+    }
+
+    *index = (int64_t)n;
+    return true;
+}
+
+// Other numbers index a map by their printed form.
+static str_t *numberKey(vm_t *vm, val_t key)
+{
+    char buffer[FMT_NUM_MAX];
+    int length = IS_INT(key) ? fmt_int(buffer, AS_INT(key)) : fmt_num(buffer, AS_NUM(key));
+
+    return str_new(vm, buffer, length);
+}
+
+static const char *mapGet(vm_t *vm, map_t *map, val_t key, val_t *value)
+{
+    int64_t index;
+    *value = VAL_NULL;
+
+    if (IS_INT(key)) {
+        hash_get(&map->hash, AS_INT(key), value);
+    }
+    else if (IS_STR(key)) {
+        tab_get(&map->table, AS_STR(key), value);
+    }
+    else if (toIndex(key, &index)) {
+        hash_get(&map->hash, index, value);
+    }
+    else if (IS_NUMBER(key)) {
+        tab_get(&map->table, numberKey(vm, key), value);
+    }
+    else {
+        return "Operands must be a number or string.";
+    }
+
+    return NULL;
+}
+
+static const char *mapSet(vm_t *vm, map_t *map, val_t key, val_t value)
+{
+    int64_t index;
+
+    gc_barrier(vm->gc, &map->obj, value);
+
+    if (IS_INT(key)) {
+        map_put_index(vm->gc, map, AS_INT(key), value);
+    }
+    else if (IS_STR(key)) {
+        gc_barrier(vm->gc, &map->obj, key);
+        map_put(vm->gc, map, AS_STR(key), value);
+    }
+    else if (toIndex(key, &index)) {
+        map_put_index(vm->gc, map, index, value);
+    }
+    else if (IS_NUMBER(key)) {
+        str_t *name = numberKey(vm, key);
+        gc_barrier(vm->gc, &map->obj, VAL_OBJ(name));
+        map_put(vm->gc, map, name, value);
+    }
+    else {
+        return "Operands must be a number or string.";
+    }
+
+    return NULL;
+}
+
+// Row-major offset of the first (dims) subscripts in (keys).
+static const char *arrayOffset(ary_t *array, val_t *keys, int *offset)
+{
+    int position = 0;
+
+    for (int d = 0; d < array->dims; d++) {
+        int64_t index;
+
+        if (IS_INT(keys[d])) {
+            index = AS_INT(keys[d]);
+        }
+        else if (!toIndex(keys[d], &index)) {
+            return "Array subscript must be an integer.";
+        }
+
+        if (index < 0 || index >= array->sizes[d]) {
+            return "Array index out of bounds.";
+        }
+
+        position = position * array->sizes[d] + (int)index;
+    }
+
+    *offset = position;
+    return NULL;
+}
+
+static const char *vectorOffset(vec_t *vector, val_t key, int *offset)
+{
+    int64_t index;
+
+    if (IS_INT(key)) {
+        index = AS_INT(key);
+    }
+    else if (!toIndex(key, &index)) {
+        return "Array subscript must be an integer.";
+    }
+
+    if (index < 0 || index >= vector->count) {
+        return "Array index out of bounds.";
+    }
+
+    *offset = (int)index;
+    return NULL;
+}
+
+// Walks (count) subscripts down nested maps and arrays, an array takes
+// as many subscripts as it has dimensions.
+static const char *getIndex(vm_t *vm, val_t *container, val_t *keys, int count)
+{
+    while (count > 0) {
+        const char *message;
+
+        if (IS_ARR(*container)) {
+            ary_t *array = AS_ARR(*container);
+            int offset;
+
+            if (count < array->dims) return "Too few subscripts for the array.";
+            if ((message = arrayOffset(array, keys, &offset)) != NULL) return message;
+
+            *container = array->values[offset];
+            keys += array->dims;
+            count -= array->dims;
+        }
+        else if (IS_MAP(*container)) {
+            if ((message = mapGet(vm, AS_MAP(*container), keys[0], container)) != NULL) {
+                return message;
+            }
+
+            keys++;
+            count--;
+        }
+        else if (IS_VEC(*container)) {
+            vec_t *vector = AS_VEC(*container);
+            int offset;
+
+            if ((message = vectorOffset(vector, keys[0], &offset)) != NULL) return message;
+
+            *container = VAL_NUM(vector->data[offset]);
+            keys++;
+            count--;
+        }
+        else {
+            return "Operands must be a map or an array.";
+        }
+    }
+
+    return NULL;
+}
+
+static const char *setIndex(vm_t *vm, val_t container, val_t *keys, int count, val_t value)
+{
+    for (;;) {
+        const char *message;
+
+        if (IS_ARR(container)) {
+            ary_t *array = AS_ARR(container);
+            int offset;
+
+            if (count < array->dims) return "Too few subscripts for the array.";
+            if ((message = arrayOffset(array, keys, &offset)) != NULL) return message;
+
+            if (count == array->dims) {
+                gc_barrier(vm->gc, &array->obj, value);
+                array->values[offset] = value;
+                return NULL;
+            }
+
+            container = array->values[offset];
+            keys += array->dims;
+            count -= array->dims;
+        }
+        else if (IS_MAP(container)) {
+            if (count == 1) return mapSet(vm, AS_MAP(container), keys[0], value);
+
+            if ((message = mapGet(vm, AS_MAP(container), keys[0], &container)) != NULL) {
+                return message;
+            }
+
+            keys++;
+            count--;
+        }
+        else if (IS_VEC(container) && count == 1) {
+            vec_t *vector = AS_VEC(container);
+            int offset;
+
+            if ((message = vectorOffset(vector, keys[0], &offset)) != NULL) return message;
+            if (!IS_NUMBER(value)) return "Vector elements must be numbers.";
+
+            vector->data[offset] = val_tonum(value);
+            return NULL;
+        }
+        else {
+            return "Operands must be a map or an array.";
+        }
+    }
+}
+
+// Array sizes are non-negative integers, (count) gets their product.
+static const char *arraySizes(val_t *values, int dims, int *sizes, int *count)
+{
+    int64_t total = 1;
+
+    for (int d = 0; d < dims; d++) {
+        int64_t size;
+
+        if (IS_INT(values[d])) {
+            size = AS_INT(values[d]);
+        }
+        else if (!toIndex(values[d], &size)) {
+            return "Array size must be an integer.";
+        }
+
+        if (size < 0) return "Array size must not be negative.";
+
+        total *= size;
+        if (total > ARY_COUNT_MAX || size > ARY_COUNT_MAX) return "Array is too large.";
+        sizes[d] = (int)size;
+    }
+
+    *count = (int)total;
+    return NULL;
+}
+
+static bool prepareCall(vm_t *vm, fun_t *function, clo_t *closure, int argCount)
 {
     if (argCount != function->arity) {
         runtimeError(vm, "Expected %d arguments but got %d.",
@@ -145,18 +509,28 @@ static bool prepareCall(vm_t *vm, fun_t *function, int argCount)
 
     frame_t *frame = &vm->frames[vm->frameCount++];
     frame->function = function;
+    frame->closure = closure;
     frame->ip = function->chunk.code;
 
     frame->slots = vm->top - argCount - 1;
     return true;
 }
 
+void vm_interrupt(vm_t *vm)
+{
+    INTERRUPT_SET(vm, INTERRUPT_HOST);
+}
+
 bool vm_call(vm_t *vm, val_t callee, int argCount)
 {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OT_FUN:
-                return prepareCall(vm, AS_FUN(callee), argCount);
+                return prepareCall(vm, AS_FUN(callee), NULL, argCount);
+
+            case OT_CLO:
+                return prepareCall(vm, AS_CLO(callee)->function,
+                    AS_CLO(callee), argCount);
 
             default:
                 // Non-callable object type.                   
@@ -175,6 +549,63 @@ bool vm_call(vm_t *vm, val_t callee, int argCount)
     return false;
 }
 
+static upv_t *captureUpvalue(vm_t *vm, val_t *local)
+{
+    upv_t *prev = NULL;
+    upv_t *upvalue = vm->openUpvalues;
+
+    while (upvalue != NULL && upvalue->location > local) {
+        prev = upvalue;
+        upvalue = upvalue->next;
+    }
+
+    if (upvalue != NULL && upvalue->location == local) return upvalue;
+
+    upv_t *created = upv_new(vm, local);
+    created->next = upvalue;
+
+    if (prev == NULL) {
+        vm->openUpvalues = created;
+    }
+    else {
+        prev->next = created;
+    }
+
+    return created;
+}
+
+static upv_t *inheritUpvalue(vm_t *vm, clo_t *closure, int index)
+{
+    if (!closure->onStack) return closure->upvalues[index];
+
+    val_t *slot = closure->slots[index];
+    if (slot >= vm->stack && slot < vm->stack + STACK_MAX) {
+        return captureUpvalue(vm, slot);
+    }
+
+    // Not on the stack, so the slot is the 'closed' field
+    // of an upvalue the enclosing closure inherited.
+    return (upv_t *)((char *)slot - offsetof(upv_t, closed));
+}
+
+static void closeUpvalues(vm_t *vm, val_t *last)
+{
+    while (vm->openUpvalues != NULL &&
+        vm->openUpvalues->location >= last) {
+        upv_t *upvalue = vm->openUpvalues;
+        gc_barrier(vm->gc, &upvalue->obj, *upvalue->location);
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm->openUpvalues = upvalue->next;
+    }
+}
+
+static inline val_t *upvalueSlot(clo_t *closure, int index)
+{
+    return closure->onStack ? closure->slots[index]
+        : closure->upvalues[index]->location;
+}
+
 int vm_execute(vm_t *vm)
 {
     register uint8_t *ip;
@@ -191,11 +622,22 @@ int vm_execute(vm_t *vm)
     stack = frame->slots; \
     consts = frame->function->chunk.constants.values
 
+// Opcodes that allocate keep the frame's ip current so an allocation
+// can be placed on its source line, see allocprof_alloc().
+#define ALLOC_SITE()    STORE_FRAME()
+
 #define STACK           (stack)
 #define CONSTS          (consts)
 
 #define PREV_BYTE()     (ip[-1])
 #define READ_BYTE()     *(ip++)
+
+// The byte dispatched on, counted first in a profiling build.
+#ifdef AU3_PROFILE_OPCODES
+#define READ_OP()       (opprof_count(vm->opprof, frame->function, ip), READ_BYTE())
+#else
+#define READ_OP()       READ_BYTE()
+#endif
 #define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 #define READ_CONST()    CONSTS[READ_BYTE()]
@@ -208,21 +650,41 @@ int vm_execute(vm_t *vm)
         return VM_RUNTIME_ERROR; \
     } while (0)
 
+// Backward jumps and calls are safepoints, a host may ask
+// a long running script to stop via vm_interrupt(), the
+// profiler's timer asks for a sample and the collector
+// for a collection or to stop a script over its limit.
+#define SAFEPOINT() \
+    if (vm->interrupt | vm->sample) { \
+        STORE_FRAME(); \
+        if (vm->sample) { \
+            vm->sample = 0; \
+            sampler_record(vm); \
+        } \
+        if (vm->interrupt) { \
+            int reasons = INTERRUPT_TAKE(vm); \
+            if ((reasons & INTERRUPT_GC) && !gc_safepoint(vm->gc)) { \
+                ERROR("Out of memory, the heap limit is %zu bytes.", vm->gc->limit); \
+            } \
+            if (reasons & INTERRUPT_HOST) ERROR("Script interrupted."); \
+        } \
+    }
+
 #ifdef _MSC_VER
 // Never try the 'computed goto' below on MSVC x86!
 #if 0 //defined(_M_IX86) || (defined(_WIN32) && !defined(_WIN64))
 #define INTERPRET       NEXT;
 #define CODE(x)         _OP_##x:
 #define CODE_ERR()      
-#define NEXT            do { size_t i = READ_BYTE() * sizeof(size_t); __asm {mov ecx, [i]} __asm {jmp _jtab[ecx]} } while (0)
-    static size_t _jtab[OPCODE_COUNT];
+#define NEXT            do { size_t i = READ_OP() * sizeof(size_t); __asm {mov ecx, [i]} __asm {jmp _jtab[ecx]} } while (0)
+    static size_t _jtab[MAX_OPCODES];
     if (_jtab[0] == 0) {
 #define _CODE(x) __asm { mov _jtab[TYPE _jtab * OP_##x], offset _OP_##x }
         OPCODES();
 #undef _CODE
     }
 #else
-#define INTERPRET       _loop: switch(READ_BYTE())
+#define INTERPRET       _loop: switch(READ_OP())
 #define CODE(x)         case OP_##x:
 #define CODE_ERR()      default:
 #define NEXT            goto _loop
@@ -231,9 +693,13 @@ int vm_execute(vm_t *vm)
 #define INTERPRET       NEXT;
 #define CODE(x)         _OP_##x:
 #define CODE_ERR()      _err:
-#define NEXT            goto *_jtab[READ_BYTE()]
+#define NEXT            goto *_jtab[READ_OP()]
 #define _CODE(x)        &&_OP_##x,
-    static void *_jtab[OPCODE_COUNT] = { OPCODES() };
+    static void *_jtab[MAX_OPCODES] = { OPCODES() };
+#endif
+
+#ifdef AU3_PROFILE_OPCODES
+    if (vm->opprof == NULL) vm->opprof = opprof_new();
 #endif
 
     LOAD_FRAME();
@@ -244,10 +710,10 @@ int vm_execute(vm_t *vm)
             int count = READ_BYTE();
 
             for (int i = count-1; i >= 0; i--) {
-                val_print(PEEK(i));
-                if (i > 0) printf("\t");
+                val_print(&vm->out, PEEK(i));
+                if (i > 0) out_char(&vm->out, '\t');
             }
-            printf("\n");
+            out_line(&vm->out);
 
             POPN(count);
             NEXT;
@@ -281,6 +747,7 @@ int vm_execute(vm_t *vm)
         CODE(CALL) {
             int argCount = READ_BYTE();
 
+            SAFEPOINT();
             STORE_FRAME();
             if (!vm_call(vm, PEEK(argCount), argCount)) {
                 return VM_RUNTIME_ERROR;
@@ -290,8 +757,48 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(TAILCALL) {
+            int argCount = READ_BYTE();
+
+            SAFEPOINT();
+            val_t callee = PEEK(argCount);
+
+            if (IS_FUN(callee) || IS_CLO(callee)) {
+                clo_t *closure = IS_CLO(callee) ? AS_CLO(callee) : NULL;
+                fun_t *function = closure ? closure->function : AS_FUN(callee);
+                if (argCount != function->arity) {
+                    ERROR("Expected %d arguments but got %d.",
+                        function->arity, argCount);
+                }
+
+                // Move the callee and its arguments down over the
+                // current frame's slots and restart it in place.
+                closeUpvalues(vm, frame->slots);
+                memmove(frame->slots, vm->top - argCount - 1,
+                    (argCount + 1) * sizeof(val_t));
+                vm->top = frame->slots + argCount + 1;
+
+                frame->function = function;
+                frame->closure = closure;
+                frame->ip = function->chunk.code;
+
+                LOAD_FRAME();
+                NEXT;
+            }
+
+            // Natives push their result, the following RET returns it.
+            STORE_FRAME();
+            if (!vm_call(vm, callee, argCount)) {
+                return VM_RUNTIME_ERROR;
+            }
+
+            LOAD_FRAME();
+            NEXT;
+        }
+
         CODE(RET) {
             val_t result = POP();
+            closeUpvalues(vm, frame->slots);
 
             if (--vm->frameCount == 0) {
                 POP();
@@ -306,17 +813,21 @@ int vm_execute(vm_t *vm)
         }
 
         CODE(NOT) {
-            PUSH(VAL_BOOL(IS_FALSEY(POP())));
+            PEEK(0) = VAL_BOOL(IS_FALSEY(PEEK(0)));
             NEXT;
         }
 
         CODE(NEG) {
             switch (AS_TYPE(PEEK(0))) {
                 case VT_BOOL:
-                    PUSH(VAL_NUM(-(char)AS_BOOL(POP())));
+                    PEEK(0) = VAL_NUM(-(char)AS_BOOL(PEEK(0)));
                     NEXT;
                 case VT_NUM:
-                    PUSH(VAL_NUM(-AS_NUM(POP())));
+                    PEEK(0) = VAL_NUM(-AS_NUM(PEEK(0)));
+                    NEXT;
+                case VT_INT:
+                    if (AS_INT(PEEK(0)) == INT64_MIN) PEEK(0) = VAL_NUM(-(double)INT64_MIN);
+                    else PEEK(0) = VAL_INT(-AS_INT(PEEK(0)));
                     NEXT;
             }
             ERROR("Operands must be a number/boolean.");
@@ -355,6 +866,22 @@ int vm_execute(vm_t *vm)
                     PUSH(VAL_BOOL(a < b));
                     NEXT;
                 }
+                case VT_INT_INT: {
+                    int64_t b = AS_INT(POP());
+                    int64_t a = AS_INT(POP());
+                    PUSH(VAL_BOOL(a < b));
+                    NEXT;
+                }
+                case VT_INT_NUM:
+                case VT_NUM_INT:
+                case VT_INT_BOOL:
+                case VT_BOOL_INT: {
+                    double b = IS_BOOL(PEEK(0)) ? AS_BOOL(PEEK(0)) : val_tonum(PEEK(0));
+                    double a = IS_BOOL(PEEK(1)) ? AS_BOOL(PEEK(1)) : val_tonum(PEEK(1));
+                    POPN(2);
+                    PUSH(VAL_BOOL(a < b));
+                    NEXT;
+                }
             }
             ERROR("Operands must be two numbers/booleans.");
         }
@@ -385,6 +912,22 @@ int vm_execute(vm_t *vm)
                     PUSH(VAL_BOOL(a <= b));
                     NEXT;
                 }
+                case VT_INT_INT: {
+                    int64_t b = AS_INT(POP());
+                    int64_t a = AS_INT(POP());
+                    PUSH(VAL_BOOL(a <= b));
+                    NEXT;
+                }
+                case VT_INT_NUM:
+                case VT_NUM_INT:
+                case VT_INT_BOOL:
+                case VT_BOOL_INT: {
+                    double b = IS_BOOL(PEEK(0)) ? AS_BOOL(PEEK(0)) : val_tonum(PEEK(0));
+                    double a = IS_BOOL(PEEK(1)) ? AS_BOOL(PEEK(1)) : val_tonum(PEEK(1));
+                    POPN(2);
+                    PUSH(VAL_BOOL(a <= b));
+                    NEXT;
+                }
             }
             ERROR("Operands must be two numbers/booleans.");
         }
@@ -415,15 +958,54 @@ int vm_execute(vm_t *vm)
                     PUSH(VAL_NUM(a + b));
                     NEXT;
                 }
+                case VT_INT_INT: {
+                    int64_t b = AS_INT(POP());
+                    int64_t a = AS_INT(POP());
+                    int64_t r;
+                    if (ADD_OVERFLOW(a, b, &r)) PUSH(VAL_NUM((double)a + (double)b));
+                    else PUSH(VAL_INT(r));
+                    NEXT;
+                }
+                case VT_INT_BOOL:
+                case VT_BOOL_INT: {
+                    int64_t b = IS_BOOL(PEEK(0)) ? AS_BOOL(PEEK(0)) : AS_INT(PEEK(0));
+                    int64_t a = IS_BOOL(PEEK(1)) ? AS_BOOL(PEEK(1)) : AS_INT(PEEK(1));
+                    int64_t r;
+                    POPN(2);
+                    if (ADD_OVERFLOW(a, b, &r)) PUSH(VAL_NUM((double)a + (double)b));
+                    else PUSH(VAL_INT(r));
+                    NEXT;
+                }
+                case VT_INT_NUM:
+                case VT_NUM_INT: {
+                    double b = val_tonum(POP());
+                    double a = val_tonum(POP());
+                    PUSH(VAL_NUM(a + b));
+                    NEXT;
+                }
                 case VT_OBJ_OBJ:
                     if (IS_STR(PEEK(0)) && IS_STR(PEEK(1))) {
-                        concatenate(vm);
+                        ALLOC_SITE();
+                        const char *message = concatenate(vm);
+                        if (message != NULL) {
+                            ERROR("%s", message);
+                        }
                         NEXT;
                     }
             }
             ERROR("Operands must be two numbers/booleans/strings.");
         }
 
+        CODE(CONCATN) {
+            uint8_t count = READ_BYTE();
+            ALLOC_SITE();
+            const char *message = concatenateN(vm, count);
+            if (message != NULL) {
+                ERROR("%s", message);
+            }
+            NEXT;
+        }
+
         CODE(SUB) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
@@ -450,6 +1032,31 @@ int vm_execute(vm_t *vm)
                     PUSH(VAL_NUM(a - b));
                     NEXT;
                 }
+                case VT_INT_INT: {
+                    int64_t b = AS_INT(POP());
+                    int64_t a = AS_INT(POP());
+                    int64_t r;
+                    if (SUB_OVERFLOW(a, b, &r)) PUSH(VAL_NUM((double)a - (double)b));
+                    else PUSH(VAL_INT(r));
+                    NEXT;
+                }
+                case VT_INT_BOOL:
+                case VT_BOOL_INT: {
+                    int64_t b = IS_BOOL(PEEK(0)) ? AS_BOOL(PEEK(0)) : AS_INT(PEEK(0));
+                    int64_t a = IS_BOOL(PEEK(1)) ? AS_BOOL(PEEK(1)) : AS_INT(PEEK(1));
+                    int64_t r;
+                    POPN(2);
+                    if (SUB_OVERFLOW(a, b, &r)) PUSH(VAL_NUM((double)a - (double)b));
+                    else PUSH(VAL_INT(r));
+                    NEXT;
+                }
+                case VT_INT_NUM:
+                case VT_NUM_INT: {
+                    double b = val_tonum(POP());
+                    double a = val_tonum(POP());
+                    PUSH(VAL_NUM(a - b));
+                    NEXT;
+                }
             }
             ERROR("Operands must be two numbers/booleans.");
         }
@@ -480,6 +1087,31 @@ int vm_execute(vm_t *vm)
                     PUSH(VAL_NUM(a * b));
                     NEXT;
                 }
+                case VT_INT_INT: {
+                    int64_t b = AS_INT(POP());
+                    int64_t a = AS_INT(POP());
+                    int64_t r;
+                    if (MUL_OVERFLOW(a, b, &r)) PUSH(VAL_NUM((double)a * (double)b));
+                    else PUSH(VAL_INT(r));
+                    NEXT;
+                }
+                case VT_INT_BOOL:
+                case VT_BOOL_INT: {
+                    int64_t b = IS_BOOL(PEEK(0)) ? AS_BOOL(PEEK(0)) : AS_INT(PEEK(0));
+                    int64_t a = IS_BOOL(PEEK(1)) ? AS_BOOL(PEEK(1)) : AS_INT(PEEK(1));
+                    int64_t r;
+                    POPN(2);
+                    if (MUL_OVERFLOW(a, b, &r)) PUSH(VAL_NUM((double)a * (double)b));
+                    else PUSH(VAL_INT(r));
+                    NEXT;
+                }
+                case VT_INT_NUM:
+                case VT_NUM_INT: {
+                    double b = val_tonum(POP());
+                    double a = val_tonum(POP());
+                    PUSH(VAL_NUM(a * b));
+                    NEXT;
+                }
             }
             ERROR("Operands must be two numbers/booleans.");
         }
@@ -510,13 +1142,32 @@ int vm_execute(vm_t *vm)
                     PUSH(VAL_NUM(a / b));
                     NEXT;
                 }
+                case VT_INT_INT: {
+                    int64_t b = AS_INT(POP());
+                    int64_t a = AS_INT(POP());
+                    // Exact quotients stay integers.
+                    if (b != 0 && !(a == INT64_MIN && b == -1) && a % b == 0) PUSH(VAL_INT(a / b));
+                    else PUSH(VAL_NUM((double)a / (double)b));
+                    NEXT;
+                }
+                case VT_INT_NUM:
+                case VT_NUM_INT:
+                case VT_INT_BOOL:
+                case VT_BOOL_INT: {
+                    double b = IS_BOOL(PEEK(0)) ? AS_BOOL(PEEK(0)) : val_tonum(PEEK(0));
+                    double a = IS_BOOL(PEEK(1)) ? AS_BOOL(PEEK(1)) : val_tonum(PEEK(1));
+                    POPN(2);
+                    PUSH(VAL_NUM(a / b));
+                    NEXT;
+                }
             }
             ERROR("Operands must be two numbers/booleans.");
         }
 
         CODE(DEF) {
             str_t *name = READ_STR();
-            tab_set(vm->globals, name, PEEK(0));
+            gc_barrier(vm->gc, NULL, PEEK(0));
+            tab_set(vm->gc, vm->globals, name, PEEK(0));
             POP();
             NEXT;
         }
@@ -533,7 +1184,8 @@ int vm_execute(vm_t *vm)
 
         CODE(GST) {
             str_t *name = READ_STR();
-            if (tab_set(vm->globals, name, PEEK(0))) {
+            gc_barrier(vm->gc, NULL, PEEK(0));
+            if (tab_set(vm->gc, vm->globals, name, PEEK(0))) {
                 tab_remove(vm->globals, name);
                 ERROR("Undefined variable '%s'.", name->chars);
             }
@@ -562,12 +1214,181 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(LOOP) {
+            uint16_t offset = READ_SHORT();
+            SAFEPOINT();
+            ip -= offset;
+            NEXT;
+        }
+
+        CODE(JMPTABLE) {
+            uint8_t *start = ip - 1;
+            double low = AS_NUM(READ_CONST());
+            uint16_t count = READ_SHORT();
+            uint16_t offset = READ_SHORT();
+            val_t subject = POP();
+
+            // Labels are int32, the subject is compared before the
+            // subtraction so it cannot overflow.
+            double index = -1;
+            if (IS_INT(subject)) {
+                int64_t value = AS_INT(subject);
+                if (value >= (int64_t)low && value < (int64_t)low + count) index = (double)(value - (int64_t)low);
+            }
+            else if (IS_NUM(subject)) index = AS_NUM(subject) - low;
+
+            if (index >= 0 && index < count && index == (int)index) {
+                uint8_t *entry = ip + (int)index * 2;
+                uint16_t target = (uint16_t)((entry[0] << 8) | entry[1]);
+                if (target != 0) offset = target;
+            }
+
+            if (offset != 0) ip = start - offset;
+            else ip += count * 2;
+            NEXT;
+        }
+
+        CODE(JMPSTR) {
+            uint8_t *start = ip - 1;
+            uint16_t capacity = READ_SHORT();
+            uint16_t offset = READ_SHORT();
+            val_t subject = POP();
+
+            if (IS_STR(subject)) {
+                str_t *key = AS_STR(subject);
+                uint32_t index = str_hash(key) & (capacity - 1);
+
+                for (;;) {
+                    uint8_t *entry = ip + index * 3;
+                    uint16_t target = (uint16_t)((entry[1] << 8) | entry[2]);
+                    if (target == 0) break;
+
+                    if (str_equal(AS_STR(CONSTS[entry[0]]), key)) {
+                        offset = target;
+                        break;
+                    }
+
+                    index = (index + 1) & (capacity - 1);
+                }
+            }
+
+            if (offset != 0) ip = start - offset;
+            else ip += capacity * 3;
+            NEXT;
+        }
+
+        CODE(FORPREP) {
+            val_t *slots = &STACK[READ_BYTE()];
+            uint16_t offset = READ_SHORT();
+
+            if (IS_INT(slots[0]) && IS_INT(slots[1]) && IS_INT(slots[2])) {
+                int64_t i = AS_INT(slots[0]);
+                int64_t limit = AS_INT(slots[1]);
+                if (AS_INT(slots[2]) == 0) ERROR("'For' loop step cannot be zero.");
+                if (AS_INT(slots[2]) > 0 ? i > limit : i < limit) ip += offset;
+                NEXT;
+            }
+
+            if (!IS_NUMBER(slots[0]) || !IS_NUMBER(slots[1]) || !IS_NUMBER(slots[2])) {
+                ERROR("'For' loop values must be numbers.");
+            }
+
+            // Mixed values, the whole loop counts in numbers.
+            for (int j = 0; j < 3; j++) slots[j] = VAL_NUM(val_tonum(slots[j]));
+
+            double i = AS_NUM(slots[0]);
+            double limit = AS_NUM(slots[1]);
+            if (AS_NUM(slots[2]) == 0) ERROR("'For' loop step cannot be zero.");
+            if (AS_NUM(slots[2]) > 0 ? i > limit : i < limit) ip += offset;
+            NEXT;
+        }
+
+        CODE(FORLOOP) {
+            val_t *slots = &STACK[READ_BYTE()];
+            uint16_t offset = READ_SHORT();
+
+            // Limit and step share their type since FORPREP.
+            if (IS_INT(slots[0]) && IS_INT(slots[2])) {
+                int64_t step = AS_INT(slots[2]);
+                int64_t limit = AS_INT(slots[1]);
+                int64_t i;
+
+                if (!ADD_OVERFLOW(AS_INT(slots[0]), step, &i) &&
+                    (step > 0 ? i <= limit : i >= limit)) {
+                    slots[0] = VAL_INT(i);
+                    SAFEPOINT();
+                    ip -= offset;
+                }
+                NEXT;
+            }
+
+            if (!IS_NUMBER(slots[0])) {
+                ERROR("'For' loop counter must be a number.");
+            }
+
+            double step = val_tonum(slots[2]);
+            double limit = val_tonum(slots[1]);
+            double i = val_tonum(slots[0]) + step;
+            slots[0] = VAL_NUM(i);
+
+            if (step > 0 ? i <= limit : i >= limit) {
+                SAFEPOINT();
+                ip -= offset;
+            }
+            NEXT;
+        }
+
+        CODE(ULD) {
+            PUSH(*upvalueSlot(frame->closure, READ_BYTE()));
+            NEXT;
+        }
+
+        CODE(UST) {
+            clo_t *closure = frame->closure;
+            int index = READ_BYTE();
+            if (!closure->onStack) gc_barrier(vm->gc, &closure->upvalues[index]->obj, PEEK(0));
+            *upvalueSlot(closure, index) = PEEK(0);
+            NEXT;
+        }
+
+        CODE(CLOSE) {
+            closeUpvalues(vm, vm->top - 1);
+            POP();
+            NEXT;
+        }
+
+        CODE(CLOSURE)
+        CODE(STKCLOSURE) {
+            bool onStack = PREV_BYTE() == OP_STKCLOSURE;
+            fun_t *function = AS_FUN(READ_CONST());
+
+            ALLOC_SITE();
+            clo_t *closure = clo_new(vm, function, onStack);
+            PUSH(VAL_OBJ(closure));
+
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+
+                if (onStack) {
+                    closure->slots[i] = isLocal ? &STACK[index]
+                        : upvalueSlot(frame->closure, index);
+                }
+                else {
+                    closure->upvalues[i] = isLocal ? captureUpvalue(vm, &STACK[index])
+                        : inheritUpvalue(vm, frame->closure, index);
+                }
+            }
+            NEXT;
+        }
+
         CODE(MAP) {
             uint8_t count = READ_BYTE();
+            ALLOC_SITE();
             map_t *map = map_new(vm);
 
-            for (val_t i = VAL_NUM(count - 1); AS_NUM(i) >= 0; AS_NUM(i) -= 1) {
-                hash_set(&map->hash, AS_RAW(i), PEEK((int)AS_NUM(i)));
+            for (int i = 0; i < count; i++) {
+                map_put_index(vm->gc, map, i, PEEK(count - 1 - i));
             }
 
             POPN(count);
@@ -575,6 +1396,56 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(ARRAY) {
+            uint8_t dims = READ_BYTE();
+            uint8_t count = READ_BYTE();
+            int sizes[ARY_DIMS_MAX];
+            int total = count;
+            ALLOC_SITE();
+
+            if (dims == 0) {
+                sizes[0] = count;
+            }
+            else {
+                const char *message = arraySizes(vm->top - count - dims, dims, sizes, &total);
+                if (message != NULL) {
+                    ERROR("%s", message);
+                }
+                if (count > total) {
+                    ERROR("Too many values to initialize the array.");
+                }
+            }
+
+            ary_t *array = ary_new(vm, dims == 0 ? 1 : dims, sizes);
+            for (int i = 0; i < count; i++) {
+                array->values[i] = PEEK(count - 1 - i);
+            }
+
+            POPN(count + dims);
+            PUSH(VAL_OBJ(array));
+            NEXT;
+        }
+
+        CODE(REDIM) {
+            uint8_t dims = READ_BYTE();
+            int sizes[ARY_DIMS_MAX];
+            int total;
+            ALLOC_SITE();
+
+            if (!IS_ARR(PEEK(dims))) {
+                ERROR("ReDim needs an array.");
+            }
+
+            const char *message = arraySizes(vm->top - dims, dims, sizes, &total);
+            if (message != NULL) {
+                ERROR("%s", message);
+            }
+
+            ary_resize(vm, AS_ARR(PEEK(dims)), dims, sizes);
+            POPN(dims + 1);
+            NEXT;
+        }
+
         CODE(GET) {
             if (IS_MAP(PEEK(0))) {
                 map_t *map = AS_MAP(PEEK(0));
@@ -595,7 +1466,8 @@ int vm_execute(vm_t *vm)
                 map_t *map = AS_MAP(PEEK(1));
                 str_t *name = READ_STR();
                 val_t value = PEEK(0);
-                tab_set(&map->table, name, value);
+                gc_barrier(vm->gc, &map->obj, value);
+                map_put(vm->gc, map, name, value);
                 POP();
                 POP();
                 PUSH(value);
@@ -607,67 +1479,55 @@ int vm_execute(vm_t *vm)
         }
 
         CODE(GETI) {
-            if (IS_MAP(PEEK(1))) {
-                if (IS_NUM(PEEK(0))) {
-                    map_t *map = AS_MAP(PEEK(1));
-                    uint64_t key = AS_RAW(PEEK(0));
-                    val_t value = VAL_NULL;
-                    hash_get(&map->hash, key, &value);
-
-                    POP();
-                    POP();
-                    PUSH(value);
-                }
-                else if (IS_STR(PEEK(0))) {
-                    map_t *map = AS_MAP(PEEK(1));
-                    str_t *key = AS_STR(PEEK(0));
-                    val_t value = VAL_NULL;
-                    tab_get(&map->table, key, &value);
-
-                    POP();
-                    POP();
-                    PUSH(value);
-                }
-                else {
-                    ERROR("Operands must be a number or string.");
+            uint8_t count = READ_BYTE();
+            val_t container = PEEK(count);
+            val_t key = PEEK(0);
+            ALLOC_SITE();
+
+            if (count == 1 && IS_ARR(container) && IS_INT(key)) {
+                ary_t *array = AS_ARR(container);
+                if (array->dims == 1 && (uint64_t)AS_INT(key) < (uint64_t)array->count) {
+                    POPN(2);
+                    PUSH(array->values[AS_INT(key)]);
+                    NEXT;
                 }
             }
-            else {
-                ERROR("Operands must be a map.");
+
+            const char *message = getIndex(vm, &container, vm->top - count, count);
+            if (message != NULL) {
+                ERROR("%s", message);
             }
+
+            POPN(count + 1);
+            PUSH(container);
             NEXT;
         }
 
         CODE(SETI) {
-            if (IS_MAP(PEEK(2))) {
-                if (IS_NUM(PEEK(1))) {
-                    map_t *map = AS_MAP(PEEK(2));
-                    uint64_t key = AS_RAW(PEEK(1));
-                    val_t value = POP();
-                    hash_set(&map->hash, key, value);
-
-                    POP();
-                    POP();
-                    PUSH(value);
-                }
-                else if (IS_STR(PEEK(1)))
-                {
-                    map_t *map = AS_MAP(PEEK(2));
-                    str_t *key = AS_STR(PEEK(1));
-                    val_t value = POP();
-                    tab_set(&map->table, key, value);
-
-                    POP();
-                    POP();
+            uint8_t count = READ_BYTE();
+            val_t container = PEEK(count + 1);
+            val_t key = PEEK(1);
+            val_t value = PEEK(0);
+            ALLOC_SITE();
+
+            if (count == 1 && IS_ARR(container) && IS_INT(key)) {
+                ary_t *array = AS_ARR(container);
+                if (array->dims == 1 && (uint64_t)AS_INT(key) < (uint64_t)array->count) {
+                    gc_barrier(vm->gc, &array->obj, value);
+                    array->values[AS_INT(key)] = value;
+                    POPN(3);
                     PUSH(value);
-                }
-                else {
-                    ERROR("Operands must be a number or string.");
+                    NEXT;
                 }
             }
-            else {
-                ERROR("Operands must be a map.");
+
+            const char *message = setIndex(vm, container, vm->top - count - 1, count, value);
+            if (message != NULL) {
+                ERROR("%s", message);
             }
+
+            POPN(count + 2);
+            PUSH(value);
             NEXT;
         }
 
@@ -679,34 +1539,75 @@ int vm_execute(vm_t *vm)
     return VM_OK;
 }
 
+// Functions point at their source for error messages, so it lives as
+// long as the VM does.
+void vm_add_source(vm_t *vm, src_t *source)
+{
+    if (vm->sourceCount == vm->sourceCapacity) {
+        vm->sourceCapacity = GROW_CAP(vm->sourceCapacity);
+        vm->sources = realloc(vm->sources, vm->sourceCapacity * sizeof(src_t *));
+    }
+
+    vm->sources[vm->sourceCount++] = source;
+}
+
+static int runScript(vm_t *vm, fun_t *function)
+{
+    val_t script = VAL_OBJ(function);
+
+    PUSH(script);
+    vm_call(vm, script, 0);
+
+    int result = vm_execute(vm);
+    out_flush(&vm->out);
+    return result;
+}
+
 int vm_dofile(vm_t *vm, const char *fname)
 {
     int result = VM_COMPILE_ERROR;
     src_t *source = src_new(fname);
 
     if (source != NULL) {
+        vm_add_source(vm, source);
+
         fun_t *function = compile(vm, source);
+        src_release(source);
         if (function == NULL) return VM_COMPILE_ERROR;
 
-        val_t script = VAL_OBJ(function);
-
-        PUSH(script);
-        vm_call(vm, script, 0);
-
-        result = vm_execute(vm);  
+        result = runScript(vm, function);
     }
 
-    src_free(source);
     return result;
 }
 
+// Runs a script compiled once by program_compile(), only its function
+// objects and constants are made in (vm).
+int vm_run(vm_t *vm, program_t *program)
+{
+    return runScript(vm, program_load(vm, program));
+}
+
+void vm_set_output(vm_t *vm, out_fn write, void *user, flush_t mode)
+{
+    out_flush(&vm->out);
+    out_init(&vm->out, write, user, mode);
+}
+
+void vm_flush(vm_t *vm)
+{
+    out_flush(&vm->out);
+}
+
 void set_global(vm_t *vm, const char *name, val_t value)
 {
     val_t global = VAL_OBJ(str_copy(vm, name, (int)strlen(name), true));
 
     PUSH(global);
     PUSH(value);
-    tab_set(vm->globals, AS_STR(global), value);
+    gc_barrier(vm->gc, NULL, value);
+    tab_set(vm->gc, vm->globals, AS_STR(global), value);
+    vm_register(vm, name, value);
     POP();
     POP();
 }
@@ -5,19 +5,52 @@
 #include "code.h"
 #include "gc.h"
 #include "table.h"
+#include "profile.h"
 
 typedef struct {
     fun_t *function;
+    clo_t *closure;
     uint8_t *ip;
     val_t *slots;
 } frame_t;
 
+// A native by the name it was registered under, "UBound" or
+// "math.abs".
+typedef struct {
+    cfn_t function;
+    char *name;
+} native_t;
+
+typedef struct {
+    native_t *natives;
+    int count;
+    int capacity;
+} catalog_t;
+
+// Why a safepoint stops, bits of vm->interrupt. The host may set them
+// from another thread, so they are set and taken atomically.
+#define INTERRUPT_HOST  1
+#define INTERRUPT_GC    2
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define INTERRUPT_SET(vm, reason)   _InterlockedOr((volatile long *)&(vm)->interrupt, (reason))
+#define INTERRUPT_TAKE(vm)          _InterlockedExchange((volatile long *)&(vm)->interrupt, 0)
+#else
+#define INTERRUPT_SET(vm, reason)   __atomic_fetch_or(&(vm)->interrupt, (reason), __ATOMIC_RELEASE)
+#define INTERRUPT_TAKE(vm)          __atomic_exchange_n(&(vm)->interrupt, 0, __ATOMIC_ACQ_REL)
+#endif
+
 struct _vm {
     val_t *top;
     val_t stack[STACK_MAX];
     frame_t frames[FRAMES_MAX];
     int frameCount;
 
+    volatile int interrupt;
+    volatile int sample;
+    sampler_t *sampler;
+
     int numRoots;
     obj_t *tempRoots[8];
     upv_t *openUpvalues;
@@ -25,6 +58,18 @@ struct _vm {
     gc_t  *gc;
     tab_t *strings;
     tab_t *globals;
+    catalog_t *natives;
+
+    out_t out;
+
+    // Sources of the functions this VM holds, freed with it.
+    src_t **sources;
+    int sourceCount;
+    int sourceCapacity;
+
+#ifdef AU3_PROFILE_OPCODES
+    opprof_t *opprof;
+#endif
 };
 
 vm_t *vm_create();
@@ -32,6 +77,19 @@ void vm_close(vm_t *vm);
 vm_t *vm_clone(vm_t *from);
 
 int vm_dofile(vm_t *vm, const char *fname);
+int vm_run(vm_t *vm, program_t *program);
+void vm_add_source(vm_t *vm, src_t *source);
+
+// Writes every object the globals reach to an image at (path). A VM
+// with the same libraries loaded starts from it with vm_restore(),
+// natives are matched by the name set_global() registered them under.
+bool vm_snapshot(vm_t *vm, const char *path);
+bool vm_restore(vm_t *vm, const char *path);
+void vm_register(vm_t *vm, const char *name, val_t value);
+
+// Sends print output to (write) instead of stdout, NULL restores it.
+void vm_set_output(vm_t *vm, out_fn write, void *user, flush_t mode);
+void vm_flush(vm_t *vm);
 
 void set_global(vm_t *vm, const char *name, val_t value);
 
@@ -40,3 +98,16 @@ val_t vm_pop(vm_t *vm);
 
 int vm_execute(vm_t *vm);
 bool vm_call(vm_t *vm, val_t callee, int argCount);
+void vm_interrupt(vm_t *vm);
+
+// Samples the running script (hz) times per second of CPU time until
+// vm_profile_stop() writes the collapsed stacks to (path). One VM of
+// the process can be profiled at a time.
+bool vm_profile_start(vm_t *vm, int hz);
+bool vm_profile_stop(vm_t *vm, const char *path);
+
+// Tracks allocations by source line until vm_allocs_stop(), a report
+// goes to (path) on vm_allocs_report() and when stopping.
+bool vm_allocs_start(vm_t *vm);
+bool vm_allocs_report(vm_t *vm, const char *path);
+bool vm_allocs_stop(vm_t *vm, const char *path);